@@ -0,0 +1,103 @@
+#include "Test.h"
+#include "Benchmark.h"
+#include "DeviceI2C.h"
+#include "AdafruitMotorDriver.h"
+#include "AdafruitServoDriver.h"
+#include "StepperMotor.h"
+
+// the PCA9685 API we want to time is protected, the drivers use it for us
+template<typename DeviceType>
+class BenchmarkPCA9685 : public PCA9685<DeviceType> {
+    public:
+        BenchmarkPCA9685 (PtrTo<DeviceType> device) : PCA9685<DeviceType> (device) {}
+
+        void setChannelPulse (byte channel, u2 on, u2 off) {
+            PCA9685<DeviceType>::setChannelPulse (channel, on, off);
+        }
+};
+
+template<typename DeviceType>
+void benchmarkDevice (const char* backend, PtrTo<DeviceType> device, uint iterations) {
+    uint i = 0;
+    Benchmark::run ("DeviceI2C::write+flush", backend, iterations, [&] () {
+        device
+            ->begin ()
+            ->write (0x0a, 0x00)
+            ->write (0x0b, 0x00)
+            ->write (0x0c, byte (++i))
+            ->write (0x0d, 0x00)
+            ->end ();
+    });
+}
+
+template<typename DeviceType>
+void benchmarkDrivers (const char* backend, PtrTo<DeviceType> motorDevice, PtrTo<DeviceType> servoDevice, uint iterations) {
+    uint i = 0;
+    PtrTo<BenchmarkPCA9685<DeviceType> > pca9685 = new BenchmarkPCA9685<DeviceType> (motorDevice);
+    Benchmark::run ("PCA9685::setChannelPulse", backend, iterations, [&] () {
+        pca9685->setChannelPulse (0, 0, (++i) & 0x0fff);
+    });
+
+    PtrTo<AdafruitMotorDriver<DeviceType> > motorDriver = new AdafruitMotorDriver<DeviceType> (motorDevice);
+    Benchmark::run ("AdafruitMotorDriver::runMotor", backend, iterations, [&] () {
+        motorDriver->runMotor (MotorId::MOTOR_0, ((++i) & 0x01) ? 0.5 : -0.5);
+    });
+
+    double speeds[MOTOR_COUNT];
+    Benchmark::run ("AdafruitMotorDriver::runMotors", backend, iterations, [&] () {
+        double speed = ((++i) & 0x01) ? 0.5 : -0.5;
+        for (uint motor = 0; motor < MOTOR_COUNT; ++motor) {
+            speeds[motor] = speed;
+        }
+        motorDriver->runMotors (speeds);
+    });
+
+    PtrTo<AdafruitServoDriver<DeviceType> > servoDriver = new AdafruitServoDriver<DeviceType> (servoDevice);
+    Benchmark::run ("AdafruitServoDriver::setPulseDuration", backend, iterations, [&] () {
+        servoDriver->setPulseDuration (ServoId::SERVO_00, ((++i) & 0x01) ? 1.0 : 2.0);
+    });
+
+    double pose[SERVO_COUNT];
+    Benchmark::run ("AdafruitServoDriver::setPulseDurations", backend, iterations, [&] () {
+        for (uint servo = 0; servo < SERVO_COUNT; ++servo) {
+            pose[servo] = ((++i) & 0x01) ? 1.0 : 2.0;
+        }
+        servoDriver->setPulseDurations (pose);
+    });
+
+    // one half-step at a time, back and forth, without any delay between steps. the plans are
+    // made once, so the benchmark is the step and not the planning
+    PtrTo<StepperMotor<AdafruitMotorDriver<DeviceType> > > stepper = StepperMotor<AdafruitMotorDriver<DeviceType> >::getHalfStepper (motorDriver, MotorId::MOTOR_0, MotorId::MOTOR_1, 1.8);
+    PtrTo<StepperMotionPlan> steps[] = { stepper->planSteps (1, 0), stepper->planSteps (-1, 0) };
+    Benchmark::run ("StepperMotor::step", backend, iterations, [&] () {
+        stepper->turn (steps[(++i) & 0x01]);
+    });
+}
+
+// the benchmarks each backend runs, in benchmarkDevice and benchmarkDrivers
+const uint BENCHMARK_COUNT = 7;
+
+TEST_CASE(BenchmarkNullDevice) {
+    PtrTo<NullDevice> device = new NullDevice ();
+    benchmarkDevice<NullDevice> ("null", device, 100000);
+    benchmarkDrivers<NullDevice> ("null", device, device, 100000);
+    TEST_TRUE(Benchmark::isComplete ("null", BENCHMARK_COUNT, 100000));
+}
+
+TEST_CASE(BenchmarkSimulatedBus) {
+    uint bus = Benchmark::addSimulatedBus (0, ADAFRUIT_MOTOR_DRIVER_DEFAULT_ADDRESS, ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS);
+    PtrToDeviceI2C motorDevice = new DeviceI2C (ADAFRUIT_MOTOR_DRIVER_DEFAULT_ADDRESS, bus);
+    PtrToDeviceI2C servoDevice = new DeviceI2C (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS, bus);
+    benchmarkDevice<DeviceI2C> ("simulated", motorDevice, 10000);
+    benchmarkDrivers<DeviceI2C> ("simulated", motorDevice, servoDevice, 10000);
+    TEST_TRUE(Benchmark::isComplete ("simulated", BENCHMARK_COUNT, 10000));
+}
+
+TEST_CASE(BenchmarkSimulatedBus400kHz) {
+    uint bus = Benchmark::addSimulatedBus (SIMULATED_BUS_FREQUENCY, ADAFRUIT_MOTOR_DRIVER_DEFAULT_ADDRESS, ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS);
+    PtrToDeviceI2C motorDevice = new DeviceI2C (ADAFRUIT_MOTOR_DRIVER_DEFAULT_ADDRESS, bus);
+    PtrToDeviceI2C servoDevice = new DeviceI2C (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS, bus);
+    benchmarkDevice<DeviceI2C> ("simulated-400kHz", motorDevice, 1000);
+    benchmarkDrivers<DeviceI2C> ("simulated-400kHz", motorDevice, servoDevice, 1000);
+    TEST_TRUE(Benchmark::isComplete ("simulated-400kHz", BENCHMARK_COUNT, 1000));
+}
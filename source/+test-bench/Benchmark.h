@@ -0,0 +1,96 @@
+#pragma once
+
+#include "SimulatedBusBackend.h"
+#include "NullDevice.h"
+
+#include <algorithm>
+#include <string.h>
+
+// a tiny harness for timing the control paths. each benchmark runs an operation a number of times,
+// timing every call, and prints one JSON object per line on stdout, so runs can be collected and
+// compared between releases:
+//   {"benchmark":"...","backend":"...","iterations":...,"opsPerSecond":...,"meanNanoseconds":...,
+//    "p50Nanoseconds":...,"p90Nanoseconds":...,"p99Nanoseconds":...,"maxNanoseconds":...}
+
+const uint BENCHMARK_WARMUP_ITERATIONS = 16;
+
+// the backends every benchmark runs against - a null device (no bus at all), the simulated bus
+// with no wire time (the cost of the software stack alone), and the simulated bus at 400 kHz
+const uint SIMULATED_BUS_FREQUENCY = 400000;
+
+// what a benchmark measured, in nanoseconds per call
+struct BenchmarkResult {
+    const char* benchmark;
+    const char* backend;
+    uint iterations;
+    uint64_t meanNanoseconds;
+    uint64_t p50Nanoseconds;
+    uint64_t p99Nanoseconds;
+    uint64_t maxNanoseconds;
+};
+
+class Benchmark {
+    public:
+        // every benchmark that has run, in order
+        static vector<BenchmarkResult>& getResults () {
+            static vector<BenchmarkResult> results;
+            return results;
+        }
+
+        // true if the given number of benchmarks ran on a backend, each timing every one of the
+        // iterations, with percentiles in order
+        static bool isComplete (const char* backend, uint count, uint iterations) {
+            uint found = 0;
+            for (vector<BenchmarkResult>::iterator iter = getResults ().begin (); iter != getResults ().end (); ++iter) {
+                if (strcmp (iter->backend, backend) == 0) {
+                    if ((iter->iterations != iterations) or (iter->p50Nanoseconds > iter->p99Nanoseconds) or (iter->p99Nanoseconds > iter->maxNanoseconds) or (iter->meanNanoseconds > iter->maxNanoseconds)) {
+                        return false;
+                    }
+                    ++found;
+                }
+            }
+            return found == count;
+        }
+
+        template<typename Operation>
+        static BenchmarkResult run (const char* benchmark, const char* backend, uint iterations, Operation operation) {
+            for (uint i = 0; i < BENCHMARK_WARMUP_ITERATIONS; ++i) {
+                operation ();
+            }
+
+            vector<uint64_t> samples (iterations);
+            uint64_t start = BusStatistics::now ();
+            for (uint i = 0; i < iterations; ++i) {
+                uint64_t callStart = BusStatistics::now ();
+                operation ();
+                samples[i] = BusStatistics::now () - callStart;
+            }
+            uint64_t elapsed = BusStatistics::now () - start;
+
+            sort (samples.begin (), samples.end ());
+            uint64_t total = 0;
+            for (uint i = 0; i < iterations; ++i) {
+                total += samples[i];
+            }
+            cout << "{\"benchmark\":\"" << benchmark << "\",\"backend\":\"" << backend << "\""
+                 << ",\"iterations\":" << iterations
+                 << ",\"opsPerSecond\":" << uint64_t ((iterations * 1.0e9) / max (elapsed, uint64_t (1)))
+                 << ",\"meanNanoseconds\":" << (total / iterations)
+                 << ",\"p50Nanoseconds\":" << samples[(iterations * 50) / 100]
+                 << ",\"p90Nanoseconds\":" << samples[(iterations * 90) / 100]
+                 << ",\"p99Nanoseconds\":" << samples[(iterations * 99) / 100]
+                 << ",\"maxNanoseconds\":" << samples[iterations - 1]
+                 << "}" << endl;
+
+            BenchmarkResult result = { benchmark, backend, iterations, total / iterations, samples[(iterations * 50) / 100], samples[(iterations * 99) / 100], samples[iterations - 1] };
+            getResults ().push_back (result);
+            return result;
+        }
+
+        // a new simulated bus, with a PCA9685 at each of the given addresses, returns the bus id
+        static uint addSimulatedBus (uint frequency, uint addressA, uint addressB) {
+            SimulatedBus simulated (addressA, frequency);
+            simulated.backend->addPCA9685 (addressB);
+            return simulated.id;
+        }
+};
@@ -1,6 +1,8 @@
 #include "Test.h"
 #include "AdafruitMotorDriver.h"
 #include "TestDevice.h"
+#include "NullDevice.h"
+#include "SimulatedBusBackend.h"
 #include "DeviceI2C.h"
 #include "Motor.h"
 #include "StepperMotor.h"
@@ -11,125 +13,44 @@ TEST_CASE(TestAdafruitMotorDriverMotor) {
     PtrToTestDevice device = new TestDevice (ADAFRUIT_MOTOR_DRIVER_DEFAULT_ADDRESS);
     device
         // constructor
+        ->expect (0x00, 0x31)
         ->expect (0xfa, 0x00)
         ->expect (0xfb, 0x00)
         ->expect (0xfc, 0x00)
-        ->expect (0xfd, 0x00)
+        ->expect (0xfd, 0x10)
         ->expect (0x01, 0x04)
-        ->expect (0x00, 0x01)
+        ->expect (0x00, 0x21)
         ->expect (0x00, 0x00)
         // which calls setPulseFrequency
         ->expect (0x00, (byte) 0x10)
         ->expect (0xfe, (byte) 0x05)
         ->expect (0x00, (byte) 0x00)
-        ->expect (0x00, (byte) 0x80)
-        // followed by a set of calls to stop all the motors
-        ->expect (0x2a, (byte) 0x00)
-        ->expect (0x2b, (byte) 0x00)
-        ->expect (0x2c, (byte) 0x00)
-        ->expect (0x2d, (byte) 0x10)
-        ->expect (0x2e, (byte) 0x00)
-        ->expect (0x2f, (byte) 0x00)
-        ->expect (0x30, (byte) 0x00)
-        ->expect (0x31, (byte) 0x10)
-        ->expect (0x26, (byte) 0x00)
-        ->expect (0x27, (byte) 0x00)
-        ->expect (0x28, (byte) 0x00)
-        ->expect (0x29, (byte) 0x10)
-
-        ->expect (0x36, (byte) 0x00)
-        ->expect (0x37, (byte) 0x00)
-        ->expect (0x38, (byte) 0x00)
-        ->expect (0x39, (byte) 0x10)
-        ->expect (0x32, (byte) 0x00)
-        ->expect (0x33, (byte) 0x00)
-        ->expect (0x34, (byte) 0x00)
-        ->expect (0x35, (byte) 0x10)
-        ->expect (0x3a, (byte) 0x00)
-        ->expect (0x3b, (byte) 0x00)
-        ->expect (0x3c, (byte) 0x00)
-        ->expect (0x3d, (byte) 0x10)
-
-        ->expect (0x12, (byte) 0x00)
-        ->expect (0x13, (byte) 0x00)
-        ->expect (0x14, (byte) 0x00)
-        ->expect (0x15, (byte) 0x10)
-        ->expect (0x16, (byte) 0x00)
-        ->expect (0x17, (byte) 0x00)
-        ->expect (0x18, (byte) 0x00)
-        ->expect (0x19, (byte) 0x10)
-        ->expect (0x0e, (byte) 0x00)
-        ->expect (0x0f, (byte) 0x00)
-        ->expect (0x10, (byte) 0x00)
-        ->expect (0x11, (byte) 0x10)
-
-        ->expect (0x1e, (byte) 0x00)
-        ->expect (0x1f, (byte) 0x00)
-        ->expect (0x20, (byte) 0x00)
-        ->expect (0x21, (byte) 0x10)
-        ->expect (0x1a, (byte) 0x00)
-        ->expect (0x1b, (byte) 0x00)
-        ->expect (0x1c, (byte) 0x00)
-        ->expect (0x1d, (byte) 0x10)
-        ->expect (0x22, (byte) 0x00)
-        ->expect (0x23, (byte) 0x00)
-        ->expect (0x24, (byte) 0x00)
-        ->expect (0x25, (byte) 0x10);
+        ->expect (0x00, (byte) 0x80);
 
+    // the constructor stops all the motors, which sends nothing - the "all" channel already
+    // turned them off
     PtrTo<AdafruitMotorDriver<TestDevice> > driver = new AdafruitMotorDriver<TestDevice> (device);
     for (byte i = 0; i < MOTOR_COUNT; ++i) {
         TEST_EQUALS(driver->getMotorSpeed (static_cast<MotorId>(i)), 0);
     }
 
-    // stop motor 0
-    device
-        ->expect (0x2a, (byte) 0x00)
-        ->expect (0x2b, (byte) 0x00)
-        ->expect (0x2c, (byte) 0x00)
-        ->expect (0x2d, (byte) 0x10)
-        ->expect (0x2e, (byte) 0x00)
-        ->expect (0x2f, (byte) 0x00)
-        ->expect (0x30, (byte) 0x00)
-        ->expect (0x31, (byte) 0x10)
-        ->expect (0x26, (byte) 0x00)
-        ->expect (0x27, (byte) 0x00)
-        ->expect (0x28, (byte) 0x00)
-        ->expect (0x29, (byte) 0x10);
-
+    // stopping motor 0 doesn't change anything, so nothing is sent
     PtrTo<Motor<AdafruitMotorDriver<TestDevice> > > motor = new Motor<AdafruitMotorDriver<TestDevice> > (driver, MotorId::MOTOR_0);
     TEST_EQUALS(driver->getMotorSpeed (MotorId::MOTOR_0), 0);
 
-    // (runMotor) - motorId: MOTOR_1, speed: 1.0
+    // (runMotor) - motorId: MOTOR_1, speed: 1.0 - the modulator and the front pin go full on
     device
+       ->expect (0x27, (byte) 0x10)
+       ->expect (0x28, (byte) 0x00)
+       ->expect (0x29, (byte) 0x00)
        ->expect (0x2a, (byte) 0x00)
        ->expect (0x2b, (byte) 0x10)
        ->expect (0x2c, (byte) 0x00)
-       ->expect (0x2d, (byte) 0x00)
-       ->expect (0x2e, (byte) 0x00)
-       ->expect (0x2f, (byte) 0x00)
-       ->expect (0x30, (byte) 0x00)
-       ->expect (0x31, (byte) 0x10)
-       ->expect (0x26, (byte) 0x00)
-       ->expect (0x27, (byte) 0x10)
-       ->expect (0x28, (byte) 0x00)
-       ->expect (0x29, (byte) 0x00);
+       ->expect (0x2d, (byte) 0x00);
     motor->run (1.0);
     TEST_EQUALS(driver->getMotorSpeed (MotorId::MOTOR_0), 1.0);
 
-    // (runMotor) - motorId: MOTOR_1, speed: 1.5
-    device
-       ->expect (0x2a, (byte) 0x00)
-       ->expect (0x2b, (byte) 0x10)
-       ->expect (0x2c, (byte) 0x00)
-       ->expect (0x2d, (byte) 0x00)
-       ->expect (0x2e, (byte) 0x00)
-       ->expect (0x2f, (byte) 0x00)
-       ->expect (0x30, (byte) 0x00)
-       ->expect (0x31, (byte) 0x10)
-       ->expect (0x26, (byte) 0x00)
-       ->expect (0x27, (byte) 0x10)
-       ->expect (0x28, (byte) 0x00)
-       ->expect (0x29, (byte) 0x00);
+    // (runMotor) - motorId: MOTOR_1, speed: 1.5 - clamped to 1.0, which is already set
     motor->run (1.5);
     TEST_EQUALS(driver->getMotorSpeed (MotorId::MOTOR_0), 1.0);
 
@@ -142,107 +63,154 @@ TEST_CASE(TestAdafruitMotorDriverStepperMotor) {
     PtrToTestDevice device = new TestDevice (ADAFRUIT_MOTOR_DRIVER_DEFAULT_ADDRESS);
     device
         // constructor
+        ->expect (0x00, 0x31)
         ->expect (0xfa, 0x00)
         ->expect (0xfb, 0x00)
         ->expect (0xfc, 0x00)
-        ->expect (0xfd, 0x00)
+        ->expect (0xfd, 0x10)
         ->expect (0x01, 0x04)
-        ->expect (0x00, 0x01)
+        ->expect (0x00, 0x21)
         ->expect (0x00, 0x00)
         // which calls setPulseFrequency
         ->expect (0x00, (byte) 0x10)
         ->expect (0xfe, (byte) 0x05)
         ->expect (0x00, (byte) 0x00)
-        ->expect (0x00, (byte) 0x80)
-        // followed by a set of calls to stop all the motors
-        ->expect (0x2a, (byte) 0x00)
-        ->expect (0x2b, (byte) 0x00)
-        ->expect (0x2c, (byte) 0x00)
-        ->expect (0x2d, (byte) 0x10)
-        ->expect (0x2e, (byte) 0x00)
-        ->expect (0x2f, (byte) 0x00)
-        ->expect (0x30, (byte) 0x00)
-        ->expect (0x31, (byte) 0x10)
-        ->expect (0x26, (byte) 0x00)
-        ->expect (0x27, (byte) 0x00)
-        ->expect (0x28, (byte) 0x00)
-        ->expect (0x29, (byte) 0x10)
-
-        ->expect (0x36, (byte) 0x00)
-        ->expect (0x37, (byte) 0x00)
-        ->expect (0x38, (byte) 0x00)
-        ->expect (0x39, (byte) 0x10)
-        ->expect (0x32, (byte) 0x00)
-        ->expect (0x33, (byte) 0x00)
-        ->expect (0x34, (byte) 0x00)
-        ->expect (0x35, (byte) 0x10)
-        ->expect (0x3a, (byte) 0x00)
-        ->expect (0x3b, (byte) 0x00)
-        ->expect (0x3c, (byte) 0x00)
-        ->expect (0x3d, (byte) 0x10)
-
-        ->expect (0x12, (byte) 0x00)
-        ->expect (0x13, (byte) 0x00)
-        ->expect (0x14, (byte) 0x00)
-        ->expect (0x15, (byte) 0x10)
-        ->expect (0x16, (byte) 0x00)
-        ->expect (0x17, (byte) 0x00)
-        ->expect (0x18, (byte) 0x00)
-        ->expect (0x19, (byte) 0x10)
-        ->expect (0x0e, (byte) 0x00)
-        ->expect (0x0f, (byte) 0x00)
-        ->expect (0x10, (byte) 0x00)
-        ->expect (0x11, (byte) 0x10)
-
-        ->expect (0x1e, (byte) 0x00)
-        ->expect (0x1f, (byte) 0x00)
-        ->expect (0x20, (byte) 0x00)
-        ->expect (0x21, (byte) 0x10)
-        ->expect (0x1a, (byte) 0x00)
-        ->expect (0x1b, (byte) 0x00)
-        ->expect (0x1c, (byte) 0x00)
-        ->expect (0x1d, (byte) 0x10)
-        ->expect (0x22, (byte) 0x00)
-        ->expect (0x23, (byte) 0x00)
-        ->expect (0x24, (byte) 0x00)
-        ->expect (0x25, (byte) 0x10);
+        ->expect (0x00, (byte) 0x80);
 
+    // the constructor stops all the motors, which sends nothing - the "all" channel already
+    // turned them off
     PtrTo<AdafruitMotorDriver<TestDevice> > driver = new AdafruitMotorDriver<TestDevice> (device);
     for (byte i = 0; i < MOTOR_COUNT; ++i) {
         TEST_EQUALS(driver->getMotorSpeed (static_cast<MotorId>(i)), 0);
     }
 
-    // stop motor 0
+    // the stepper starts with motor 0 full on, and motor 1 (already) stopped
     device
-        ->expect (0x2a, (byte) 0x00)
-        ->expect (0x2b, (byte) 0x10)
-        ->expect (0x2c, (byte) 0x00)
-        ->expect (0x2d, (byte) 0x00)
-        ->expect (0x2e, (byte) 0x00)
-        ->expect (0x2f, (byte) 0x00)
-        ->expect (0x30, (byte) 0x00)
-        ->expect (0x31, (byte) 0x10)
-        ->expect (0x26, (byte) 0x00)
         ->expect (0x27, (byte) 0x10)
         ->expect (0x28, (byte) 0x00)
         ->expect (0x29, (byte) 0x00)
+        ->expect (0x2a, (byte) 0x00)
+        ->expect (0x2b, (byte) 0x10)
+        ->expect (0x2c, (byte) 0x00)
+        ->expect (0x2d, (byte) 0x00);
 
-        ->expect (0x36, (byte) 0x00)
-        ->expect (0x37, (byte) 0x00)
+    PtrTo<StepperMotor<AdafruitMotorDriver<TestDevice> > > stepper = StepperMotor<AdafruitMotorDriver<TestDevice> >::getHalfStepper (driver, MotorId::MOTOR_0, MotorId::MOTOR_1, 1.8);
+    TEST_EQUALS(driver->getMotorSpeed (MotorId::MOTOR_0), 1);
+    TEST_EQUALS(driver->getMotorSpeed (MotorId::MOTOR_1), 0);
+
+    // one half step turns motor 1 full on, the step's register bytes were computed when the
+    // stepper was built, and only the ones that change go out (with the known ones between them)
+    device
+        ->expect (0x37, (byte) 0x10)
         ->expect (0x38, (byte) 0x00)
-        ->expect (0x39, (byte) 0x10)
-        ->expect (0x32, (byte) 0x00)
-        ->expect (0x33, (byte) 0x00)
-        ->expect (0x34, (byte) 0x00)
-        ->expect (0x35, (byte) 0x10)
+        ->expect (0x39, (byte) 0x00)
         ->expect (0x3a, (byte) 0x00)
-        ->expect (0x3b, (byte) 0x00)
+        ->expect (0x3b, (byte) 0x10)
         ->expect (0x3c, (byte) 0x00)
-        ->expect (0x3d, (byte) 0x10);
-
-    PtrTo<StepperMotor<AdafruitMotorDriver<TestDevice> > > stepper = StepperMotor<AdafruitMotorDriver<TestDevice> >::getHalfStepper (driver, MotorId::MOTOR_0, MotorId::MOTOR_1, 1.8);
+        ->expect (0x3d, (byte) 0x00);
+    stepper->turn (1.0 / 400.0);
     TEST_EQUALS(driver->getMotorSpeed (MotorId::MOTOR_0), 1);
-    TEST_EQUALS(driver->getMotorSpeed (MotorId::MOTOR_1), 0);
+    TEST_EQUALS(driver->getMotorSpeed (MotorId::MOTOR_1), 1);
 
     TEST_ASSERTION(device->report ());
 }
+
+TEST_CASE(TestAdafruitMotorDriverPreparedMotors) {
+    //Log::Scope scope (Log::TRACE);
+    PtrToNullDevice device = new NullDevice ();
+    PtrTo<AdafruitMotorDriver<NullDevice> > driver = new AdafruitMotorDriver<NullDevice> (device);
+
+    // the two motors of a stepper on the hat are one run of six channels
+    MotorId motorIds[] = { MotorId::MOTOR_1, MotorId::MOTOR_0 };
+    double speeds[] = { -1.0, 0.5 };
+    PreparedMotors prepared;
+    driver->prepareMotors (motorIds, speeds, 2, prepared);
+    TEST_EQUALS(prepared.runCount, 1);
+    TEST_EQUALS(prepared.runChannels[0], 8);
+    TEST_EQUALS(prepared.runLengths[0], 6);
+
+    // channel 8 is the motor 0 modulator, at half
+    TEST_EQUALS(prepared.registers[2] | (prepared.registers[3] << 8), 2047);
+
+    // channel 13 is the motor 1 modulator, full on
+    TEST_EQUALS(prepared.registers[21], 0x10);
+    driver->runPreparedMotors (prepared);
+    TEST_EQUALS(driver->getMotorSpeed (MotorId::MOTOR_0), 0.5);
+    TEST_EQUALS(driver->getMotorSpeed (MotorId::MOTOR_1), -1.0);
+
+    // motors 0 and 3 are apart on the chip, two runs
+    motorIds[1] = MotorId::MOTOR_3;
+    driver->prepareMotors (motorIds, speeds, 2, prepared);
+    TEST_EQUALS(prepared.runCount, 2);
+    TEST_EQUALS(prepared.runChannels[0], 5);
+    TEST_EQUALS(prepared.runChannels[1], 11);
+}
+
+TEST_CASE(TestAdafruitMotorHatWiring) {
+    // the packed wiring gives the same pins as the hat's schematic
+    byte pins[MOTOR_COUNT][3] = { { 8, 9, 10 }, { 13, 12, 11 }, { 2, 3, 4 }, { 7, 6, 5 } };
+    for (uint i = 0; i < MOTOR_COUNT; ++i) {
+        MotorId motorId = static_cast<MotorId> (i);
+        TEST_EQUALS(uint (AdafruitMotorHatWiring::getModulator (motorId)), uint (pins[i][0]));
+        TEST_EQUALS(uint (AdafruitMotorHatWiring::getFrontPin (motorId)), uint (pins[i][1]));
+        TEST_EQUALS(uint (AdafruitMotorHatWiring::getBackPin (motorId)), uint (pins[i][2]));
+    }
+    static_assert (AdafruitMotorHatWiring::getModulator (MotorId::MOTOR_1) == 13, "wiring should be computed at compile time");
+}
+
+TEST_CASE(TestSimulatedBusMotorFrame) {
+    //Log::Scope scope (Log::TRACE);
+    SimulatedBus simulated (ADAFRUIT_MOTOR_DRIVER_DEFAULT_ADDRESS);
+    PtrTo<AdafruitMotorDriver<DeviceI2C> > driver = new AdafruitMotorDriver<DeviceI2C> (ADAFRUIT_MOTOR_DRIVER_DEFAULT_ADDRESS, PCA9685_DEFAULT_PULSE_FREQUENCY, simulated.id);
+
+    // a 4-motor chassis update is one transfer, and nothing changes on the chip until the commit
+    uint64_t ioctlCount = simulated.bus->getIoctlCount ();
+    driver->beginFrame ();
+    driver
+        ->runMotor (MotorId::MOTOR_0, 0.5)
+        ->runMotor (MotorId::MOTOR_1, 0.5)
+        ->runMotor (MotorId::MOTOR_2, -0.5)
+        ->runMotor (MotorId::MOTOR_3, -0.5);
+    TEST_EQUALS(simulated.bus->getIoctlCount () - ioctlCount, 0);
+    TEST_EQUALS(simulated.chip->getChannelOff (8), 0x1000);
+    driver->commit ();
+    TEST_EQUALS(simulated.bus->getIoctlCount () - ioctlCount, 1);
+    TEST_EQUALS(simulated.chip->getChannelOff (8), 2047);
+    TEST_EQUALS(simulated.chip->getChannelOn (9), 0x1000);
+    TEST_EQUALS(simulated.chip->getChannelOn (3), 0);
+    TEST_EQUALS(simulated.chip->getChannelOn (4), 0x1000);
+}
+
+TEST_CASE(TestSimulatedBusRunMotors) {
+    //Log::Scope scope (Log::TRACE);
+    SimulatedBus simulated (ADAFRUIT_MOTOR_DRIVER_DEFAULT_ADDRESS);
+    PtrTo<AdafruitMotorDriver<DeviceI2C> > driver = new AdafruitMotorDriver<DeviceI2C> (ADAFRUIT_MOTOR_DRIVER_DEFAULT_ADDRESS, PCA9685_DEFAULT_PULSE_FREQUENCY, simulated.id);
+
+    // one motor is one transfer
+    uint64_t ioctlCount = simulated.bus->getIoctlCount ();
+    driver->runMotor (MotorId::MOTOR_2, 0.25);
+    TEST_EQUALS(simulated.bus->getIoctlCount () - ioctlCount, 1);
+    TEST_EQUALS(simulated.chip->getChannelOff (2), 1023);
+    TEST_EQUALS(simulated.chip->getChannelOn (3), 0x1000);
+
+    // so is all of them, and the outputs all change together
+    ioctlCount = simulated.bus->getIoctlCount ();
+    uint outputChanges = simulated.chip->getOutputChanges ();
+    double speeds[MOTOR_COUNT] = { 0.5, -0.5, 0.0, 1.0 };
+    driver->runMotors (speeds);
+    TEST_EQUALS(simulated.bus->getIoctlCount () - ioctlCount, 1);
+    TEST_EQUALS(simulated.chip->getOutputChanges () - outputChanges, 1);
+    for (uint i = 0; i < MOTOR_COUNT; ++i) {
+        TEST_EQUALS(driver->getMotorSpeed (static_cast<MotorId> (i)), speeds[i]);
+    }
+    TEST_EQUALS(simulated.chip->getOutputOff (8), 2047);
+    TEST_EQUALS(simulated.chip->getOutputOff (12), 0x1000);
+    TEST_EQUALS(simulated.chip->getChannelOn (11), 0x1000);
+    TEST_EQUALS(simulated.chip->getOutputOff (2), 0x1000);
+    TEST_EQUALS(simulated.chip->getChannelOn (7), 0x1000);
+
+    // setting the same speeds again sends nothing
+    ioctlCount = simulated.bus->getIoctlCount ();
+    driver->runMotors (speeds);
+    TEST_EQUALS(simulated.bus->getIoctlCount () - ioctlCount, 0);
+}
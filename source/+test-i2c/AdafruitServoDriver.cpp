@@ -2,6 +2,8 @@
 #include "AdafruitServoDriver.h"
 #include "Servo.h"
 #include "TestDevice.h"
+#include "NullDevice.h"
+#include "SimulatedBusBackend.h"
 #include "DeviceI2C.h"
 
 TEST_CASE(TestAdafruitServoDriver) {
@@ -9,12 +11,13 @@ TEST_CASE(TestAdafruitServoDriver) {
     PtrToTestDevice device = new TestDevice (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS);
     device
         // PCA9685 constructor
+        ->expect (0x00, 0x31)
         ->expect (0xfa, 0x00)
         ->expect (0xfb, 0x00)
         ->expect (0xfc, 0x00)
-        ->expect (0xfd, 0x00)
+        ->expect (0xfd, 0x10)
         ->expect (0x01, 0x04)
-        ->expect (0x00, 0x01)
+        ->expect (0x00, 0x21)
         ->expect (0x00, 0x00)
         // which calls setPulseFrequency
         ->expect (0x00, (byte) 0x10)
@@ -49,3 +52,220 @@ TEST_CASE(TestAdafruitServoDriver) {
 
     TEST_ASSERTION(device->report ());
 }
+
+TEST_CASE(TestAdafruitServoDriverPose) {
+    //Log::Scope scope (Log::TRACE);
+    PtrToTestDevice device = new TestDevice (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS);
+    device
+        // PCA9685 constructor
+        ->expect (0x00, 0x31)
+        ->expect (0xfa, 0x00)
+        ->expect (0xfb, 0x00)
+        ->expect (0xfc, 0x00)
+        ->expect (0xfd, 0x10)
+        ->expect (0x01, 0x04)
+        ->expect (0x00, 0x21)
+        ->expect (0x00, 0x00)
+        // which calls setPulseFrequency
+        ->expect (0x00, (byte) 0x10)
+        ->expect (0xfe, (byte) 0x79)
+        ->expect (0x00, (byte) 0x00)
+        ->expect (0x00, (byte) 0x80);
+    PtrTo<AdafruitServoDriver<TestDevice> > driver = new AdafruitServoDriver<TestDevice> (device);
+
+    // servos 2 and 0 (in that order) are written in register order, from the first register that
+    // changes to the last, with the gap filled in from what the "all" channel set it to in the
+    // constructor, so the span is one run
+    device
+        ->expect (0x08, (byte) 0x33)
+        ->expect (0x09, (byte) 0x01)
+        ->expect (0x0a, (byte) 0x00)
+        ->expect (0x0b, (byte) 0x00)
+        ->expect (0x0c, (byte) 0x00)
+        ->expect (0x0d, (byte) 0x10)
+        ->expect (0x0e, (byte) 0x00)
+        ->expect (0x0f, (byte) 0x00)
+        ->expect (0x10, (byte) 0xcd)
+        ->expect (0x11, (byte) 0x00);
+    ServoId servoIds[] = { ServoId::SERVO_02, ServoId::SERVO_00 };
+    double milliseconds[] = { 1.0, 1.5 };
+    driver->setPulseDurations (servoIds, milliseconds, 2);
+    TEST_EQUALS(driver->getPulseDuration (ServoId::SERVO_00), 1.5);
+    TEST_EQUALS(driver->getPulseDuration (ServoId::SERVO_02), 1.0);
+
+    TEST_ASSERTION(device->report ());
+}
+
+TEST_CASE(TestAdafruitServoDriverFrame) {
+    //Log::Scope scope (Log::TRACE);
+    PtrToTestDevice device = new TestDevice (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS);
+    device
+        // PCA9685 constructor
+        ->expect (0x00, 0x31)
+        ->expect (0xfa, 0x00)
+        ->expect (0xfb, 0x00)
+        ->expect (0xfc, 0x00)
+        ->expect (0xfd, 0x10)
+        ->expect (0x01, 0x04)
+        ->expect (0x00, 0x21)
+        ->expect (0x00, 0x00)
+        // which calls setPulseFrequency
+        ->expect (0x00, (byte) 0x10)
+        ->expect (0xfe, (byte) 0x79)
+        ->expect (0x00, (byte) 0x00)
+        ->expect (0x00, (byte) 0x80);
+    PtrTo<AdafruitServoDriver<TestDevice> > driver = new AdafruitServoDriver<TestDevice> (device);
+
+    // nothing goes to the device until the commit, and then only the registers that changed (and
+    // the known ones between them)
+    driver->beginFrame ();
+    driver
+        ->setPulseDuration (ServoId::SERVO_03, 1.0)
+        ->setPulseDuration (ServoId::SERVO_01, 2.0)
+        ->setPulseDuration (ServoId::SERVO_03, 1.5);
+    TEST_TRUE(driver->isFraming ());
+    TEST_ASSERTION(device->report ());
+    device
+        ->expect (0x0c, (byte) 0x9a)
+        ->expect (0x0d, (byte) 0x01)
+        ->expect (0x0e, (byte) 0x00)
+        ->expect (0x0f, (byte) 0x00)
+        ->expect (0x10, (byte) 0x00)
+        ->expect (0x11, (byte) 0x10)
+        ->expect (0x12, (byte) 0x00)
+        ->expect (0x13, (byte) 0x00)
+        ->expect (0x14, (byte) 0x33)
+        ->expect (0x15, (byte) 0x01);
+    driver->commit ();
+    TEST_TRUE(not driver->isFraming ());
+    TEST_ASSERTION(device->report ());
+
+    // a frame that changes nothing sends nothing
+    driver->beginFrame ();
+    driver->setPulseDuration (ServoId::SERVO_01, 2.0);
+    driver->commit ();
+    TEST_ASSERTION(device->report ());
+}
+
+TEST_CASE(TestAdafruitServoDriverStaticTiming) {
+    //Log::Scope scope (Log::TRACE);
+    typedef PCA9685Timing<25000000, 50> Timing;
+    static_assert (Timing::getPreScale () == 0x79, "pre-scale should be computed at compile time");
+    static_assert (Timing::getWidth (1500) == 307, "widths should be computed at compile time");
+    TEST_EQUALS(Timing::getWidth (1000), 205);
+    TEST_EQUALS(Timing::getWidth (0), 0);
+    TEST_EQUALS(Timing::getWidth (100000), 4095);
+
+    // a driver with a compile-time timing can't be asked for another pulse frequency
+    bool refused = false;
+    try {
+        PtrTo<AdafruitServoDriver<NullDevice, Timing> > refusedDriver = new AdafruitServoDriver<NullDevice, Timing> (new NullDevice (), 60);
+    } catch (RuntimeError& runtimeError) {
+        refused = true;
+    }
+    TEST_TRUE(refused);
+
+    PtrToTestDevice device = new TestDevice (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS);
+    device
+        // PCA9685 constructor
+        ->expect (0x00, 0x31)
+        ->expect (0xfa, 0x00)
+        ->expect (0xfb, 0x00)
+        ->expect (0xfc, 0x00)
+        ->expect (0xfd, 0x10)
+        ->expect (0x01, 0x04)
+        ->expect (0x00, 0x21)
+        ->expect (0x00, 0x00)
+        // which sets the pre-scale computed at compile time
+        ->expect (0x00, (byte) 0x10)
+        ->expect (0xfe, (byte) 0x79)
+        ->expect (0x00, (byte) 0x00)
+        ->expect (0x00, (byte) 0x80);
+    PtrTo<AdafruitServoDriver<TestDevice, Timing> > driver = new AdafruitServoDriver<TestDevice, Timing> (device);
+    TEST_EQUALS(driver->getPulseFrequency (), Timing::getPulseFrequency ());
+
+    // the integer conversion agrees with the run time conversion
+    for (uint microseconds = 500; microseconds <= 2500; microseconds += 10) {
+        TEST_EQUALS(Timing::getWidth (microseconds), uint (round ((4095 * microseconds * driver->getPulseFrequency ()) / 1.0e6)));
+    }
+
+    device
+        ->expect (0x06, (byte) 0x00)
+        ->expect (0x07, (byte) 0x00)
+        ->expect (0x08, (byte) 0x33)
+        ->expect (0x09, (byte) 0x01)
+        ->expect (0x0a, (byte) 0x00)
+        ->expect (0x0b, (byte) 0x00)
+        ->expect (0x0c, (byte) 0xcd)
+        ->expect (0x0d, (byte) 0x00);
+    driver
+        ->setPulseMicroseconds (ServoId::SERVO_00, 1500)
+        ->setPulseMicroseconds (ServoId::SERVO_01, 1000);
+    TEST_EQUALS(driver->getPulseDuration (ServoId::SERVO_00), 1.5);
+    TEST_EQUALS(driver->getPulseDuration (ServoId::SERVO_01), 1.0);
+
+    TEST_ASSERTION(device->report ());
+}
+
+TEST_CASE(TestSimulatedBusServoStaticTiming) {
+    //Log::Scope scope (Log::TRACE);
+    // the same durations through a run time and a compile-time timing driver put the same bytes
+    // in the registers
+    typedef PCA9685Timing<25000000, ADAFRUIT_SERVO_DRIVER_DEFAULT_PULSE_FREQUENCY> Timing;
+    SimulatedBus runtimeBus (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS);
+    SimulatedBus staticBus (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS);
+    PtrTo<AdafruitServoDriver<DeviceI2C> > runtimeDriver = new AdafruitServoDriver<DeviceI2C> (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS, ADAFRUIT_SERVO_DRIVER_DEFAULT_PULSE_FREQUENCY, runtimeBus.id);
+    PtrTo<AdafruitServoDriver<DeviceI2C, Timing> > staticDriver = new AdafruitServoDriver<DeviceI2C, Timing> (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS, ADAFRUIT_SERVO_DRIVER_DEFAULT_PULSE_FREQUENCY, staticBus.id);
+
+    double durations[] = { 0.5, 1.0, 1.234, 1.5, 1.75, 2.0, 2.5 };
+    for (uint i = 0; i < 7; ++i) {
+        runtimeDriver->setPulseDuration (static_cast<ServoId> (i), durations[i]);
+        staticDriver->setPulseDuration (static_cast<ServoId> (i), durations[i]);
+    }
+    double pose[SERVO_COUNT];
+    for (uint i = 0; i < SERVO_COUNT; ++i) {
+        pose[i] = 0.8 + (i * 0.1);
+    }
+    ServoId servoIds[] = { ServoId::SERVO_08, ServoId::SERVO_09, ServoId::SERVO_10 };
+    runtimeDriver->setPulseDurations (servoIds, pose, 3);
+    staticDriver->setPulseDurations (servoIds, pose, 3);
+    for (byte at = SimulatedPCA9685::LED_BASE; at <= SimulatedPCA9685::LED_LAST; ++at) {
+        TEST_EQUALS(staticBus.chip->getRegister (at), runtimeBus.chip->getRegister (at));
+    }
+    TEST_EQUALS(staticBus.chip->getChannelOff (3), 307);
+}
+
+TEST_CASE(TestSimulatedBusServoTooMany) {
+    //Log::Scope scope (Log::TRACE);
+    // asking for more servos than the board has is an error, not a silent truncation
+    SimulatedBus simulatedBus (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS);
+    PtrTo<AdafruitServoDriver<DeviceI2C> > driver = new AdafruitServoDriver<DeviceI2C> (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS, ADAFRUIT_SERVO_DRIVER_DEFAULT_PULSE_FREQUENCY, simulatedBus.id);
+    ServoId servoIds[SERVO_COUNT + 1];
+    double pose[SERVO_COUNT + 1];
+    for (uint i = 0; i <= SERVO_COUNT; ++i) {
+        servoIds[i] = static_cast<ServoId> (i % SERVO_COUNT);
+        pose[i] = 1.5;
+    }
+    uint64_t transactions = simulatedBus.backend->getTransactions ();
+    u2 channelOff = simulatedBus.chip->getChannelOff (0);
+    EXPECT_FAIL(driver->setPulseDurations (servoIds, pose, SERVO_COUNT + 1));
+    TEST_EQUALS(simulatedBus.backend->getTransactions (), transactions);
+    TEST_EQUALS(simulatedBus.chip->getChannelOff (0), channelOff);
+}
+
+TEST_CASE(TestSimulatedBusServoPose) {
+    //Log::Scope scope (Log::TRACE);
+    SimulatedBus simulated (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS);
+    PtrTo<AdafruitServoDriver<DeviceI2C> > driver = new AdafruitServoDriver<DeviceI2C> (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS, ADAFRUIT_SERVO_DRIVER_DEFAULT_PULSE_FREQUENCY, simulated.id);
+
+    // a whole-board pose is one transfer of all 64 LED registers
+    double milliseconds[SERVO_COUNT];
+    for (uint i = 0; i < SERVO_COUNT; ++i) {
+        milliseconds[i] = 1.0 + (i / 15.0);
+    }
+    uint64_t ioctlCount = simulated.bus->getIoctlCount ();
+    driver->setPulseDurations (milliseconds);
+    TEST_EQUALS(simulated.bus->getIoctlCount () - ioctlCount, 1);
+    TEST_EQUALS(simulated.chip->getChannelOff (0), 205);
+    TEST_EQUALS(simulated.chip->getChannelOff (15), 410);
+}
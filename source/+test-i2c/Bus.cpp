@@ -0,0 +1,137 @@
+#include "Test.h"
+#include "SimulatedBusBackend.h"
+#include "DeviceI2C.h"
+#include "AdafruitServoDriver.h"
+
+#include <thread>
+
+TEST_CASE(TestBusPriority) {
+    //Log::Scope scope (Log::TRACE);
+    SimulatedBus simulated (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS);
+    PtrToBus bus = simulated.bus;
+
+    // hold the bus, and let a background caller line up for it before a real-time caller does
+    vector<BusPriority> order;
+    bus->begin (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS);
+    thread background ([&] () {
+        bus->begin (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS, BusPriority::BACKGROUND);
+        order.push_back (BusPriority::BACKGROUND);
+        bus->end ();
+    });
+    Pause::milli (10);
+    thread realtime ([&] () {
+        bus->begin (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS, BusPriority::REALTIME);
+        order.push_back (BusPriority::REALTIME);
+        bus->end ();
+    });
+    Pause::milli (10);
+
+    // the real-time caller gets the bus first
+    bus->end ();
+    background.join ();
+    realtime.join ();
+    TEST_EQUALS(order.size (), 2);
+    TEST_TRUE(order[0] == BusPriority::REALTIME);
+    TEST_TRUE(order[1] == BusPriority::BACKGROUND);
+
+    // the waits are reported per class
+    TEST_EQUALS(bus->getStatistics ().getMutexWait (BusPriority::REALTIME).getCount (), 1);
+    TEST_EQUALS(bus->getStatistics ().getMutexWait (BusPriority::BACKGROUND).getCount (), 2);
+    TEST_TRUE(bus->getStatistics ().getMutexWait (BusPriority::BACKGROUND).getMaxNanoseconds () >= 10000000);
+
+    // the recursive lock still works for a background caller while a real-time caller waits
+    bus->begin (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS);
+    thread waiting ([&] () {
+        bus->begin (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS, BusPriority::REALTIME);
+        bus->end ();
+    });
+    Pause::milli (10);
+    bus->begin (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS);
+    bus->end ();
+    bus->end ();
+    waiting.join ();
+    TEST_EQUALS(bus->getStatistics ().getMutexWait (BusPriority::REALTIME).getCount (), 2);
+}
+
+TEST_CASE(TestSimulatedBusWriteModes) {
+    //Log::Scope scope (Log::TRACE);
+    // the same run of registers, on adapters that can do less and less
+    unsigned long functionalities[] = {
+        SIMULATED_BUS_FUNCTIONALITY,
+        I2C_FUNC_SMBUS_BYTE | I2C_FUNC_SMBUS_BYTE_DATA | I2C_FUNC_SMBUS_WRITE_I2C_BLOCK,
+        I2C_FUNC_SMBUS_BYTE | I2C_FUNC_SMBUS_BYTE_DATA
+    };
+    BusWriteMode writeModes[] = { BusWriteMode::TRANSFER, BusWriteMode::I2C_BLOCK, BusWriteMode::BYTE };
+    uint ioctlCounts[] = { 1, 1, 4 };
+    for (uint i = 0; i < 3; ++i) {
+        SimulatedBus simulated (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS, 0, functionalities[i]);
+        byte autoIncrement[] = { SimulatedPCA9685::MODE1, SimulatedPCA9685::AUTO_INCREMENT | SimulatedPCA9685::ALLCALL };
+        simulated.chip->write (autoIncrement, 2);
+        TEST_EQUALS(strcmp (simulated.bus->getName ().get (), "simulated"), 0);
+        TEST_TRUE(simulated.bus->getWriteMode () == writeModes[i]);
+
+        DeviceI2C device (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS, simulated.id);
+        device.enableAutoIncrement ()->begin ();
+        uint64_t ioctlCount = simulated.bus->getIoctlCount ();
+        device.write (0x0a, 0x01)->write (0x0b, 0x00)->write (0x0c, 0x34)->write (0x0d, 0x02)->end ();
+        TEST_EQUALS(simulated.bus->getIoctlCount () - ioctlCount, ioctlCounts[i]);
+        TEST_EQUALS(simulated.chip->getChannelOn (1), 0x0001);
+        TEST_EQUALS(simulated.chip->getChannelOff (1), 0x0234);
+    }
+
+    // simulated buses sort after the real ones
+    TEST_EQUALS(Bus::getBusByIndex (0)->getId () <= Bus::getBusByIndex (1)->getId (), true);
+}
+
+TEST_CASE(TestSimulatedBusFunctionality) {
+    //Log::Scope scope (Log::TRACE);
+    // threads asking at the same time all get the mask, and the adapter is only asked once
+    SimulatedBus simulated (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS);
+    atomic<uint> matched (0);
+    vector<thread> threads;
+    for (uint i = 0; i < 8; ++i) {
+        threads.push_back (thread ([&simulated, &matched] () {
+            if (simulated.bus->getFunctionality () == SIMULATED_BUS_FUNCTIONALITY) {
+                ++matched;
+            }
+        }));
+    }
+    for (vector<thread>::iterator iter = threads.begin (); iter != threads.end (); ++iter) {
+        iter->join ();
+    }
+    TEST_EQUALS(matched, 8);
+
+    // the bus is configured once when it opens, and once more for the functionality
+    TEST_EQUALS(simulated.bus->getStatistics ().getLatency (BusOperation::CONFIGURE).getCount (), 2);
+}
+
+TEST_CASE(TestSimulatedBusReadModes) {
+    //Log::Scope scope (Log::TRACE);
+    // the same run of registers read back, on adapters that can do less and less
+    unsigned long functionalities[] = {
+        SIMULATED_BUS_FUNCTIONALITY,
+        I2C_FUNC_SMBUS_BYTE | I2C_FUNC_SMBUS_BYTE_DATA | I2C_FUNC_SMBUS_READ_I2C_BLOCK,
+        I2C_FUNC_SMBUS_BYTE | I2C_FUNC_SMBUS_BYTE_DATA
+    };
+    uint ioctlCounts[] = { 1, 3, 70 };
+    for (uint i = 0; i < 3; ++i) {
+        SimulatedBus simulated (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS, 0, functionalities[i]);
+        byte setup[] = { SimulatedPCA9685::MODE1, SimulatedPCA9685::AUTO_INCREMENT | SimulatedPCA9685::ALLCALL };
+        simulated.chip->write (setup, 2);
+        byte channel[] = { 0x3e, 0x01, 0x00, 0x34, 0x02 };
+        simulated.chip->write (channel, 5);
+        TEST_EQUALS(simulated.bus->canTransfer (), (i == 0));
+
+        DeviceI2C device (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS, simulated.id);
+        byte registers[70];
+        device.begin ();
+        uint64_t ioctlCount = simulated.bus->getIoctlCount ();
+        device.readBlock (0x00, registers, 70)->end ();
+        TEST_EQUALS(simulated.bus->getIoctlCount () - ioctlCount, ioctlCounts[i]);
+        TEST_EQUALS(registers[0x00], simulated.chip->getRegister (0x00));
+        TEST_EQUALS(registers[0x05], 0xe0);
+        TEST_EQUALS(registers[0x3e], 0x01);
+        TEST_EQUALS(registers[0x41], 0x02);
+        TEST_EQUALS(registers[0x45], 0x10);
+    }
+}
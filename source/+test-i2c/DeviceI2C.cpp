@@ -1,6 +1,10 @@
 #include "Test.h"
+#include "SimulatedBusBackend.h"
 #include "DeviceI2C.h"
 #include "AdafruitMotorDriver.h"
+#include "AdafruitServoDriver.h"
+
+#include <thread>
 
 TEST_CASE(TestDeviceI2C) {
     try {
@@ -38,3 +42,243 @@ TEST_CASE(TestDeviceI2C) {
         TEST_TRUE(true);
     }
 }
+
+TEST_CASE(TestDeviceI2CBlockWrite) {
+    try {
+        //Log::Scope scope (Log::TRACE);
+        DeviceI2C   device (ADAFRUIT_MOTOR_DRIVER_DEFAULT_ADDRESS);
+
+        // turn on auto-increment (MODE1, bit 5) so the device accepts a run of registers, then
+        // write LED15_ON_L..LED15_OFF_H (0x42..0x45) as one block and read them back one by one.
+        // the ON registers are 0 so the OFF value is valid
+        device.begin ();
+        device.write (0x00, device.read (0x00) | 0x20)->enableAutoIncrement ();
+        device
+            .write (0x42, 0x00)
+            ->write (0x43, 0x00)
+            ->write (0x44, 0x34)
+            ->write (0x45, 0x02)
+            ->flush ();
+        Pause::milli (10);
+        TEST_EQUALS(device.read (0x42), 0x00);
+        TEST_EQUALS(device.read (0x43), 0x00);
+        TEST_EQUALS(device.read (0x44), 0x34);
+        TEST_EQUALS(device.read (0x45), 0x02);
+        device.end ();
+    }
+    catch (RuntimeError& runtimeError) {
+        Log::exception (runtimeError);
+        TEST_TRUE(true);
+    }
+}
+
+TEST_CASE(TestDeviceI2CShadow) {
+    try {
+        //Log::Scope scope (Log::TRACE);
+        DeviceI2C   device (ADAFRUIT_MOTOR_DRIVER_DEFAULT_ADDRESS);
+
+        // shadow LED15 (0x42..0x45), and write the same values twice - the second time nothing
+        // should be sent. the overridden write to 0x44 in the first flush is dropped too
+        device.enableShadow (0x42, 0x45);
+        device.begin ();
+        device
+            .write (0x42, 0x00)
+            ->write (0x43, 0x00)
+            ->write (0x44, 0x12)
+            ->write (0x44, 0x34)
+            ->write (0x45, 0x02)
+            ->flush ();
+        TEST_EQUALS(device.getShadowBytesSent (), 4);
+        TEST_EQUALS(device.getShadowBytesSaved (), 1);
+        device
+            .write (0x42, 0x00)
+            ->write (0x43, 0x00)
+            ->write (0x44, 0x34)
+            ->write (0x45, 0x02)
+            ->flush ();
+        TEST_EQUALS(device.getShadowBytesSent (), 4);
+        TEST_EQUALS(device.getShadowBytesSaved (), 5);
+
+        // the shadow should agree with the device after a resync
+        device.resync ();
+        TEST_EQUALS(device.read (0x44), 0x34);
+        TEST_EQUALS(device.read (0x45), 0x02);
+        device.end ();
+    }
+    catch (RuntimeError& runtimeError) {
+        Log::exception (runtimeError);
+        TEST_TRUE(true);
+    }
+}
+
+TEST_CASE(TestDeviceI2CDedicatedHandle) {
+    try {
+        //Log::Scope scope (Log::DEBUG);
+        PtrToBus bus = Bus::getBusByIndex (0);
+
+        // alternate single register writes between two devices, through the shared handle and then
+        // through dedicated handles, and compare the system calls each way
+        DeviceI2C   motorShared (ADAFRUIT_MOTOR_DRIVER_DEFAULT_ADDRESS);
+        DeviceI2C   servoShared (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS);
+        uint64_t start = bus->getIoctlCount ();
+        for (int i = 0; i < 10; ++i) {
+            motorShared.begin ();
+            motorShared.write (0x44, 0x10);
+            motorShared.end ();
+            servoShared.begin ();
+            servoShared.write (0x44, 0x10);
+            servoShared.end ();
+        }
+        uint64_t shared = bus->getIoctlCount () - start;
+
+        DeviceI2C   motorDedicated (ADAFRUIT_MOTOR_DRIVER_DEFAULT_ADDRESS, -1, BusHandle::DEDICATED);
+        DeviceI2C   servoDedicated (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS, -1, BusHandle::DEDICATED);
+        PtrToBus motorBus = bus->getDedicatedBus (ADAFRUIT_MOTOR_DRIVER_DEFAULT_ADDRESS);
+        PtrToBus servoBus = bus->getDedicatedBus (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS);
+        uint64_t dedicatedStart = motorBus->getIoctlCount () + servoBus->getIoctlCount ();
+        for (int i = 0; i < 10; ++i) {
+            motorDedicated.begin ();
+            motorDedicated.write (0x44, 0x10);
+            motorDedicated.end ();
+            servoDedicated.begin ();
+            servoDedicated.write (0x44, 0x10);
+            servoDedicated.end ();
+        }
+        uint64_t dedicated = motorBus->getIoctlCount () + servoBus->getIoctlCount () - dedicatedStart;
+        Log::debug () << "TestDeviceI2CDedicatedHandle: " << "shared (" << shared << " ioctls), dedicated (" << dedicated << " ioctls)" << endl;
+        TEST_EQUALS(shared, 40);
+        TEST_EQUALS(dedicated, 20);
+
+        Bus::closeAll ();
+    }
+    catch (RuntimeError& runtimeError) {
+        Log::exception (runtimeError);
+        TEST_TRUE(true);
+    }
+}
+
+TEST_CASE(TestDeviceI2CStatistics) {
+    try {
+        //Log::Scope scope (Log::DEBUG);
+        DeviceI2C   device (ADAFRUIT_MOTOR_DRIVER_DEFAULT_ADDRESS);
+        device.enableAutoIncrement ();
+        Bus::resetStatistics ();
+
+        // one single register write, and one block of four
+        device.begin ();
+        device.write (0x44, 0x10);
+        device.flush ();
+        device
+            .write (0x42, 0x00)
+            ->write (0x43, 0x00)
+            ->write (0x44, 0x34)
+            ->write (0x45, 0x02);
+        device.end ();
+
+        AddressStatistics& statistics = device.getStatistics ();
+        TEST_EQUALS(statistics.getTransactions (), 2);
+        TEST_EQUALS(statistics.getBytesWritten (), 7);
+        TEST_EQUALS(statistics.getErrors (), 0);
+        Log::debug () << "TestDeviceI2CStatistics: " << endl << Bus::getStatisticsText () << Bus::getStatisticsJson () << endl;
+    }
+    catch (RuntimeError& runtimeError) {
+        Log::exception (runtimeError);
+        TEST_TRUE(true);
+    }
+}
+
+TEST_CASE(TestSimulatedBusDeviceI2CSubmitRejected) {
+    //Log::Scope scope (Log::TRACE);
+    SimulatedBus simulated (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS);
+    DeviceI2C device (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS, simulated.id);
+    DeviceI2C blocker (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS, simulated.id);
+
+    // sixty scattered registers are more runs than one transaction holds, so they go to the
+    // worker as two transactions (42 + 18)
+    const uint count = 60;
+    for (uint i = 0; i < count; ++i) {
+        device.write (byte (0x06 + (i * 2)), byte (i + 1));
+    }
+
+    // holding the bus keeps the worker's slots busy once they have something, so with another
+    // device's writes in both of them, the first transaction is refused and nothing is lost. a
+    // refused submit is tried again until it goes, and stopping the worker sends everything
+    BusWorker::start (simulated.bus, 2, BusWorker::REJECT);
+    uint64_t transactions = simulated.backend->getTransactions ();
+    simulated.bus->begin (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS);
+    TEST_TRUE(blocker.write (0xfe, 0x00)->submit ());
+    TEST_TRUE(blocker.write (0xfe, 0x00)->submit ());
+    TEST_TRUE(not device.submit ());
+    simulated.bus->end ();
+    while (not device.submit ()) {
+        Pause::micro (BUS_WORKER_BACKOFF_MICROSECONDS);
+    }
+    BusWorker::stop (simulated.bus);
+    TEST_EQUALS(simulated.backend->getTransactions () - transactions, 4);
+    for (uint i = 0; i < count; ++i) {
+        TEST_EQUALS(simulated.chip->getRegister (byte (0x06 + (i * 2))), byte (i + 1));
+    }
+
+    // with one slot free, the first transaction goes and the second is refused - only its
+    // couplets stay buffered, so trying again doesn't send the first ones twice
+    for (uint i = 0; i < count; ++i) {
+        device.write (byte (0x06 + (i * 2)), byte (i + 0x41));
+    }
+    BusWorker::start (simulated.bus, 2, BusWorker::REJECT);
+    transactions = simulated.backend->getTransactions ();
+    simulated.bus->begin (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS);
+    TEST_TRUE(blocker.write (0xfe, 0x00)->submit ());
+    TEST_TRUE(not device.submit ());
+    simulated.bus->end ();
+    while (not device.submit ()) {
+        Pause::micro (BUS_WORKER_BACKOFF_MICROSECONDS);
+    }
+    BusWorker::stop (simulated.bus);
+    TEST_EQUALS(simulated.backend->getTransactions () - transactions, 3);
+    for (uint i = 0; i < count; ++i) {
+        TEST_EQUALS(simulated.chip->getRegister (byte (0x06 + (i * 2))), byte (i + 0x41));
+    }
+}
+
+TEST_CASE(TestSimulatedBusDeviceI2CFailedEnd) {
+    //Log::Scope scope (Log::TRACE);
+    SimulatedBus simulated (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS);
+    byte autoIncrement[] = { SimulatedPCA9685::MODE1, SimulatedPCA9685::AUTO_INCREMENT | SimulatedPCA9685::ALLCALL };
+    simulated.chip->write (autoIncrement, 2);
+    DeviceI2C device (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS, simulated.id);
+
+    // a write that isn't acknowledged fails the end, which still lets go of the bus
+    simulated.backend->nakNextTransfer ();
+    EXPECT_FAIL(device.begin ()->write (0x06, 0x01)->write (0x07, 0x02)->end ());
+
+    // so another thread can use it
+    thread other ([&simulated] () {
+        DeviceI2C otherDevice (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS, simulated.id);
+        otherDevice.begin ()->write (0x06, 0x03)->write (0x07, 0x04)->end ();
+    });
+    other.join ();
+    TEST_EQUALS(simulated.chip->getChannelOn (0), 0x0403);
+}
+
+TEST_CASE(TestSimulatedBusDeviceI2CAutoIncrement) {
+    //Log::Scope scope (Log::TRACE);
+    // the chip powers on without auto-increment, so a device that hasn't been told otherwise
+    // sends each couplet on its own, and every register gets its value
+    SimulatedBus simulated (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS);
+    DeviceI2C device (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS, simulated.id);
+    uint64_t transactions = simulated.backend->getTransactions ();
+    device.begin ()->write (0x0a, 0x01)->write (0x0b, 0x00)->write (0x0c, 0x34)->write (0x0d, 0x02)->end ();
+    TEST_EQUALS(simulated.backend->getTransactions () - transactions, 4);
+    TEST_EQUALS(simulated.chip->getChannelOn (1), 0x0001);
+    TEST_EQUALS(simulated.chip->getChannelOff (1), 0x0234);
+
+    // once the chip auto-increments and the device is told so, the run goes as one block
+    byte autoIncrement[] = { SimulatedPCA9685::MODE1, SimulatedPCA9685::AUTO_INCREMENT | SimulatedPCA9685::ALLCALL };
+    simulated.chip->write (autoIncrement, 2);
+    device.enableAutoIncrement ();
+    transactions = simulated.backend->getTransactions ();
+    device.begin ()->write (0x0a, 0x02)->write (0x0b, 0x00)->write (0x0c, 0x35)->write (0x0d, 0x02)->end ();
+    TEST_EQUALS(simulated.backend->getTransactions () - transactions, 1);
+    TEST_EQUALS(simulated.chip->getChannelOn (1), 0x0002);
+    TEST_EQUALS(simulated.chip->getChannelOff (1), 0x0235);
+}
@@ -1,6 +1,7 @@
 #include "Test.h"
 #include "AdafruitMotorDriver.h"
 #include "NullDevice.h"
+#include "SimulatedBusBackend.h"
 #include "DeviceI2C.h"
 #include "Motor.h"
 
@@ -25,6 +26,40 @@ TEST_CASE(TestAMotor) {
     TEST_EQUALS(driver->getMotorSpeed (MotorId::MOTOR_0), 1.0);
 }
 
+TEST_CASE(TestMotorRamp) {
+    //Log::Scope scope (Log::TRACE);
+
+    PtrToNullDevice device = new NullDevice ();
+    PtrTo<AdafruitMotorDriver<NullDevice> > driver = new AdafruitMotorDriver<NullDevice> (device);
+    PtrTo<Motor<AdafruitMotorDriver<NullDevice> > > motor = new Motor<AdafruitMotorDriver<NullDevice> > (driver, MotorId::MOTOR_1);
+
+    // a ramp runs to its target, and completes true - the target is clamped
+    future<bool> result = motor->rampToFuture (1.5, 10.0);
+    TEST_TRUE(result.get ());
+    TEST_TRUE(not motor->isRamping ());
+    TEST_EQUALS(motor->getSpeed (), 1.0);
+    TEST_EQUALS(driver->getMotorSpeed (MotorId::MOTOR_1), 1.0);
+
+    // a cancelled ramp completes false, and leaves the speed where it got to
+    result = motor->rampToFuture (0.0, 1.0);
+    Pause::milli (100);
+    TEST_TRUE(motor->isRamping ());
+    TEST_TRUE(motor->cancelRamp ());
+    TEST_TRUE(not result.get ());
+    TEST_TRUE(not motor->cancelRamp ());
+    double speed = motor->getSpeed ();
+    TEST_TRUE((speed > 0.0) and (speed < 1.0));
+    TEST_EQUALS(driver->getMotorSpeed (MotorId::MOTOR_1), speed);
+
+    // run replaces a ramp
+    bool completed = true;
+    motor->rampTo (-1.0, 1.0, [&completed] (bool success) { completed = success; });
+    motor->run (0.25);
+    TEST_TRUE(not completed);
+    TEST_TRUE(not motor->isRamping ());
+    TEST_EQUALS(motor->getSpeed (), 0.25);
+}
+
 TEST_CASE(LiveTestMotor) {
     try {
         PtrTo<AdafruitMotorDriver<DeviceI2C> > driver = new AdafruitMotorDriver<DeviceI2C> ();
@@ -45,3 +80,27 @@ TEST_CASE(LiveTestMotor) {
     }
     TEST_TRUE(true);
 }
+
+TEST_CASE(TestSimulatedBusMotorRamp) {
+    //Log::Scope scope (Log::TRACE);
+    SimulatedBus simulated (ADAFRUIT_MOTOR_DRIVER_DEFAULT_ADDRESS);
+    typedef AdafruitMotorDriver<DeviceI2C> Driver;
+    PtrTo<Driver> driver = new Driver (ADAFRUIT_MOTOR_DRIVER_DEFAULT_ADDRESS, PCA9685_DEFAULT_PULSE_FREQUENCY, simulated.id);
+    PtrTo<Motor<Driver> > motor0 = new Motor<Driver> (driver, MotorId::MOTOR_0);
+    PtrTo<Motor<Driver> > motor3 = new Motor<Driver> (driver, MotorId::MOTOR_3);
+
+    // two motors ramping on one driver share one transfer per tick
+    MotorRampScheduler<Driver>* scheduler = MotorRampScheduler<Driver>::get ();
+    uint64_t tickCount = scheduler->getTickCount ();
+    uint64_t ioctlCount = simulated.bus->getIoctlCount ();
+    future<bool> result0 = motor0->rampToFuture (0.5, 5.0);
+    future<bool> result3 = motor3->rampToFuture (-0.5, 5.0);
+    TEST_TRUE(result0.get ());
+    TEST_TRUE(result3.get ());
+    uint64_t ticks = scheduler->getTickCount () - tickCount;
+    TEST_TRUE(ticks >= 10);
+    TEST_TRUE((simulated.bus->getIoctlCount () - ioctlCount) <= ticks);
+    TEST_EQUALS(driver->getMotorSpeed (MotorId::MOTOR_0), 0.5);
+    TEST_EQUALS(driver->getMotorSpeed (MotorId::MOTOR_3), -0.5);
+    TEST_EQUALS(simulated.chip->getOutputOff (8), 2047);
+}
@@ -1,17 +1,21 @@
 #include "Test.h"
 #include "TestDevice.h"
-#include "PCA9685.h"
+#include "SimulatedBusBackend.h"
+#include "DeviceI2C.h"
+#include "AdafruitServoDriver.h"
+#include "AdafruitMotorDriver.h"
 
 TEST_CASE(TestPCA9685) {
     PtrToTestDevice device = new TestDevice (0x40);
     device
         // constructor
+        ->expect (0x00, 0x31)
         ->expect (0xfa, 0x00)
         ->expect (0xfb, 0x00)
         ->expect (0xfc, 0x00)
-        ->expect (0xfd, 0x00)
+        ->expect (0xfd, 0x10)
         ->expect (0x01, 0x04)
-        ->expect (0x00, 0x01)
+        ->expect (0x00, 0x21)
         ->expect (0x00, 0x00)
         // which calls setPulseFrequency
         ->expect (0x00, (byte) 0x10)
@@ -24,3 +28,135 @@ TEST_CASE(TestPCA9685) {
     // the PCA9685 class otherwise exposes no useful public interface to test
     TEST_ASSERTION(device->report ());
 }
+
+TEST_CASE(TestSimulatedBusAttach) {
+    //Log::Scope scope (Log::TRACE);
+    SimulatedBus simulated (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS);
+
+    // attaching to a chip that was never set up is the full init
+    PtrTo<AdafruitServoDriver<DeviceI2C> > driver = new AdafruitServoDriver<DeviceI2C> (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS, ADAFRUIT_SERVO_DRIVER_DEFAULT_PULSE_FREQUENCY, simulated.id, true);
+    TEST_TRUE(not driver->isAttached ());
+    TEST_TRUE(not simulated.chip->isSleeping ());
+    driver->setPulseDuration (ServoId::SERVO_03, 1.5);
+    TEST_EQUALS(simulated.chip->getChannelOff (3), 307);
+
+    // a restarted process attaches with two reads and no writes, and the servo keeps its pulse
+    uint64_t transactions = simulated.backend->getTransactions ();
+    PtrTo<AdafruitServoDriver<DeviceI2C> > attached = new AdafruitServoDriver<DeviceI2C> (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS, ADAFRUIT_SERVO_DRIVER_DEFAULT_PULSE_FREQUENCY, simulated.id, true);
+    TEST_TRUE(attached->isAttached ());
+    TEST_EQUALS(simulated.backend->getTransactions () - transactions, 2);
+    TEST_EQUALS(simulated.chip->getChannelOff (3), 307);
+    TEST_EQUALS(simulated.chip->getTimingViolations (), 0);
+    TEST_TRUE(fabs (attached->getPulseDuration (ServoId::SERVO_03) - 1.5) < 0.01);
+    TEST_EQUALS(attached->getPulseDuration (ServoId::SERVO_02), 0);
+
+    // the adopted image means an unchanged channel isn't sent again
+    transactions = simulated.backend->getTransactions ();
+    attached->beginFrame ();
+    attached->setPulseDuration (ServoId::SERVO_03, 1.5);
+    attached->commit ();
+    TEST_EQUALS(simulated.backend->getTransactions () - transactions, 0);
+    attached->beginFrame ();
+    attached->setPulseDuration (ServoId::SERVO_02, 1.0);
+    attached->commit ();
+    TEST_EQUALS(simulated.backend->getTransactions () - transactions, 1);
+    TEST_EQUALS(simulated.chip->getChannelOff (2), 205);
+
+    // a different pulse frequency can't attach, the chip is set up again
+    PtrTo<AdafruitMotorDriver<DeviceI2C> > motorDriver = new AdafruitMotorDriver<DeviceI2C> (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS, PCA9685_DEFAULT_PULSE_FREQUENCY, simulated.id, true);
+    TEST_TRUE(not motorDriver->isAttached ());
+    TEST_EQUALS(simulated.chip->getRegister (SimulatedPCA9685::PRE_SCALE), 5);
+    TEST_EQUALS(motorDriver->getMotorSpeed (MotorId::MOTOR_0), 0);
+}
+
+TEST_CASE(TestSimulatedBusOutputChange) {
+    //Log::Scope scope (Log::TRACE);
+    SimulatedBus simulated (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS);
+    PtrTo<AdafruitServoDriver<DeviceI2C> > driver = new AdafruitServoDriver<DeviceI2C> (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS, ADAFRUIT_SERVO_DRIVER_DEFAULT_PULSE_FREQUENCY, simulated.id);
+    TEST_TRUE(driver->getOutputChange () == PCA9685OutputChange::STOP);
+
+    // with nothing known between them, the servos are three runs, but they go out in a single
+    // transfer, and the outputs change once, all together
+    driver->invalidateImage ();
+    uint64_t transactions = simulated.backend->getTransactions ();
+    uint outputChanges = simulated.chip->getOutputChanges ();
+    driver->beginFrame ();
+    driver
+        ->setPulseDuration (ServoId::SERVO_00, 1.0)
+        ->setPulseDuration (ServoId::SERVO_05, 1.5)
+        ->setPulseDuration (ServoId::SERVO_15, 2.0);
+    driver->commit ();
+    TEST_EQUALS(simulated.backend->getTransactions () - transactions, 1);
+    TEST_EQUALS(simulated.chip->getOutputChanges () - outputChanges, 1);
+    TEST_EQUALS(simulated.chip->getOutputOff (0), 205);
+    TEST_EQUALS(simulated.chip->getOutputOff (5), 307);
+    TEST_EQUALS(simulated.chip->getOutputOff (15), 410);
+
+    // changing on the acknowledge, the same update is seen a byte at a time
+    driver->setOutputChange (PCA9685OutputChange::ACK);
+    TEST_EQUALS(simulated.chip->getRegister (SimulatedPCA9685::MODE2), SimulatedPCA9685::OCH | 0x04);
+    outputChanges = simulated.chip->getOutputChanges ();
+    driver->beginFrame ();
+    driver
+        ->setPulseDuration (ServoId::SERVO_00, 2.0)
+        ->setPulseDuration (ServoId::SERVO_05, 1.0)
+        ->setPulseDuration (ServoId::SERVO_15, 1.5);
+    driver->commit ();
+    TEST_TRUE((simulated.chip->getOutputChanges () - outputChanges) > 1);
+    TEST_EQUALS(simulated.chip->getOutputOff (15), 307);
+
+    // a board attaches in either mode, and keeps it
+    PtrTo<AdafruitServoDriver<DeviceI2C> > attached = new AdafruitServoDriver<DeviceI2C> (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS, ADAFRUIT_SERVO_DRIVER_DEFAULT_PULSE_FREQUENCY, simulated.id, true);
+    TEST_TRUE(attached->isAttached ());
+    TEST_TRUE(attached->getOutputChange () == PCA9685OutputChange::ACK);
+}
+
+TEST_CASE(TestSimulatedBusCommitFailure) {
+    //Log::Scope scope (Log::TRACE);
+    SimulatedBus simulated (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS);
+    PtrTo<AdafruitServoDriver<DeviceI2C> > driver = new AdafruitServoDriver<DeviceI2C> (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS, ADAFRUIT_SERVO_DRIVER_DEFAULT_PULSE_FREQUENCY, simulated.id);
+
+    // with nothing known between them, the servos are three messages in one transfer, and a NAK
+    // on the second one leaves the chip with only the first
+    driver->invalidateImage ();
+    driver->beginFrame ();
+    driver
+        ->setPulseDuration (ServoId::SERVO_00, 1.0)
+        ->setPulseDuration (ServoId::SERVO_05, 1.5)
+        ->setPulseDuration (ServoId::SERVO_15, 2.0);
+    simulated.backend->nakNextTransfer (1);
+    EXPECT_FAIL(driver->commit ());
+    TEST_TRUE(not driver->isFraming ());
+    TEST_EQUALS(simulated.chip->getChannelOff (0), 205);
+    TEST_EQUALS(simulated.chip->getChannelOff (5), 0x1000);
+
+    // the image was forgotten, so the same frame is sent again in full
+    driver->beginFrame ();
+    driver
+        ->setPulseDuration (ServoId::SERVO_00, 1.0)
+        ->setPulseDuration (ServoId::SERVO_05, 1.5)
+        ->setPulseDuration (ServoId::SERVO_15, 2.0);
+    driver->commit ();
+    TEST_EQUALS(simulated.chip->getChannelOff (5), 307);
+    TEST_EQUALS(simulated.chip->getChannelOff (15), 410);
+}
+
+TEST_CASE(TestSimulatedBusShadowRefused) {
+    //Log::Scope scope (Log::TRACE);
+    // the driver keeps the register image, so it won't share a device with a shadow of its own
+    SimulatedBus simulated (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS);
+    PtrToDeviceI2C device = new DeviceI2C (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS, simulated.id);
+    device->enableShadow (0x06, 0x45);
+    EXPECT_FAIL(new AdafruitServoDriver<DeviceI2C> (device));
+
+    // and turning the shadow on later stops the next send
+    device->disableShadow ();
+    PtrTo<AdafruitServoDriver<DeviceI2C> > driver = new AdafruitServoDriver<DeviceI2C> (device);
+    driver->setPulseDuration (ServoId::SERVO_00, 1.0);
+    TEST_EQUALS(simulated.chip->getChannelOff (0), 205);
+    device->enableShadow (0x06, 0x45);
+    driver->beginFrame ();
+    driver->setPulseDuration (ServoId::SERVO_00, 1.5);
+    EXPECT_FAIL(driver->commit ());
+    TEST_EQUALS(simulated.chip->getChannelOff (0), 205);
+}
@@ -0,0 +1,57 @@
+#include "Test.h"
+#include "SimulatedBusBackend.h"
+#include "DeviceI2C.h"
+#include "PCA9685BringUp.h"
+#include "AdafruitServoDriver.h"
+#include "AdafruitMotorDriver.h"
+
+TEST_CASE(TestSimulatedBusPCA9685BringUp) {
+    //Log::Scope scope (Log::TRACE);
+    // four boards on each of two buses, at 400kHz
+    uint addresses[] = { 0x40, 0x41, 0x60, 0x61 };
+    uint busIds[2];
+    vector<PtrTo<SimulatedPCA9685> > chips;
+    vector<PCA9685Config> configs;
+    for (uint i = 0; i < 2; ++i) {
+        SimulatedBus simulated (addresses[0], 400000);
+        busIds[i] = simulated.id;
+        for (uint j = 0; j < 4; ++j) {
+            chips.push_back ((j == 0) ? simulated.chip : simulated.backend->addPCA9685 (addresses[j]));
+            configs.push_back (PCA9685Config (addresses[j], busIds[i], (addresses[j] < 0x60) ? ADAFRUIT_SERVO_DRIVER_DEFAULT_PULSE_FREQUENCY : PCA9685_DEFAULT_PULSE_FREQUENCY));
+        }
+    }
+
+    // constructing the boards one at a time waits for each of them, bringing them up together
+    // waits once per bus - every board on a bus has woken up before any of them restarts
+    PCA9685BringUp<DeviceI2C>::bringUp (configs);
+    for (uint i = 0; i < 2; ++i) {
+        uint64_t lastWake = 0;
+        uint64_t firstRestart = UINT64_MAX;
+        for (uint j = 0; j < 4; ++j) {
+            lastWake = max (lastWake, chips[(i * 4) + j]->getWakeTime ());
+            firstRestart = min (firstRestart, chips[(i * 4) + j]->getRestartTime ());
+        }
+        TEST_TRUE((lastWake > 0) and (lastWake < firstRestart));
+    }
+
+    for (uint i = 0; i < chips.size (); ++i) {
+        TEST_TRUE(not chips[i]->isSleeping ());
+        TEST_EQUALS(chips[i]->getTimingViolations (), 0);
+        TEST_EQUALS(chips[i]->getRegister (SimulatedPCA9685::MODE1), SimulatedPCA9685::AUTO_INCREMENT | SimulatedPCA9685::ALLCALL);
+        TEST_EQUALS(chips[i]->getRegister (SimulatedPCA9685::PRE_SCALE), (configs[i].address < 0x60) ? 121 : 5);
+        TEST_EQUALS(chips[i]->getChannelOff (7), 0x1000);
+    }
+
+    // the drivers attach to the boards as they were left
+    PtrTo<AdafruitServoDriver<DeviceI2C> > servoDriver = new AdafruitServoDriver<DeviceI2C> (0x40, ADAFRUIT_SERVO_DRIVER_DEFAULT_PULSE_FREQUENCY, busIds[1], true);
+    TEST_TRUE(servoDriver->isAttached ());
+    PtrTo<AdafruitMotorDriver<DeviceI2C> > motorDriver = new AdafruitMotorDriver<DeviceI2C> (0x61, PCA9685_DEFAULT_PULSE_FREQUENCY, busIds[0], true);
+    TEST_TRUE(motorDriver->isAttached ());
+    TEST_EQUALS(motorDriver->getMotorSpeed (MotorId::MOTOR_2), 0);
+
+    // a board nobody answers for fails the bring-up
+    vector<PCA9685Config> missing;
+    missing.push_back (PCA9685Config (0x42, busIds[0]));
+    missing.push_back (PCA9685Config (0x40, busIds[1]));
+    EXPECT_FAIL(PCA9685BringUp<DeviceI2C>::bringUp (missing));
+}
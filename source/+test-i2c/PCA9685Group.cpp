@@ -0,0 +1,108 @@
+#include "Test.h"
+#include "TestDevice.h"
+#include "SimulatedBusBackend.h"
+#include "DeviceI2C.h"
+#include "PCA9685Group.h"
+#include "AdafruitServoDriver.h"
+
+TEST_CASE(TestPCA9685Group) {
+    //Log::Scope scope (Log::TRACE);
+    PtrToTestDevice device = new TestDevice (0x40);
+    device
+        // constructor
+        ->expect (0x00, 0x31)
+        ->expect (0xfa, 0x00)
+        ->expect (0xfb, 0x00)
+        ->expect (0xfc, 0x00)
+        ->expect (0xfd, 0x10)
+        ->expect (0x01, 0x04)
+        ->expect (0x00, 0x21)
+        ->expect (0x00, 0x00)
+        // which calls setPulseFrequency
+        ->expect (0x00, (byte) 0x10)
+        ->expect (0xfe, (byte) 0x05)
+        ->expect (0x00, (byte) 0x00)
+        ->expect (0x00, (byte) 0x80)
+        // joining the group programs SUBADR2, and turns on SUB2 in MODE1 (which reads back as 0)
+        ->expect (0x03, (byte) 0xe6)
+        ->expect (0x00, (byte) 0x04);
+    PtrTo<PCA9685<TestDevice> > pca9685 = new PCA9685<TestDevice> (device);
+
+    PtrToTestDevice groupDevice = new TestDevice (0x73);
+    PtrTo<PCA9685Group<TestDevice> > group = new PCA9685Group<TestDevice> (groupDevice, 0x73, 2);
+    group->add (pca9685);
+    TEST_EQUALS(group->getBoardCount (), 1);
+
+    // channels go to the group device in ascending order
+    groupDevice
+        ->expect (0x0a, 0x00)
+        ->expect (0x0b, 0x00)
+        ->expect (0x0c, 0x00)
+        ->expect (0x0d, 0x01)
+        ->expect (0x0e, 0x00)
+        ->expect (0x0f, 0x10)
+        ->expect (0x10, 0x00)
+        ->expect (0x11, 0x00)
+        // all off
+        ->expect (0xfa, 0x00)
+        ->expect (0xfb, 0x00)
+        ->expect (0xfc, 0x00)
+        ->expect (0xfd, 0x10);
+    ChannelPulse pulses[] = { { 2, 0x1000, 0x0000 }, { 1, 0x0000, 0x0100 } };
+    group->setChannelPulses (pulses, 2);
+    group->allOff ();
+
+    // the emergency stop is the one full off byte, it doesn't depend on auto-increment
+    groupDevice->expect (0xfd, 0x10);
+    PCA9685Group<TestDevice>::emergencyAllOff (groupDevice);
+
+    TEST_ASSERTION(device->report ());
+    TEST_ASSERTION(groupDevice->report ());
+}
+
+TEST_CASE(TestSimulatedBusPCA9685Group) {
+    //Log::Scope scope (Log::TRACE);
+    SimulatedBus simulated (0x40);
+    PtrTo<SimulatedPCA9685> chipA = simulated.chip;
+    PtrTo<SimulatedPCA9685> chipB = simulated.backend->addPCA9685 (0x41);
+    PtrToBus bus = simulated.bus;
+    uint busId = simulated.id;
+    PtrTo<AdafruitServoDriver<DeviceI2C> > boardA = new AdafruitServoDriver<DeviceI2C> (0x40, ADAFRUIT_SERVO_DRIVER_DEFAULT_PULSE_FREQUENCY, busId);
+    PtrTo<AdafruitServoDriver<DeviceI2C> > boardB = new AdafruitServoDriver<DeviceI2C> (0x41, ADAFRUIT_SERVO_DRIVER_DEFAULT_PULSE_FREQUENCY, busId);
+
+    // nobody answers at the group address until the boards join
+    PtrTo<PCA9685Group<DeviceI2C> > group = new PCA9685Group<DeviceI2C> (PCA9685_DEFAULT_GROUP_ADDRESS, 1, busId);
+    EXPECT_FAIL(group->setChannelPulse (0, 0, 0x100));
+    group->add (boardA)->add (boardB);
+
+    // a common pose is one transfer, to both boards (after the address ioctl, the bus was talking to
+    // the last board that joined)
+    ChannelPulse pulses[16];
+    for (byte i = 0; i < 16; ++i) {
+        pulses[i].channel = i;
+        pulses[i].on = 0;
+        pulses[i].off = 0x100 + i;
+    }
+    uint64_t ioctlCount = bus->getIoctlCount ();
+    group->setChannelPulses (pulses, 16);
+    TEST_EQUALS(bus->getIoctlCount () - ioctlCount, 2);
+    TEST_EQUALS(chipA->getChannelOff (15), 0x10f);
+    TEST_EQUALS(chipB->getChannelOff (15), 0x10f);
+    group->setChannelPulseMs (3, 1.5);
+    TEST_EQUALS(chipA->getChannelOff (3), 307);
+    TEST_EQUALS(chipB->getChannelOff (3), 307);
+
+    // the boards forgot what they knew, so a board write after a group write still goes out
+    boardA->setPulseDuration (ServoId::SERVO_04, 1.0);
+    TEST_EQUALS(chipA->getChannelOff (4), 205);
+    TEST_EQUALS(chipB->getChannelOff (4), 0x104);
+
+    // and everybody stops at once, at the all-call address
+    ioctlCount = bus->getIoctlCount ();
+    PCA9685Group<DeviceI2C>::emergencyAllOff (busId);
+    TEST_EQUALS(bus->getIoctlCount () - ioctlCount, 2);
+    for (byte i = 0; i < 16; ++i) {
+        TEST_EQUALS(chipA->getOutputOff (i) & 0x1000, 0x1000);
+        TEST_EQUALS(chipB->getOutputOff (i) & 0x1000, 0x1000);
+    }
+}
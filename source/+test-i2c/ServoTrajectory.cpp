@@ -0,0 +1,102 @@
+#include "Test.h"
+#include "SimulatedBusBackend.h"
+#include "DeviceI2C.h"
+#include "NullDevice.h"
+#include "AdafruitServoDriver.h"
+#include "ServoTrajectory.h"
+
+TEST_CASE(TestServoTrajectory) {
+    //Log::Scope scope (Log::TRACE);
+    typedef AdafruitServoDriver<NullDevice> Driver;
+    PtrToNullDevice device = new NullDevice ();
+    PtrTo<Driver> driver = new Driver (device);
+    vector<PtrTo<Servo<Driver> > > servos;
+    servos.push_back (new Servo<Driver> (driver, ServoId::SERVO_00));
+    servos.push_back (new Servo<Driver> (driver, ServoId::SERVO_01));
+
+    // the period follows the driver
+    PtrTo<ServoTrajectory<Driver> > linear = new ServoTrajectory<Driver> (servos, ServoInterpolation::LINEAR);
+    TEST_TRUE(fabs (linear->getPeriod () - (1.0 / driver->getPulseFrequency ())) < 1.0e-6);
+
+    // linear interpolation, holding before the first keyframe and after the last
+    vector<double> from = { -1.0, 0.0 };
+    vector<double> to = { 1.0, 0.5 };
+    linear->addKeyframe (0.0, from)->addKeyframe (0.1, to);
+    vector<double> positions;
+    linear->getPositions (0.05, positions);
+    TEST_EQUALS(positions.size (), 2);
+    TEST_TRUE(fabs (positions[0]) < 1.0e-9);
+    TEST_TRUE(fabs (positions[1] - 0.25) < 1.0e-9);
+    linear->getPositions (1.0, positions);
+    TEST_EQUALS(positions[0], 1.0);
+
+    // cubic interpolation starts and ends at rest, and passes through the middle keyframe
+    PtrTo<ServoTrajectory<Driver> > cubic = new ServoTrajectory<Driver> (servos);
+    vector<double> middle = { 0.0, 0.25 };
+    cubic->addKeyframe (0.0, from)->addKeyframe (0.05, middle)->addKeyframe (0.1, to);
+    cubic->getPositions (0.05, positions);
+    TEST_TRUE(fabs (positions[0]) < 1.0e-9);
+    cubic->getPositions (0.001, positions);
+    double early = positions[0] - from[0];
+    cubic->getPositions (0.05, positions);
+    TEST_TRUE(early < ((positions[0] - from[0]) * 0.001 / 0.05));
+
+    // keyframes out of order, or with the wrong number of positions, are refused
+    uint refused = 0;
+    try {
+        cubic->addKeyframe (0.05, from);
+    } catch (RuntimeError& runtimeError) {
+        ++refused;
+    }
+    vector<double> single = { 0.0 };
+    try {
+        cubic->addKeyframe (0.2, single);
+    } catch (RuntimeError& runtimeError) {
+        ++refused;
+    }
+    TEST_EQUALS(refused, 2);
+
+    // play runs to the end, once per period
+    future<bool> result = linear->playFuture ();
+    TEST_TRUE(result.get ());
+    TEST_TRUE(not linear->isPlaying ());
+    TEST_TRUE(linear->getEmitCount () >= 2);
+    TEST_TRUE((linear->getEmitCount () + linear->getMissedCount ()) <= (uint) (0.1 / linear->getPeriod ()) + 2);
+    TEST_EQUALS(servos[0]->getPosition (), 1.0);
+    TEST_EQUALS(driver->getPulseDuration (ServoId::SERVO_01), 1.75);
+
+    // cancel stops it part way
+    PtrTo<ServoTrajectory<Driver> > slow = new ServoTrajectory<Driver> (servos, ServoInterpolation::LINEAR);
+    slow->addKeyframe (10.0, from);
+    result = slow->playFuture ();
+    TEST_TRUE(not slow->play ());
+    Pause::milli (50);
+    slow->cancel ();
+    TEST_TRUE(not result.get ());
+    TEST_TRUE(servos[0]->getPosition () > -1.0);
+}
+
+TEST_CASE(TestSimulatedBusServoTrajectory) {
+    //Log::Scope scope (Log::TRACE);
+    typedef AdafruitServoDriver<DeviceI2C> Driver;
+    SimulatedBus simulated (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS);
+    PtrTo<Driver> driver = new Driver (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS, ADAFRUIT_SERVO_DRIVER_DEFAULT_PULSE_FREQUENCY, simulated.id);
+
+    // all sixteen servos move every update, in one transfer for the board
+    vector<PtrTo<Servo<Driver> > > servos;
+    vector<double> up, down;
+    for (uint i = 0; i < SERVO_COUNT; ++i) {
+        servos.push_back (new Servo<Driver> (driver, static_cast<ServoId> (i)));
+        up.push_back (0.5);
+        down.push_back (-0.5);
+    }
+    PtrTo<ServoTrajectory<Driver> > trajectory = new ServoTrajectory<Driver> (servos);
+    trajectory->addKeyframe (0.1, up)->addKeyframe (0.2, down);
+    uint64_t ioctlCount = simulated.bus->getIoctlCount ();
+    TEST_TRUE(trajectory->playFuture ().get ());
+    TEST_TRUE((simulated.bus->getIoctlCount () - ioctlCount) <= trajectory->getEmitCount ());
+    for (uint i = 0; i < SERVO_COUNT; ++i) {
+        TEST_EQUALS(driver->getPulseDuration (static_cast<ServoId> (i)), 1.25);
+    }
+    TEST_EQUALS(simulated.chip->getOutputOff (15), simulated.chip->getOutputOff (0));
+}
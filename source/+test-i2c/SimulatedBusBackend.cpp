@@ -0,0 +1,131 @@
+#include "Test.h"
+#include "SimulatedBusBackend.h"
+#include "DeviceI2C.h"
+#include "AdafruitServoDriver.h"
+#include "AdafruitMotorDriver.h"
+
+TEST_CASE(TestSimulatedPCA9685) {
+    //Log::Scope scope (Log::TRACE);
+    SimulatedPCA9685 device (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS);
+
+    // power-on state
+    TEST_TRUE(device.isSleeping ());
+    TEST_EQUALS(device.getRegister (SimulatedPCA9685::PRE_SCALE), 0x1e);
+    TEST_EQUALS(device.getChannelOff (0), 0x1000);
+    TEST_TRUE(device.respondsTo (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS));
+    TEST_TRUE(device.respondsTo (0x70));
+    TEST_TRUE(not device.respondsTo (0x71));
+
+    // without auto-increment, a run of values all land in the same register
+    byte run[] = { 0x06, 0x01, 0x02, 0x03 };
+    device.write (run, 4);
+    TEST_EQUALS(device.getRegister (0x06), 0x03);
+    TEST_EQUALS(device.getRegister (0x07), 0x00);
+
+    // with it, they go to consecutive registers, skipping from the last LED register to ALL_LED
+    byte mode[] = { SimulatedPCA9685::MODE1, SimulatedPCA9685::SLEEP | SimulatedPCA9685::AUTO_INCREMENT | SimulatedPCA9685::ALLCALL };
+    device.write (mode, 2);
+    device.write (run, 4);
+    TEST_EQUALS(device.getRegister (0x07), 0x02);
+    TEST_EQUALS(device.getChannelOn (0), 0x0201);
+    byte wrap[] = { 0x45, 0x00, 0x22 };
+    device.write (wrap, 3);
+    for (uint channel = 0; channel < SimulatedPCA9685::CHANNEL_COUNT; ++channel) {
+        TEST_EQUALS(device.getRegister (SimulatedPCA9685::LED_BASE + (channel * 4)), 0x22);
+    }
+
+    // the ALL_LED registers read back as 0
+    byte readBack[4];
+    byte at = SimulatedPCA9685::ALL_LED_BASE;
+    device.write (&at, 1);
+    device.read (readBack, 4);
+    TEST_EQUALS(readBack[0], 0x00);
+
+    // the pre-scale only changes while sleeping
+    byte preScale[] = { SimulatedPCA9685::PRE_SCALE, 0x79 };
+    device.write (preScale, 2);
+    TEST_EQUALS(device.getRegister (SimulatedPCA9685::PRE_SCALE), 0x79);
+    byte wake[] = { SimulatedPCA9685::MODE1, SimulatedPCA9685::AUTO_INCREMENT | SimulatedPCA9685::ALLCALL };
+    device.write (wake, 2);
+    TEST_TRUE(not device.isSleeping ());
+    preScale[1] = 0x03;
+    device.write (preScale, 2);
+    TEST_EQUALS(device.getRegister (SimulatedPCA9685::PRE_SCALE), 0x79);
+
+    // going to sleep sets RESTART, restarting too soon after waking up is a timing violation
+    device.write (mode, 2);
+    TEST_EQUALS(device.getRegister (SimulatedPCA9685::MODE1) & SimulatedPCA9685::RESTART, SimulatedPCA9685::RESTART);
+    device.write (wake, 2);
+    byte restart[] = { SimulatedPCA9685::MODE1, SimulatedPCA9685::RESTART | SimulatedPCA9685::AUTO_INCREMENT | SimulatedPCA9685::ALLCALL };
+    device.write (restart, 2);
+    TEST_EQUALS(device.getRegister (SimulatedPCA9685::MODE1) & SimulatedPCA9685::RESTART, 0);
+    TEST_EQUALS(device.getTimingViolations (), 1);
+}
+
+TEST_CASE(TestSimulatedBusServoDriver) {
+    //Log::Scope scope (Log::TRACE);
+    SimulatedBus simulated (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS);
+    EXPECT_FAIL(Bus::addBus (simulated.id, "simulated", simulated.backend));
+
+    // the whole driver stack runs unchanged on the simulated bus
+    PtrTo<AdafruitServoDriver<DeviceI2C> > driver = new AdafruitServoDriver<DeviceI2C> (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS, ADAFRUIT_SERVO_DRIVER_DEFAULT_PULSE_FREQUENCY, simulated.id);
+    TEST_TRUE(not simulated.chip->isSleeping ());
+    TEST_EQUALS(simulated.chip->getRegister (SimulatedPCA9685::MODE1) & SimulatedPCA9685::AUTO_INCREMENT, SimulatedPCA9685::AUTO_INCREMENT);
+    TEST_EQUALS(simulated.chip->getRegister (SimulatedPCA9685::PRE_SCALE), 121);
+    TEST_EQUALS(simulated.chip->getTimingViolations (), 0);
+
+    driver->setPulseDuration (ServoId::SERVO_03, 1.5);
+    TEST_EQUALS(simulated.chip->getChannelOn (3), 0);
+    TEST_EQUALS(simulated.chip->getChannelOff (3), 307);
+    TEST_EQUALS(simulated.chip->getChannelOff (2), 0x1000);
+
+    // nobody answers at an empty address
+    DeviceI2C nobody (0x41, simulated.id);
+    nobody.begin ();
+    EXPECT_FAIL(nobody.write (0x06, 0x00)->flush ());
+    nobody.end ();
+    TEST_EQUALS(simulated.bus->getStatistics ().getAddress (0x41).getErrors (), 1);
+}
+
+TEST_CASE(TestSimulatedBusDevice) {
+    //Log::Scope scope (Log::TRACE);
+    SimulatedBus simulated (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS);
+    byte autoIncrement[] = { SimulatedPCA9685::MODE1, SimulatedPCA9685::AUTO_INCREMENT | SimulatedPCA9685::ALLCALL };
+    simulated.chip->write (autoIncrement, 2);
+
+    // a coalesced flush lands in consecutive registers, and the shadow drops repeats
+    DeviceI2C device (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS, simulated.id);
+    device.enableAutoIncrement ()->enableShadow (0x06, 0x45);
+    device.begin ()->write (0x0a, 0x01)->write (0x0b, 0x00)->write (0x0c, 0x34)->write (0x0d, 0x02)->end ();
+    TEST_EQUALS(simulated.chip->getChannelOff (1), 0x0234);
+    device.begin ()->write (0x0a, 0x01)->write (0x0b, 0x00)->write (0x0c, 0x35)->write (0x0d, 0x02)->end ();
+    TEST_EQUALS(simulated.chip->getChannelOff (1), 0x0235);
+    TEST_EQUALS(device.getShadowBytesSaved (), 3);
+    TEST_EQUALS(device.getStatistics ().getBytesWritten (), 7);
+
+    // a transaction writes and reads back in one transfer
+    Transaction transaction;
+    byte values[] = { 0x00, 0x00, 0x00, 0x01 };
+    transaction.writeAt (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS, 0x42, values, 4);
+    uint read = transaction.readAt (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS, 0x3e, 8);
+    transaction.submit (simulated.bus);
+    TEST_EQUALS(transaction.getRead (read, 4), 0x00);
+    TEST_EQUALS(transaction.getRead (read, 7), 0x01);
+    TEST_EQUALS(simulated.chip->getChannelOff (15), 0x0100);
+
+    // the worker sends submitted writes in order
+    BusWorker::start (simulated.bus, 4);
+    for (int i = 0; i < 16; ++i) {
+        device.write (0x0c, byte (i))->submit ();
+    }
+    TEST_TRUE(device.submitFuture ().get ());
+    TEST_EQUALS(simulated.chip->getChannelOff (1), 0x020f);
+    BusWorker::stop (simulated.bus);
+
+    // at 400 kHz, a 1-byte register write is 3 bytes on the wire (address, register, value), about
+    // 70 microseconds with the start and stop
+    simulated.backend->setFrequency (400000);
+    device.disableShadow ();
+    device.begin ()->write (0x0c, 0x00)->end ();
+    TEST_EQUALS(simulated.backend->getWireNanoseconds (), 72500);
+}
@@ -1,6 +1,7 @@
 #include "Test.h"
 #include "AdafruitMotorDriver.h"
 #include "NullDevice.h"
+#include "SimulatedBusBackend.h"
 #include "DeviceI2C.h"
 #include "StepperMotor.h"
 
@@ -18,6 +19,152 @@ TEST_CASE(TestStepperMotor) {
     TEST_EQUALS(driver->getMotorSpeed (MotorId::MOTOR_1), 0);
 }
 
+TEST_CASE(TestStepperMotorTurnAsync) {
+    //Log::Scope scope (Log::TRACE);
+
+    PtrToNullDevice device = new NullDevice ();
+    PtrTo<AdafruitMotorDriver<NullDevice> > driver = new AdafruitMotorDriver<NullDevice> (device);
+    PtrTo<StepperMotor<AdafruitMotorDriver<NullDevice> > > stepper = StepperMotor<AdafruitMotorDriver<NullDevice> >::getFullStepper (driver, MotorId::MOTOR_0, MotorId::MOTOR_1, 1.8);
+
+    // a turn runs to the end on its own thread, the caller is free while it does
+    PtrTo<StepperTurn<AdafruitMotorDriver<NullDevice> > > turn = stepper->turnAsync (0.5, 0.1);
+    TEST_TRUE(stepper->isTurning ());
+    TEST_TRUE(not turn->isDone ());
+    turn->wait ();
+    TEST_TRUE(turn->isDone ());
+    TEST_TRUE(not stepper->isTurning ());
+    TEST_EQUALS(turn->getStepsTaken (), turn->getStepCount ());
+    TEST_EQUALS(turn->getRevolutions (), 0.5);
+    TEST_EQUALS(stepper->getPosition (), turn->getStepsTaken ());
+
+    // the turn was planned to take the time it was asked to
+    TEST_TRUE(fabs (turn->getRequestedTime () - 0.1) < 0.002);
+
+    // a cancelled turn slows down over the steps it took to speed up, the soft start ramp speeds
+    // up all the way to the middle, so a turn cancelled at step n (before the middle) stops at 2n
+    int position = stepper->getPosition ();
+    turn = stepper->turnAsync (-1.0, 1.0);
+    while ((turn->getStepsTaken () < 20) and (not turn->isDone ())) {
+        Pause::micro (100);
+    }
+    turn->cancel ()->wait ();
+    int taken = turn->getStepsTaken ();
+    TEST_TRUE(turn->isCancelled ());
+    TEST_EQUALS(taken, turn->getStepCount ());
+    TEST_TRUE((taken >= 40) and (taken < 200) and ((taken % 2) == 0));
+    TEST_TRUE(turn->getRevolutions () > -0.5);
+    TEST_EQUALS(stepper->getPosition (), position - taken);
+
+    // one turn at a time
+    turn = stepper->turnAsync (1.0, 1.0);
+    bool refused = false;
+    try {
+        stepper->turnAsync (1.0);
+    } catch (RuntimeError& runtimeError) {
+        refused = true;
+    }
+    TEST_TRUE(refused);
+    turn->cancel ()->wait ();
+}
+
+TEST_CASE(TestStepperMotionPlan) {
+    //Log::Scope scope (Log::TRACE);
+
+    PtrToNullDevice device = new NullDevice ();
+    PtrTo<AdafruitMotorDriver<NullDevice> > driver = new AdafruitMotorDriver<NullDevice> (device);
+    PtrTo<StepperMotor<AdafruitMotorDriver<NullDevice> > > stepper = StepperMotor<AdafruitMotorDriver<NullDevice> >::getFullStepper (driver, MotorId::MOTOR_0, MotorId::MOTOR_1, 1.8);
+
+    // trapezoidal - 1/4s up to 1 rev/s covering 1/8 rev, 3/4s cruising, and 1/4s back down
+    PtrTo<StepperMotionPlan> plan = stepper->planTurn (1.0, StepperMotionLimits (1.0, 4.0));
+    TEST_EQUALS(plan->getStepCount (), 200);
+    TEST_TRUE(fabs (plan->getDuration () - 1.25) < 1.0e-6);
+    TEST_TRUE(fabs (plan->getPeakVelocity () - 1.0) < 1.0e-9);
+    TEST_EQUALS(plan->getRampSteps (), 25);
+    uint64_t total = 0;
+    for (int i = 0; i <= plan->getStepCount (); ++i) {
+        total += plan->getInterval (i);
+    }
+    TEST_TRUE(fabs ((total / 1.0e9) - plan->getDuration ()) < 1.0e-6);
+
+    // every planner turns a revolution into the same steps, and waits before each step
+    PtrTo<StepperMotionPlan> ramp = stepper->planTurn (1.0, 1.0);
+    TEST_EQUALS(ramp->getStepCount (), plan->getStepCount ());
+    TEST_EQUALS(stepper->planSteps (200, 1.0)->getStepCount (), ramp->getStepCount ());
+    TEST_TRUE(ramp->getInterval (0) > 0);
+    TEST_EQUALS(ramp->getInterval (ramp->getStepCount ()), 0);
+    TEST_TRUE(plan->getInterval (0) > 0);
+    TEST_EQUALS(plan->getInterval (plan->getStepCount ()), 0);
+
+    // the cruise intervals are one step at the velocity limit, and the ends slow down the way the
+    // start speeds up
+    TEST_TRUE(abs (int64_t (plan->getInterval (100)) - 5000000) < 1000);
+    TEST_TRUE(plan->getInterval (1) > plan->getInterval (10));
+    TEST_TRUE(abs (int64_t (plan->getInterval (1)) - int64_t (plan->getInterval (198))) < 1000);
+
+    // a short move never reaches the velocity limit
+    plan = stepper->planTurn (-0.1, StepperMotionLimits (1.0, 4.0));
+    TEST_EQUALS(plan->getRevolutions (), -0.1);
+    TEST_TRUE(fabs (plan->getPeakVelocity () - sqrt (0.4)) < 1.0e-6);
+    TEST_TRUE(fabs (plan->getDuration () - (2.0 * sqrt (0.4) / 4.0)) < 1.0e-6);
+
+    // limiting the jerk takes longer, but gets the same place
+    PtrTo<StepperMotionPlan> sCurve = stepper->planTurn (1.0, StepperMotionLimits (1.0, 4.0, 40.0));
+    TEST_EQUALS(sCurve->getStepCount (), 200);
+    TEST_TRUE(fabs (sCurve->getDuration () - 1.35) < 1.0e-6);
+    TEST_TRUE(sCurve->getInterval (0) > stepper->planTurn (1.0, StepperMotionLimits (1.0, 4.0))->getInterval (0));
+
+    // play one back
+    int position = stepper->getPosition ();
+    plan = stepper->planTurn (0.25, StepperMotionLimits (5.0, 50.0));
+    PtrTo<StepperTurn<AdafruitMotorDriver<NullDevice> > > turn = stepper->turnAsync (plan);
+    turn->wait ();
+    TEST_EQUALS(stepper->getPosition (), position + 50);
+    TEST_EQUALS(turn->getRequestedTime (), plan->getDuration ());
+}
+
+TEST_CASE(TestStepperMotorTurnTogether) {
+    //Log::Scope scope (Log::TRACE);
+
+    typedef StepperMotor<AdafruitMotorDriver<NullDevice> > Stepper;
+    PtrToNullDevice device = new NullDevice ();
+    PtrTo<AdafruitMotorDriver<NullDevice> > driver = new AdafruitMotorDriver<NullDevice> (device);
+    vector<PtrTo<Stepper> > steppers;
+    steppers.push_back (Stepper::getFullStepper (driver, MotorId::MOTOR_0, MotorId::MOTOR_1, 1.8));
+    steppers.push_back (Stepper::getHalfStepper (driver, MotorId::MOTOR_2, MotorId::MOTOR_3, 1.8));
+
+    // both axes finish together, the longer one follows the plan
+    vector<int> steps = { 100, -40 };
+    PtrTo<StepperMotionPlan> plan = steppers[0]->planSteps (100, StepperMotionLimits (2.0, 20.0));
+    TEST_EQUALS(plan->getStepCount (), 100);
+    Stepper::turnTogether (steppers, steps, plan);
+    TEST_EQUALS(steppers[0]->getPosition (), 100);
+    TEST_EQUALS(steppers[1]->getPosition (), -40);
+    TEST_TRUE(not steppers[0]->isTurning ());
+
+    // part way through, the axes have moved in proportion
+    steps = { -50, 100 };
+    plan = steppers[1]->planSteps (100, 0.5);
+    PtrTo<StepperTurn<AdafruitMotorDriver<NullDevice> > > turn = Stepper::turnTogetherAsync (steppers, steps, plan);
+    TEST_TRUE(steppers[0]->isTurning () and steppers[1]->isTurning ());
+    while ((turn->getStepsTaken () < 10) and (not turn->isDone ())) {
+        Pause::micro (100);
+    }
+    turn->cancel ()->wait ();
+    int taken = turn->getStepsTaken ();
+    TEST_TRUE((taken >= 20) and (taken < 100));
+    TEST_EQUALS(steppers[1]->getPosition (), -40 + taken);
+    TEST_TRUE(abs ((100 - steppers[0]->getPosition ()) - (taken / 2)) <= 1);
+
+    // the plan has to match the longest axis
+    bool refused = false;
+    try {
+        Stepper::turnTogether (steppers, steps, steppers[0]->planSteps (50, 0.1));
+    } catch (RuntimeError& runtimeError) {
+        refused = true;
+    }
+    TEST_TRUE(refused);
+}
+
 template<typename DeviceType>
 void backAndForth (PtrTo<StepperMotor<AdafruitMotorDriver<DeviceType> > > stepper) {
     Log::debug () << stepper->getDescription () << " - forward" << endl;
@@ -40,9 +187,42 @@ TEST_CASE(LiveTestStepperMotor) {
         PtrTo<AdafruitMotorDriver<DeviceI2C> > driver = new AdafruitMotorDriver<DeviceI2C> ();
         PtrTo<StepperMotor<AdafruitMotorDriver<DeviceI2C> > > stepper = StepperMotor<AdafruitMotorDriver<DeviceI2C> >::getHalfStepper (driver, MotorId::MOTOR_0, MotorId::MOTOR_1, 1.8);
         backAndForth (stepper);
+
+        // the steps are on deadlines, so the turn takes the time it was planned to
+        PtrTo<StepperTurn<AdafruitMotorDriver<DeviceI2C> > > turn = stepper->turnAsync (0.5, 0.25);
+        turn->wait ();
+        stepper->stop ();
+        Log::debug () << "LiveTestStepperMotor: " << "turn took " << (turn->getElapsedTime () * 1.0e3) << "ms, planned " << (turn->getRequestedTime () * 1.0e3) << "ms, step write " << (turn->getStepWriteTime () * 1.0e6) << "us" << endl;
+        TEST_TRUE(fabs (turn->getElapsedTime () - turn->getRequestedTime ()) < 0.01);
     } catch (RuntimeError& runtimeError) {
         Log::exception (runtimeError);
     } catch (...) {
     }
     TEST_TRUE(true);
 }
+
+TEST_CASE(TestSimulatedBusStepperTurnTogether) {
+    //Log::Scope scope (Log::TRACE);
+    SimulatedBus simulated (ADAFRUIT_MOTOR_DRIVER_DEFAULT_ADDRESS);
+    typedef AdafruitMotorDriver<DeviceI2C> Driver;
+    typedef StepperMotor<Driver> Stepper;
+    PtrTo<Driver> driver = new Driver (ADAFRUIT_MOTOR_DRIVER_DEFAULT_ADDRESS, PCA9685_DEFAULT_PULSE_FREQUENCY, simulated.id);
+    vector<PtrTo<Stepper> > steppers;
+    steppers.push_back (Stepper::getFullStepper (driver, MotorId::MOTOR_0, MotorId::MOTOR_1, 1.8));
+    steppers.push_back (Stepper::getFullStepper (driver, MotorId::MOTOR_2, MotorId::MOTOR_3, 1.8));
+
+    // both steppers on the hat, four coils, one transfer per tick. the steppers don't change the
+    // priority of the driver they share
+    vector<int> steps = { 40, 40 };
+    uint64_t ioctlCount = simulated.bus->getIoctlCount ();
+    Stepper::turnTogether (steppers, steps, steppers[0]->planSteps (40, 0));
+    TEST_EQUALS(simulated.bus->getIoctlCount () - ioctlCount, 40);
+    TEST_EQUALS(steppers[0]->getPosition (), 40);
+    TEST_EQUALS(steppers[1]->getPosition (), 40);
+    TEST_EQUALS(simulated.bus->getStatistics ().getMutexWait (BusPriority::REALTIME).getCount (), 0);
+
+    // unless asked to
+    steppers[0]->setPriority (BusPriority::REALTIME);
+    Stepper::turnTogether (steppers, steps, steppers[0]->planSteps (40, 0));
+    TEST_TRUE(simulated.bus->getStatistics ().getMutexWait (BusPriority::REALTIME).getCount () >= 40);
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Log.h"
+#include "BusPriority.h"
 
 class Expectation {
     public:
@@ -42,6 +43,13 @@ MAKE_PTR_TO(TestDevice) {
             return this;
         }
 
+        TestDevice* readBlock (byte at, byte* out, uint count) {
+            for (uint i = 0; i < count; ++i) {
+                out[i] = read (byte (at + i));
+            }
+            return this;
+        }
+
         TestDevice* write (byte at, byte b) {
             if (expectations.size () > 0) {
                 Expectation& currentExpectation = expectations.front ();
@@ -65,6 +73,26 @@ MAKE_PTR_TO(TestDevice) {
             return this;
         }
 
+        TestDevice* flushCombined () {
+            return flush ();
+        }
+
+        TestDevice* invalidate (byte first = 0x00, byte last = 0xff) {
+            return this;
+        }
+
+        TestDevice* setPriority (BusPriority priority) {
+            return this;
+        }
+
+        TestDevice* enableAutoIncrement () {
+            return this;
+        }
+
+        bool isShadowEnabled () {
+            return false;
+        }
+
         void end () {
         }
 
@@ -0,0 +1,65 @@
+#include "Test.h"
+#include "Transaction.h"
+#include "DeviceI2C.h"
+#include "AdafruitMotorDriver.h"
+#include "AdafruitServoDriver.h"
+
+TEST_CASE(TestTransaction) {
+    //Log::Scope scope (Log::TRACE);
+    Transaction transaction;
+
+    // consecutive register writes to the same device merge into one message
+    transaction
+        .writeAt (ADAFRUIT_MOTOR_DRIVER_DEFAULT_ADDRESS, 0x42, 0x00)
+        ->writeAt (ADAFRUIT_MOTOR_DRIVER_DEFAULT_ADDRESS, 0x43, 0x00)
+        ->writeAt (ADAFRUIT_MOTOR_DRIVER_DEFAULT_ADDRESS, 0x44, 0x34)
+        ->writeAt (ADAFRUIT_MOTOR_DRIVER_DEFAULT_ADDRESS, 0x45, 0x02);
+    TEST_EQUALS(transaction.getMessageCount (), 1);
+    TEST_EQUALS(transaction.getByteCount (), 5);
+
+    // a different device, or a gap in the registers, starts a new message
+    transaction
+        .writeAt (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS, 0x46, 0x00)
+        ->writeAt (ADAFRUIT_MOTOR_DRIVER_DEFAULT_ADDRESS, 0x06, 0x00);
+    TEST_EQUALS(transaction.getMessageCount (), 3);
+
+    // a read is a write of the register followed by the read itself
+    uint read = transaction.readAt (ADAFRUIT_MOTOR_DRIVER_DEFAULT_ADDRESS, 0x42, 4);
+    TEST_EQUALS(transaction.getMessageCount (), 5);
+    TEST_EQUALS(read, 4);
+    EXPECT_FAIL(transaction.getRead (0));
+    EXPECT_FAIL(transaction.getRead (read, 4));
+
+    transaction.reset ();
+    TEST_EQUALS(transaction.getMessageCount (), 0);
+    TEST_EQUALS(transaction.getByteCount (), 0);
+
+    // running out of room is an error
+    for (int i = 0; i < TRANSACTION_MESSAGE_COUNT; ++i) {
+        transaction.writeAt (ADAFRUIT_MOTOR_DRIVER_DEFAULT_ADDRESS + (i & 0x01), 0x06, 0x00);
+    }
+    EXPECT_FAIL(transaction.writeAt (ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS, 0x06, 0x00));
+}
+
+TEST_CASE(LiveTestTransaction) {
+    try {
+        //Log::Scope scope (Log::TRACE);
+        PtrToBus bus = Bus::getBusByIndex (0);
+
+        // set LED15 on the motor driver and read it back, in one transfer. auto-increment has to
+        // be on (MODE1, bit 5), which the PCA9685 constructor does for us
+        PtrTo<AdafruitMotorDriver<DeviceI2C> > driver = new AdafruitMotorDriver<DeviceI2C> ();
+        Transaction transaction;
+        byte values[] = { 0x00, 0x00, 0x34, 0x02 };
+        transaction.writeAt (ADAFRUIT_MOTOR_DRIVER_DEFAULT_ADDRESS, 0x42, values, 4);
+        uint read = transaction.readAt (ADAFRUIT_MOTOR_DRIVER_DEFAULT_ADDRESS, 0x42, 4);
+        transaction.submit (bus);
+        for (uint i = 0; i < 4; ++i) {
+            TEST_EQUALS(transaction.getRead (read, i), values[i]);
+        }
+    } catch (RuntimeError& runtimeError) {
+        Log::exception (runtimeError);
+    } catch (...) {
+    }
+    TEST_TRUE(true);
+}
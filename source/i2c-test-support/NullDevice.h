@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Common.h"
+#include "BusPriority.h"
 
 MAKE_PTR_TO(NullDevice) {
     public:
@@ -24,6 +25,13 @@ MAKE_PTR_TO(NullDevice) {
             return this;
         }
 
+        NullDevice* readBlock (byte at, byte* out, uint count) {
+            for (uint i = 0; i < count; ++i) {
+                out[i] = read (byte (at + i));
+            }
+            return this;
+        }
+
         // writes are buffered
         NullDevice* write (byte at, byte value) {
             return this;
@@ -34,6 +42,26 @@ MAKE_PTR_TO(NullDevice) {
             return this;
         }
 
+        NullDevice* flushCombined () {
+            return flush ();
+        }
+
+        NullDevice* invalidate (byte first = 0x00, byte last = 0xff) {
+            return this;
+        }
+
+        NullDevice* setPriority (BusPriority priority) {
+            return this;
+        }
+
+        NullDevice* enableAutoIncrement () {
+            return this;
+        }
+
+        bool isShadowEnabled () {
+            return false;
+        }
+
         void end () {
         }
 
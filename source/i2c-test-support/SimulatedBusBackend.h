@@ -0,0 +1,504 @@
+#pragma once
+
+#include "Bus.h"
+
+// an in-process stand-in for the kernel I2C interface, so the bus, the devices, and the drivers
+// above them can be tested and benchmarked without any hardware. the backend answers the same
+// ioctl calls the kernel does, routes each message to the simulated devices that respond to its
+// address, and (optionally) takes as long as the message would take on a real wire.
+
+// a device on the simulated bus. a write message starts with the register pointer, followed by
+// the values to write from there, and a read returns values from wherever the pointer is.
+MAKE_PTR_TO(SimulatedDevice) {
+    public:
+        virtual ~SimulatedDevice () {}
+
+        virtual bool respondsTo (uint address) = 0;
+
+        virtual void write (const byte* data, uint count) = 0;
+
+        virtual void read (byte* data, uint count) = 0;
+
+        // the STOP at the end of a transfer, for the devices that act on it
+        virtual void stop () {}
+};
+
+// a register model of the PCA9685 (https://cdn-shop.adafruit.com/datasheets/PCA9685.pdf), with
+// power-on defaults, auto-increment, the ALL_LED registers, sub-addresses and all-call, the SLEEP
+// and RESTART bits in MODE1, and PRE_SCALE only being writable while the oscillator sleeps. the
+// outputs follow the LED registers on the STOP at the end of a transfer, or on every byte with the
+// OCH bit of MODE2 set, and the number of times they changed is counted.
+class SimulatedPCA9685 : public SimulatedDevice {
+    public:
+        enum {
+            // registers
+            MODE1 = 0x00,
+            MODE2 = 0x01,
+            SUBADR1 = 0x02,
+            SUBADR2 = 0x03,
+            SUBADR3 = 0x04,
+            ALLCALLADR = 0x05,
+            LED_BASE = 0x06,
+            LED_LAST = 0x45,
+            ALL_LED_BASE = 0xfa,
+            ALL_LED_LAST = 0xfd,
+            PRE_SCALE = 0xfe,
+
+            // MODE2 bits
+            OCH = 0x08,
+
+            // MODE1 bits
+            RESTART = 0x80,
+            AUTO_INCREMENT = 0x20,
+            SLEEP = 0x10,
+            SUB1 = 0x08,
+            SUB2 = 0x04,
+            SUB3 = 0x02,
+            ALLCALL = 0x01,
+
+            // the oscillator needs this long after waking up before the outputs can restart
+            WAKE_NANOSECONDS = 500000,
+
+            CHANNEL_COUNT = 16
+        };
+
+    private:
+        uint address;
+        byte registers[256];
+        byte pointer;
+        uint64_t wakeTime;
+        uint64_t restartTime;
+        uint timingViolations;
+        byte outputs[LED_LAST + 1];
+        uint outputChanges;
+
+        // the outputs take on the values in the LED registers
+        void latch () {
+            bool changed = false;
+            for (uint at = LED_BASE; at <= LED_LAST; ++at) {
+                changed = changed or (outputs[at] != registers[at]);
+                outputs[at] = registers[at];
+            }
+            if (changed) {
+                ++outputChanges;
+            }
+        }
+
+        void advance () {
+            // auto-increment skips the reserved registers after the last LED register
+            if (registers[MODE1] & AUTO_INCREMENT) {
+                pointer = (pointer == LED_LAST) ? byte (ALL_LED_BASE) : byte (pointer + 1);
+            }
+        }
+
+        void writeRegister (byte at, byte value) {
+            if (at == MODE1) {
+                byte old = registers[MODE1];
+
+                // writing 1 to RESTART clears it (and restarts the outputs), writing 0 leaves it
+                bool restart = (old & RESTART) and (not (value & RESTART));
+                if (value & RESTART) {
+                    restartTime = BusStatistics::now ();
+                    if ((old & RESTART) and ((restartTime - wakeTime) < WAKE_NANOSECONDS)) {
+                        ++timingViolations;
+                    }
+                }
+                value = (value & ~RESTART) | (restart ? RESTART : 0);
+
+                // going to sleep leaves RESTART set, waking up starts the oscillator
+                if ((not (old & SLEEP)) and (value & SLEEP)) {
+                    value |= RESTART;
+                } else if ((old & SLEEP) and (not (value & SLEEP))) {
+                    wakeTime = BusStatistics::now ();
+                }
+                registers[MODE1] = value;
+            } else if (at == PRE_SCALE) {
+                // the pre-scale can only be changed while the oscillator is off
+                if (registers[MODE1] & SLEEP) {
+                    registers[PRE_SCALE] = value;
+                }
+            } else if ((at >= ALL_LED_BASE) and (at <= ALL_LED_LAST)) {
+                for (uint channel = 0; channel < CHANNEL_COUNT; ++channel) {
+                    registers[LED_BASE + (channel * 4) + (at - ALL_LED_BASE)] = value;
+                }
+            } else {
+                registers[at] = value;
+            }
+
+            // with OCH set, the outputs change on the acknowledge of each byte
+            if (registers[MODE2] & OCH) {
+                latch ();
+            }
+        }
+
+        byte readRegister (byte at) {
+            // the ALL_LED registers always read as 0
+            return ((at >= ALL_LED_BASE) and (at <= ALL_LED_LAST)) ? 0 : registers[at];
+        }
+
+    public:
+        SimulatedPCA9685 (uint _address) : address (_address) {
+            reset ();
+        }
+
+        // power-on state
+        void reset () {
+            for (uint i = 0; i < 256; ++i) {
+                registers[i] = 0;
+            }
+            registers[MODE1] = SLEEP | ALLCALL;
+            registers[MODE2] = 0x04;
+            registers[SUBADR1] = 0xe2;
+            registers[SUBADR2] = 0xe4;
+            registers[SUBADR3] = 0xe8;
+            registers[ALLCALLADR] = 0xe0;
+            for (uint channel = 0; channel < CHANNEL_COUNT; ++channel) {
+                registers[LED_BASE + (channel * 4) + 3] = 0x10;
+            }
+            registers[PRE_SCALE] = 0x1e;
+            pointer = 0;
+            wakeTime = 0;
+            restartTime = 0;
+            timingViolations = 0;
+            for (uint at = LED_BASE; at <= LED_LAST; ++at) {
+                outputs[at] = registers[at];
+            }
+            outputChanges = 0;
+        }
+
+        bool respondsTo (uint _address) {
+            // the sub-address and all-call registers hold 8-bit addresses (the 7-bit address
+            // shifted up by one)
+            byte mode1 = registers[MODE1];
+            return (_address == address) or
+                ((mode1 & ALLCALL) and (_address == uint (registers[ALLCALLADR] >> 1))) or
+                ((mode1 & SUB1) and (_address == uint (registers[SUBADR1] >> 1))) or
+                ((mode1 & SUB2) and (_address == uint (registers[SUBADR2] >> 1))) or
+                ((mode1 & SUB3) and (_address == uint (registers[SUBADR3] >> 1)));
+        }
+
+        void write (const byte* data, uint count) {
+            if (count > 0) {
+                pointer = data[0];
+                for (uint i = 1; i < count; ++i) {
+                    writeRegister (pointer, data[i]);
+                    advance ();
+                }
+            }
+        }
+
+        void read (byte* data, uint count) {
+            for (uint i = 0; i < count; ++i) {
+                data[i] = readRegister (pointer);
+                advance ();
+            }
+        }
+
+        void stop () {
+            latch ();
+        }
+
+        uint getAddress () {
+            return address;
+        }
+
+        byte getRegister (byte at) {
+            return registers[at];
+        }
+
+        u2 getChannelOn (byte channel) {
+            return registers[LED_BASE + (channel * 4)] | ((registers[LED_BASE + (channel * 4) + 1] & 0x1f) << 8);
+        }
+
+        u2 getChannelOff (byte channel) {
+            return registers[LED_BASE + (channel * 4) + 2] | ((registers[LED_BASE + (channel * 4) + 3] & 0x1f) << 8);
+        }
+
+        // what the outputs are actually doing, which can lag the registers until a STOP
+        u2 getOutputOff (byte channel) {
+            return outputs[LED_BASE + (channel * 4) + 2] | ((outputs[LED_BASE + (channel * 4) + 3] & 0x1f) << 8);
+        }
+
+        // the number of times the outputs changed
+        uint getOutputChanges () {
+            return outputChanges;
+        }
+
+        bool isSleeping () {
+            return (registers[MODE1] & SLEEP) != 0;
+        }
+
+        // when the oscillator last woke up, and when a 1 was last written into RESTART (0 if never)
+        uint64_t getWakeTime () {
+            return wakeTime;
+        }
+
+        uint64_t getRestartTime () {
+            return restartTime;
+        }
+
+        // the number of times RESTART was written before the oscillator had time to settle
+        uint getTimingViolations () {
+            return timingViolations;
+        }
+};
+
+const int SIMULATED_BUS_FIRST_HANDLE = 0x100;
+
+// what the simulated adapter says it can do, by default everything we use
+const unsigned long SIMULATED_BUS_FUNCTIONALITY = I2C_FUNC_I2C | I2C_FUNC_SMBUS_BYTE | I2C_FUNC_SMBUS_BYTE_DATA | I2C_FUNC_SMBUS_READ_I2C_BLOCK | I2C_FUNC_SMBUS_WRITE_I2C_BLOCK;
+
+class SimulatedBusBackend : public BusBackend {
+    private:
+        vector<PtrToSimulatedDevice> devices;
+        map<int, uint> handles;
+        int nextHandle;
+        uint frequency;
+        unsigned long functionality;
+        uint64_t wireNanoseconds;
+        uint64_t transactions;
+        int nakAt;
+        pthread_mutex_t mutex;
+
+        // the wire time for a transaction - every message has a start and an address byte, every
+        // byte is 9 clocks (8 bits and an ack), and there is one stop at the end
+        void wire (struct i2c_msg* messages, uint count) {
+            if (frequency > 0) {
+                uint64_t clocks = 1;
+                for (uint i = 0; i < count; ++i) {
+                    clocks += 1 + (9 * (1 + messages[i].len));
+                }
+                uint64_t nanoseconds = (clocks * 1000000000) / frequency;
+                wireNanoseconds += nanoseconds;
+
+                // spin, rather than sleep, to get the short times right
+                uint64_t until = BusStatistics::now () + nanoseconds;
+                while (BusStatistics::now () < until) {}
+            }
+            ++transactions;
+        }
+
+        int fail (int error) {
+            errno = error;
+            return -1;
+        }
+
+        int transfer (struct i2c_msg* messages, uint count) {
+            wire (messages, count);
+            int result = deliver (messages, count);
+
+            // the transfer ends with a STOP, even if it failed part way
+            for (vector<PtrToSimulatedDevice>::iterator iter = devices.begin (); iter != devices.end (); ++iter) {
+                (*iter)->stop ();
+            }
+            return result;
+        }
+
+        int deliver (struct i2c_msg* messages, uint count) {
+            for (uint i = 0; i < count; ++i) {
+                struct i2c_msg& message = messages[i];
+                if (int (i) == nakAt) {
+                    nakAt = -1;
+                    return fail (ENXIO);
+                }
+                vector<PtrToSimulatedDevice> responders;
+                for (vector<PtrToSimulatedDevice>::iterator iter = devices.begin (); iter != devices.end (); ++iter) {
+                    if ((*iter)->respondsTo (message.addr)) {
+                        responders.push_back (*iter);
+                    }
+                }
+                if (responders.size () == 0) {
+                    // nobody acknowledged the address
+                    return fail (ENXIO);
+                }
+                if (message.flags & I2C_M_RD) {
+                    // more than one device driving the bus on a read is an error
+                    if (responders.size () > 1) {
+                        return fail (EIO);
+                    }
+                    responders[0]->read (message.buf, message.len);
+                } else {
+                    for (vector<PtrToSimulatedDevice>::iterator iter = responders.begin (); iter != responders.end (); ++iter) {
+                        (*iter)->write (message.buf, message.len);
+                    }
+                }
+            }
+            return 0;
+        }
+
+        // an SMBus call is the same thing as a short transfer to the slave address of the handle
+        int smbus (uint address, BusControl* control) {
+            byte command = control->command;
+            struct i2c_msg messages[2];
+            messages[0].addr = messages[1].addr = address;
+            messages[0].flags = 0;
+            messages[1].flags = I2C_M_RD;
+            if (control->readWrite == I2C_SMBUS_WRITE) {
+                byte data[I2C_SMBUS_BLOCK_MAX + 1];
+                data[0] = command;
+                messages[0].buf = data;
+                switch (control->size) {
+                    case I2C_SMBUS_BYTE:
+                        messages[0].len = 1;
+                        break;
+                    case I2C_SMBUS_BYTE_DATA:
+                        data[1] = control->data[0];
+                        messages[0].len = 2;
+                        break;
+                    case I2C_SMBUS_I2C_BLOCK_DATA:
+                        if (not (functionality & I2C_FUNC_SMBUS_WRITE_I2C_BLOCK)) {
+                            return fail (EOPNOTSUPP);
+                        }
+                        for (uint i = 0; i < control->data[0]; ++i) {
+                            data[i + 1] = control->data[i + 1];
+                        }
+                        messages[0].len = control->data[0] + 1;
+                        break;
+                    default:
+                        return fail (EINVAL);
+                }
+                return transfer (messages, 1);
+            } else {
+                messages[0].buf = &command;
+                messages[0].len = 1;
+                switch (control->size) {
+                    case I2C_SMBUS_BYTE:
+                        messages[1].buf = control->data;
+                        messages[1].len = 1;
+                        return transfer (&messages[1], 1);
+                    case I2C_SMBUS_BYTE_DATA:
+                        messages[1].buf = control->data;
+                        messages[1].len = 1;
+                        break;
+                    case I2C_SMBUS_I2C_BLOCK_DATA:
+                        if (not (functionality & I2C_FUNC_SMBUS_READ_I2C_BLOCK)) {
+                            return fail (EOPNOTSUPP);
+                        }
+                        messages[1].buf = &control->data[1];
+                        messages[1].len = control->data[0];
+                        break;
+                    default:
+                        return fail (EINVAL);
+                }
+                return transfer (messages, 2);
+            }
+        }
+
+    public:
+        // frequency is the bus clock in Hz (100000 and 400000 are typical), or 0 to let the
+        // simulated bus take no time at all
+        SimulatedBusBackend (uint _frequency = 0) : nextHandle (SIMULATED_BUS_FIRST_HANDLE), frequency (_frequency), functionality (SIMULATED_BUS_FUNCTIONALITY), wireNanoseconds (0), transactions (0), nakAt (-1) {
+            pthread_mutex_init (&mutex, 0);
+        }
+
+        ~SimulatedBusBackend () {
+            pthread_mutex_destroy (&mutex);
+        }
+
+        PtrTo<SimulatedPCA9685> addPCA9685 (uint address) {
+            PtrTo<SimulatedPCA9685> device = new SimulatedPCA9685 (address);
+            devices.push_back (device);
+            return device;
+        }
+
+        SimulatedBusBackend* addDevice (PtrToSimulatedDevice device) {
+            devices.push_back (device);
+            return this;
+        }
+
+        int open (const Text&) {
+            pthread_mutex_lock (&mutex);
+            int handle = nextHandle++;
+            handles[handle] = BUS_NO_ADDRESS;
+            pthread_mutex_unlock (&mutex);
+            return handle;
+        }
+
+        void close (int handle) {
+            pthread_mutex_lock (&mutex);
+            handles.erase (handle);
+            pthread_mutex_unlock (&mutex);
+        }
+
+        int ioctl (int handle, unsigned long request, void* argument) {
+            pthread_mutex_lock (&mutex);
+            int result;
+            map<int, uint>::iterator iter = handles.find (handle);
+            if (iter == handles.end ()) {
+                result = fail (EBADF);
+            } else {
+                switch (request) {
+                    case I2C_TENBIT:
+                        result = (argument == 0) ? 0 : fail (EINVAL);
+                        break;
+                    case I2C_SLAVE:
+                        iter->second = uint (reinterpret_cast<uintptr_t> (argument));
+                        result = 0;
+                        break;
+                    case I2C_SMBUS:
+                        result = smbus (iter->second, static_cast<BusControl*> (argument));
+                        break;
+                    case I2C_FUNCS:
+                        *static_cast<unsigned long*> (argument) = functionality;
+                        result = 0;
+                        break;
+                    case I2C_RDWR: {
+                        struct i2c_rdwr_ioctl_data* data = static_cast<struct i2c_rdwr_ioctl_data*> (argument);
+                        result = (functionality & I2C_FUNC_I2C) ? transfer (data->msgs, data->nmsgs) : fail (EOPNOTSUPP);
+                        break;
+                    }
+                    default:
+                        result = fail (ENOTTY);
+                        break;
+                }
+            }
+            pthread_mutex_unlock (&mutex);
+            return result;
+        }
+
+        SimulatedBusBackend* setFrequency (uint _frequency) {
+            frequency = _frequency;
+            return this;
+        }
+
+        // limit what the simulated adapter can do, to stand in for a simpler one (set it before the
+        // bus is first used, the bus only asks once)
+        SimulatedBusBackend* setFunctionality (unsigned long _functionality) {
+            functionality = _functionality;
+            return this;
+        }
+
+        // have the next transfer fail part way, with the address of one of its messages not
+        // acknowledged - the messages before it are delivered, and the rest aren't
+        SimulatedBusBackend* nakNextTransfer (uint message = 0) {
+            nakAt = int (message);
+            return this;
+        }
+
+        // the total time the simulated wire has been busy, and the number of transactions on it
+        uint64_t getWireNanoseconds () {
+            return wireNanoseconds;
+        }
+
+        uint64_t getTransactions () {
+            return transactions;
+        }
+};
+
+// a simulated bus with a PCA9685 on it, added under the next bus id nobody has, so every test or
+// benchmark gets a bus of its own without picking an id. the functionality has to be set before the
+// bus is first used, so it is given here.
+struct SimulatedBus {
+    PtrTo<SimulatedBusBackend> backend;
+    PtrTo<SimulatedPCA9685> chip;
+    PtrToBus bus;
+    uint id;
+
+    SimulatedBus (uint address, uint frequency = 0, unsigned long functionality = SIMULATED_BUS_FUNCTIONALITY) {
+        backend = new SimulatedBusBackend (frequency);
+        backend->setFunctionality (functionality);
+        chip = backend->addPCA9685 (address);
+        id = Bus::getUnusedId ();
+        bus = Bus::addBus (id, "simulated", backend);
+    }
+};
@@ -1,7 +1,8 @@
 #pragma once
 
-#include "PCA9685.h"
-#include "MotorId.h"
+#include "PCA9685Timing.h"
+
+#include <algorithm>
 
 // DC and Stepper Motor "Hat" Driver
 //
@@ -11,85 +12,184 @@
 // this "hat" is a combination 9685 16 Channel Pulse Width Modulation Controller (PWM) for LEDs, and
 // 2 6612 H-bridge motor controllers driven off the modulated outputs. the "hat" supports four
 // motors (a stepper motor is driven as if it were two motors)
+//
+// the timing and the wiring of the motors to the PCA9685 channels are template parameters (see
+// PCA9685Timing.h), the defaults are the run time timing and the wiring of the Adafruit hat. with
+// a compile-time timing, the requested pulse frequency has to be the timing's.
 
 const int ADAFRUIT_MOTOR_DRIVER_DEFAULT_ADDRESS = 0x60;
 
-template<typename DeviceType>
+// the register bytes that run some motors at some speeds, computed ahead of time by
+// AdafruitMotorDriver::prepareMotors for callers that cycle through a fixed set of speeds (like
+// a stepper). the channels are grouped into runs of contiguous channels, so running them is one
+// pass over the bytes and at most a few runs on the bus.
+struct PreparedMotors {
+    byte motorCount;
+    MotorId motorIds[MOTOR_COUNT];
+    double speeds[MOTOR_COUNT];
+    byte runCount;
+    byte runChannels[3 * MOTOR_COUNT];
+    byte runLengths[3 * MOTOR_COUNT];
+    byte registers[3 * MOTOR_COUNT * 4];
+};
+
+template<typename DeviceType, typename Timing = PCA9685RuntimeTiming, typename Wiring = AdafruitMotorHatWiring>
 class AdafruitMotorDriver : public PCA9685<DeviceType> {
     protected:
-        // a helper class to capture the three pin values that we have to set through the PCA9685
-        // for any given motor id
-        struct MotorSpec {
-            byte modulator;
-            byte frontPin;
-            byte backPin;
-
-            void operator () (byte _modulator, byte _frontPin, byte _backPin) {
-                modulator = _modulator;
-                frontPin = _frontPin;
-                backPin = _backPin;
-            }
-        };
-
         double speeds[MOTOR_COUNT];
 
         void stopAllMotors () {
+            double stopped[MOTOR_COUNT] = { 0.0, 0.0, 0.0, 0.0 };
+            runMotors (stopped);
+        }
+
+        // the three channels that run a motor at a speed - the direction pins, and the modulator
+        void getMotorPulses (MotorId motorId, double speed, ChannelPulse* pulses) {
+            byte modulator = Wiring::getModulator (motorId);
+            byte frontPin = Wiring::getFrontPin (motorId);
+            byte backPin = Wiring::getBackPin (motorId);
+            Log::trace () << "AdafruitMotorDriver: " << "run MOTOR_" << motorId << " ("
+                          << "modulator [" << hex (modulator) << "], "
+                          << "frontPin [" << hex (frontPin) << "], "
+                          << "backPin [" << hex(backPin) << "]" << ") @ "
+                          << speed << endl;
+
+            uint high = PCA9685<DeviceType>::CHANNEL_HIGH;
+            if (speed < 0.0) {
+                pulses[0] = PCA9685<DeviceType>::getChannelPulse (frontPin, 0);
+                pulses[1] = PCA9685<DeviceType>::getChannelPulse (backPin, high);
+                pulses[2] = PCA9685<DeviceType>::getChannelPulse (modulator, uint (-speed * high));
+            } else if (speed > 0.0) {
+                pulses[0] = PCA9685<DeviceType>::getChannelPulse (frontPin, high);
+                pulses[1] = PCA9685<DeviceType>::getChannelPulse (backPin, 0);
+                pulses[2] = PCA9685<DeviceType>::getChannelPulse (modulator, uint (speed * high));
+            } else {
+                pulses[0] = PCA9685<DeviceType>::getChannelPulse (frontPin, 0);
+                pulses[1] = PCA9685<DeviceType>::getChannelPulse (backPin, 0);
+                pulses[2] = PCA9685<DeviceType>::getChannelPulse (modulator, 0);
+            }
+        }
+
+        // an attached board keeps running the motors, so the speeds are read back from the pins
+        void adoptMotors () {
             for (byte i = 0; i < MOTOR_COUNT; ++i) {
-                runMotor (static_cast<MotorId>(i), 0.0);
+                MotorId motorId = static_cast<MotorId>(i);
+                double speed = double (PCA9685<DeviceType>::getChannelImageWidth (Wiring::getModulator (motorId))) / PCA9685<DeviceType>::CHANNEL_HIGH;
+                bool front = PCA9685<DeviceType>::getChannelImageWidth (Wiring::getFrontPin (motorId)) > 0;
+                bool back = PCA9685<DeviceType>::getChannelImageWidth (Wiring::getBackPin (motorId)) > 0;
+                speeds[i] = (front and (not back)) ? speed : ((back and (not front)) ? -speed : 0.0);
+            }
+        }
+
+        void init () {
+            if (PCA9685<DeviceType>::isAttached ()) {
+                adoptMotors ();
+            } else {
+                stopAllMotors ();
             }
         }
 
 
     public:
-        AdafruitMotorDriver (uint address = ADAFRUIT_MOTOR_DRIVER_DEFAULT_ADDRESS, uint requestedPulseFrequency = PCA9685_DEFAULT_PULSE_FREQUENCY, int bus = -1) : PCA9685<DeviceType> (address, requestedPulseFrequency, bus) {
-            stopAllMotors ();
+        AdafruitMotorDriver (uint address = ADAFRUIT_MOTOR_DRIVER_DEFAULT_ADDRESS, uint requestedPulseFrequency = PCA9685_DEFAULT_PULSE_FREQUENCY, int bus = -1, bool attach = false) : PCA9685<DeviceType> (address, Timing::checkRequestedPulseFrequency (requestedPulseFrequency), bus, Timing::getPreScale (), Timing::getOscillatorFrequency (), attach) {
+            init ();
         }
 
-        AdafruitMotorDriver (PtrTo<DeviceType> _device, uint requestedPulseFrequency = PCA9685_DEFAULT_PULSE_FREQUENCY) : PCA9685<DeviceType> (_device, requestedPulseFrequency) {
-            stopAllMotors ();
+        AdafruitMotorDriver (PtrTo<DeviceType> _device, uint requestedPulseFrequency = PCA9685_DEFAULT_PULSE_FREQUENCY, bool attach = false) : PCA9685<DeviceType> (_device, Timing::checkRequestedPulseFrequency (requestedPulseFrequency), Timing::getPreScale (), Timing::getOscillatorFrequency (), attach) {
+            init ();
         }
 
         /**
-        * run a motor
+        * run a motor, the three channels that drive it are sent in one cycle on the bus
         * @param motorId - which motor to run
         * @param speed - the speed to run it at in the range 0..1, 0 is stopped.
         */
-        AdafruitMotorDriver<DeviceType>* runMotor (MotorId motorId, double speed) {
-            MotorSpec motorSpec;
-            switch (motorId) {
-                case MotorId::MOTOR_0: motorSpec ( 8, 9, 10); break;
-                case MotorId::MOTOR_1: motorSpec (13, 12, 11); break;
-                case MotorId::MOTOR_2: motorSpec ( 2, 3, 4); break;
-                case MotorId::MOTOR_3: motorSpec ( 7, 6, 5); break;
-                // this line of code is to get around older gcc compilers (like 6), complaining
-                // that motorSpec may not be initialized. I tried turning off the warning, but it
-                // started a cascade of warning problems that were leading towards more complex
-                // code, so I just bit the bullet - this will never happen.
-                default:               motorSpec ( 0, 0, 0); break;
+        AdafruitMotorDriver<DeviceType, Timing, Wiring>* runMotor (MotorId motorId, double speed) {
+            ChannelPulse pulses[3];
+            getMotorPulses (motorId, speed, pulses);
+            PCA9685<DeviceType>::setChannelPulses (pulses, 3);
+
+            // if we successfully got here, then capture the speed request
+            speeds[static_cast<uint>(motorId)] = speed;
+
+            return this;
+        }
+
+        /**
+        * run all the motors at once, in one cycle on the bus - the motors all change together (in
+        * the same PWM period, with the outputs changing on STOP).
+        * @param motorSpeeds - the speeds to run the motors at, in motor id order
+        */
+        AdafruitMotorDriver<DeviceType, Timing, Wiring>* runMotors (const double* motorSpeeds) {
+            ChannelPulse pulses[3 * MOTOR_COUNT];
+            for (byte i = 0; i < MOTOR_COUNT; ++i) {
+                getMotorPulses (static_cast<MotorId>(i), motorSpeeds[i], &pulses[3 * i]);
             }
-            Log::trace () << "AdafruitMotorDriver: " << "run MOTOR_" << motorId << " ("
-                          << "modulator [" << hex (motorSpec.modulator) << "], "
-                          << "frontPin [" << hex (motorSpec.frontPin) << "], "
-                          << "backPin [" << hex(motorSpec.backPin) << "]" << ") @ "
-                          << speed << endl;
+            PCA9685<DeviceType>::setChannelPulses (pulses, 3 * MOTOR_COUNT);
 
-            if (speed < 0.0) {
-                PCA9685<DeviceType>::setChannelOff (motorSpec.frontPin);
-                PCA9685<DeviceType>::setChannelOn (motorSpec.backPin);
-                PCA9685<DeviceType>::setChannelPulse (motorSpec.modulator, uint (-speed * PCA9685<DeviceType>::CHANNEL_HIGH));
-            } else if (speed > 0.0) {
-                PCA9685<DeviceType>::setChannelOn (motorSpec.frontPin);
-                PCA9685<DeviceType>::setChannelOff (motorSpec.backPin);
-                PCA9685<DeviceType>::setChannelPulse (motorSpec.modulator, uint (speed * PCA9685<DeviceType>::CHANNEL_HIGH));
-            } else if (speed == 0.0) {
-                PCA9685<DeviceType>::setChannelOff (motorSpec.frontPin);
-                PCA9685<DeviceType>::setChannelOff (motorSpec.backPin);
-                PCA9685<DeviceType>::setChannelOff (motorSpec.modulator);
+            // if we successfully got here, then capture the speed requests
+            for (uint i = 0; i < MOTOR_COUNT; ++i) {
+                speeds[i] = motorSpeeds[i];
             }
+            return this;
+        }
 
-            // if we successfully got here, then capture the speed request
-            speeds[static_cast<uint>(motorId)] = speed;
+        /**
+        * compute the register bytes that run a set of motors at a set of speeds, to be run later
+        * (any number of times) with runPreparedMotors.
+        * @param motorIds - which motors to run
+        * @param motorSpeeds - the speeds to run them at
+        * @param count - the number of motors, at most MOTOR_COUNT
+        * @param prepared - filled in with the register bytes
+        */
+        void prepareMotors (const MotorId* motorIds, const double* motorSpeeds, uint count, PreparedMotors& prepared) {
+            if (count > MOTOR_COUNT) {
+                throw RuntimeError (Text ("AdafruitMotorDriver: ") << "can't prepare " << count << " motors");
+            }
+
+            // the pulses for all the channels, in channel order
+            ChannelPulse pulses[3 * MOTOR_COUNT];
+            prepared.motorCount = count;
+            for (uint i = 0; i < count; ++i) {
+                prepared.motorIds[i] = motorIds[i];
+                prepared.speeds[i] = motorSpeeds[i];
+                getMotorPulses (motorIds[i], motorSpeeds[i], &pulses[3 * i]);
+            }
+            uint pulseCount = 3 * count;
+            sort (pulses, pulses + pulseCount, [] (const ChannelPulse& a, const ChannelPulse& b) { return a.channel < b.channel; });
+
+            // group them into runs of contiguous channels
+            prepared.runCount = 0;
+            byte* registers = prepared.registers;
+            for (uint i = 0; i < pulseCount; ++i) {
+                if (pulses[i].channel >= PCA9685<DeviceType>::CHANNEL_COUNT) {
+                    throw RuntimeError (Text ("AdafruitMotorDriver: ") << "invalid channel for prepareMotors (" << hex (pulses[i].channel) << ")");
+                }
+                if ((i > 0) and (pulses[i].channel == pulses[i - 1].channel)) {
+                    throw RuntimeError (Text ("AdafruitMotorDriver: ") << "channel " << hex (pulses[i].channel) << " prepared twice");
+                }
+                if ((i == 0) or (pulses[i].channel != (pulses[i - 1].channel + 1))) {
+                    prepared.runChannels[prepared.runCount] = pulses[i].channel;
+                    prepared.runLengths[prepared.runCount++] = 0;
+                }
+                ++prepared.runLengths[prepared.runCount - 1];
+                PCA9685<DeviceType>::getChannelRegisters (pulses[i], registers);
+                registers += 4;
+            }
+        }
+
+        /**
+        * run motors with register bytes computed by prepareMotors - nothing is converted, and only
+        * the bytes that differ from what the chip already has are sent, in one cycle on the bus.
+        * @param prepared - the register bytes to run
+        */
+        AdafruitMotorDriver<DeviceType, Timing, Wiring>* runPreparedMotors (const PreparedMotors& prepared) {
+            PCA9685<DeviceType>::setChannelRegisters (prepared.runChannels, prepared.runLengths, prepared.runCount, prepared.registers);
 
+            // if we successfully got here, then capture the speed requests
+            for (uint i = 0; i < prepared.motorCount; ++i) {
+                speeds[static_cast<uint>(prepared.motorIds[i])] = prepared.speeds[i];
+            }
             return this;
         }
 
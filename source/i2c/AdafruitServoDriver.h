@@ -1,6 +1,6 @@
 #pragma once
 
-#include "PCA9685.h"
+#include "PCA9685Timing.h"
 #include "ServoId.h"
 
 /**
@@ -11,28 +11,40 @@
 * this breakout board is a straightforward implementation of a 9685 16-Channel Pulse Width
 * Modulation (PWM) Controller for LEDs with 12-bits of resolution. We use it to provide a bunch of
 * PWM outputs for servos.
+*
+* the timing is configured at run time by default, a PCA9685Timing fixes it at compile time, e.g.
+* AdafruitServoDriver<DeviceI2C, PCA9685Timing<25000000, 50> >, so that the conversion from a
+* pulse duration to ticks (in setPulseDuration, setPulseDurations, and setPulseMicroseconds) is
+* integer math with constants. the requested pulse frequency then has to be the timing's.
 */
 
 const int ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS = 0x40;
 const int ADAFRUIT_SERVO_DRIVER_DEFAULT_PULSE_FREQUENCY = 50;
 
-template<typename DeviceType>
+template<typename DeviceType, typename Timing = PCA9685RuntimeTiming>
 class AdafruitServoDriver : public PCA9685<DeviceType> {
     private:
         double pulseDurations[SERVO_COUNT];
 
+        // the width of a pulse, with a compile-time timing the duration is taken to the nearest
+        // microsecond and converted with integer math
+        uint getWidth (double milliseconds) {
+            return Timing::isStatic () ? Timing::getWidth (uint ((max (milliseconds, 0.0) * 1.0e3) + 0.5)) : PCA9685<DeviceType>::getChannelWidth (milliseconds);
+        }
+
         void init () {
+            // an attached board keeps its pulses, so the durations are read back from them
             for (byte i = 0; i < SERVO_COUNT; ++i) {
-                pulseDurations[i] = 0;
+                pulseDurations[i] = PCA9685<DeviceType>::isAttached () ? ((PCA9685<DeviceType>::getChannelImageWidth (i) * 1.0e3) / (PCA9685<DeviceType>::CHANNEL_HIGH * PCA9685<DeviceType>::getPulseFrequency ())) : 0;
             }
         }
 
     public:
-        AdafruitServoDriver (uint address = ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS, uint requestedPulseFrequency = ADAFRUIT_SERVO_DRIVER_DEFAULT_PULSE_FREQUENCY, int bus = -1) : PCA9685<DeviceType> (address, requestedPulseFrequency, bus) {
+        AdafruitServoDriver (uint address = ADAFRUIT_SERVO_DRIVER_DEFAULT_ADDRESS, uint requestedPulseFrequency = ADAFRUIT_SERVO_DRIVER_DEFAULT_PULSE_FREQUENCY, int bus = -1, bool attach = false) : PCA9685<DeviceType> (address, Timing::checkRequestedPulseFrequency (requestedPulseFrequency), bus, Timing::getPreScale (), Timing::getOscillatorFrequency (), attach) {
             init ();
         }
 
-        AdafruitServoDriver (PtrTo<DeviceType> _device, uint requestedPulseFrequency = ADAFRUIT_SERVO_DRIVER_DEFAULT_PULSE_FREQUENCY) : PCA9685<DeviceType> (_device, requestedPulseFrequency) {
+        AdafruitServoDriver (PtrTo<DeviceType> _device, uint requestedPulseFrequency = ADAFRUIT_SERVO_DRIVER_DEFAULT_PULSE_FREQUENCY, bool attach = false) : PCA9685<DeviceType> (_device, Timing::checkRequestedPulseFrequency (requestedPulseFrequency), Timing::getPreScale (), Timing::getOscillatorFrequency (), attach) {
             init ();
         }
 
@@ -42,8 +54,8 @@ class AdafruitServoDriver : public PCA9685<DeviceType> {
         * @param milliseconds - the width of the puls in milliseconds
         * @return this, for chaining
         */
-        AdafruitServoDriver<DeviceType>*  setPulseDuration (ServoId servoId, double milliseconds) {
-            PCA9685<DeviceType>::setChannelPulseMs (static_cast<byte> (servoId), milliseconds);
+        AdafruitServoDriver<DeviceType, Timing>*  setPulseDuration (ServoId servoId, double milliseconds) {
+            PCA9685<DeviceType>::setChannelPulse (static_cast<byte> (servoId), getWidth (milliseconds));
 
             // if we successfully got here, then capture the pulse duration request
             pulseDurations[static_cast<uint>(servoId)] = milliseconds;
@@ -51,6 +63,61 @@ class AdafruitServoDriver : public PCA9685<DeviceType> {
             return this;
         }
 
+        /**
+        * set the pulse width to control a servo, in whole microseconds. with a compile-time timing
+        * the conversion to ticks is a constant multiply and shift.
+        * @param servoId - which servo to set the pulse duration for
+        * @param microseconds - the width of the pulse in microseconds
+        * @return this, for chaining
+        */
+        AdafruitServoDriver<DeviceType, Timing>*  setPulseMicroseconds (ServoId servoId, uint microseconds) {
+            uint width = Timing::isStatic () ? Timing::getWidth (microseconds) : PCA9685<DeviceType>::getChannelWidth (microseconds / 1.0e3);
+            PCA9685<DeviceType>::setChannelPulse (static_cast<byte> (servoId), width);
+
+            // if we successfully got here, then capture the pulse duration request
+            pulseDurations[static_cast<uint>(servoId)] = microseconds / 1.0e3;
+
+            return this;
+        }
+
+        /**
+        * set the pulse widths for a number of servos at once, in a single cycle on the bus - a
+        * whole-board pose is one transfer.
+        * @param servoIds - which servos to set the pulse durations for
+        * @param milliseconds - the widths of the pulses in milliseconds, one for each servo id
+        * @param count - how many servos there are, at most SERVO_COUNT
+        * @return this, for chaining
+        */
+        AdafruitServoDriver<DeviceType, Timing>*  setPulseDurations (const ServoId* servoIds, const double* milliseconds, uint count) {
+            if (count > SERVO_COUNT) {
+                throw RuntimeError (Text ("AdafruitServoDriver: ") << "can't set " << count << " servos");
+            }
+            ChannelPulse pulses[SERVO_COUNT];
+            for (uint i = 0; i < count; ++i) {
+                pulses[i] = PCA9685<DeviceType>::getChannelPulse (static_cast<byte> (servoIds[i]), getWidth (milliseconds[i]));
+            }
+            PCA9685<DeviceType>::setChannelPulses (pulses, count);
+
+            // if we successfully got here, then capture the pulse duration requests
+            for (uint i = 0; i < count; ++i) {
+                pulseDurations[static_cast<uint>(servoIds[i])] = milliseconds[i];
+            }
+            return this;
+        }
+
+        /**
+        * set the pulse widths for all the servos at once
+        * @param milliseconds - the widths of the pulses in milliseconds, in servo id order
+        * @return this, for chaining
+        */
+        AdafruitServoDriver<DeviceType, Timing>*  setPulseDurations (const double* milliseconds) {
+            ServoId servoIds[SERVO_COUNT];
+            for (uint i = 0; i < SERVO_COUNT; ++i) {
+                servoIds[i] = static_cast<ServoId> (i);
+            }
+            return setPulseDurations (servoIds, milliseconds, SERVO_COUNT);
+        }
+
         double getPulseDuration (ServoId servoId) {
             return pulseDurations[static_cast<uint>(servoId)];
         }
@@ -1,3 +1,5 @@
 #include "Bus.h"
 
 map<int, PtrToBus> Bus::buses;
+vector<PtrToBus> Bus::busIndex;
+bool Bus::identified = false;
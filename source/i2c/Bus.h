@@ -1,35 +1,14 @@
 #pragma once
 
 #include "Log.h"
-#include "File.h"
+#include "BusStatistics.h"
+#include "BusBackend.h"
 
-// headers needed for open, close, and ioctl
-#include <fcntl.h>
-#include <unistd.h>
-#include <sys/ioctl.h>
-#include <errno.h>
+#include <dirent.h>
+#include <string.h>
+#include <sched.h>
+#include <fstream>
 
-#ifndef __APPLE__
-#include <linux/i2c.h>
-#include <linux/i2c-dev.h>
-#else
-// shamelessly copied from a linux i2c.h and i2c-dev.h headers to facilitate compilation and unit
-// testing on platforms other than linux, or that don't have an I2C bus. prefer the linux source if
-// it is available
-
-#define I2C_SLAVE               0x0703  // use this slave address
-#define I2C_TENBIT              0x0704  // set to 0 for 7 bit addrs (pretty much everything we care about)
-#define I2C_SMBUS               0x0720  // perform a SMBus operation
-
-// SMBus read or write markers
-#define I2C_SMBUS_READ          1
-#define I2C_SMBUS_WRITE         0
-
-// sizes of transfers for byte and byte data
-#define I2C_SMBUS_BYTE          1
-#define I2C_SMBUS_BYTE_DATA     2
-
-#endif
 
 // this is an abstraction on a System Management Bus (SMB) which we use for Inter-Integrated
 // Circuit Bus (I2C) operations. Both are 2-wire bus protocols that are compatible with each other,
@@ -40,51 +19,128 @@
 // we assume stuff works, so the general error handling strategy is to throw an exception if
 // something fails.
 
-const int BUS_INVALID = -1;
 const int BUS_MAX_COUNT = 256;
+const uint BUS_NO_ADDRESS = 0xffff;
+const uint BUS_DEFAULT_HANDLE_POOL_SIZE = 8;
+
+// the longest raw message we build for a register write (the register and 256 values)
+const uint BUS_MESSAGE_MAX = 257;
 #define BUS_FILE_PATH   "/dev/i2c-"
 
+// the kernel lists the I2C adapters (with their names) here, if sysfs isn't there we look for the
+// bus files in /dev instead
+#define BUS_SYSFS_PATH  "/sys/class/i2c-dev"
+#define BUS_DEVICE_PATH "/dev"
+#define BUS_FILE_PREFIX "i2c-"
+
+// how a run of consecutive registers is written, from slowest to fastest - a register at a time,
+// as SMBus I2C blocks (up to 32 bytes per call), or as a single raw I2C message. the bus picks the
+// fastest one the adapter says it can do.
+enum class BusWriteMode {
+    BYTE,
+    I2C_BLOCK,
+    TRANSFER
+};
+
+// how a device reaches its bus. by default, all the devices on a bus share one handle (file
+// descriptor), and every transaction locks the bus and sets the slave address. a device can
+// instead have a handle of its own, bound to its address once, that skips the address ioctl and
+// only locks itself - or also locks the shared bus, if the caller needs transactions to be
+// serialized with the other devices.
+enum class BusHandle {
+    SHARED,
+    DEDICATED,
+    DEDICATED_SERIALIZED
+};
+
 MAKE_PTR_TO(Bus) {
     private:
         uint id;
         Text filePath;
+        Text name;
+        PtrToBusBackend backend;
         int handle;
 
-        // a mutex used to atomicize access to the bus
+        // what the adapter can do (I2C_FUNCS), asked once. the flag is set with the bus locked,
+        // after the mask, so a caller that sees it set can read the mask without the lock
+        unsigned long functionality;
+        atomic<bool> functionalityKnown;
+
+        // the slave address the handle is currently set to talk to, so we only have to tell the
+        // kernel when it changes
+        uint currentAddress;
+
+        // a mutex used to atomicize access to the bus. it inherits the priority of the highest
+        // priority thread waiting on it, and background callers step aside while a real-time
+        // caller is waiting. the lock depth is only touched by the thread holding the mutex.
         pthread_mutex_t     mutex;
         pthread_mutexattr_t mutexAttribute;
+        atomic<uint> realtimeWaiting;
+        uint lockDepth;
+
+        // a dedicated bus has a parent (the shared bus for the same file), and might lock it too.
+        // the shared bus keeps the pool of dedicated buses made from it.
+        Bus* parent;
+        bool serialize;
+        uint handlePoolSize;
+        vector<PtrToBus> dedicatedBuses;
+
+        // counters and latencies for everything done on the handle
+        BusStatistics statistics;
 
         static map<int, PtrToBus> buses;
+        static vector<PtrToBus> busIndex;
+        static bool identified;
 
-        struct BusControl {
-            byte readWrite;
-            byte command;
-            uint size;
-            byte* data;
 
-            BusControl (byte _readWrite, byte _command, uint _size, byte*_data) :
-                readWrite (_readWrite), command (_command), size (_size), data(_data) {}
-        };
+        // make an ioctl call and record how long it took, and what it moved
+        bool timedIoctl (BusOperation operation, unsigned long request, void* argument, uint read = 0, uint written = 0) {
+            uint64_t start = BusStatistics::now ();
+            bool success = (backend->ioctl (handle, request, argument) >= 0);
+            statistics.record (operation, currentAddress, BusStatistics::now () - start, success ? read : 0, success ? written : 0, not success);
+            return success;
+        }
 
         void read (byte command, int size, byte* data) {
             BusControl control (I2C_SMBUS_READ, command, size, data);
-            if (ioctl (handle, I2C_SMBUS, &control) != 0) {
+            if (not timedIoctl (BusOperation::SMBUS_READ, I2C_SMBUS, &control, 1)) {
                 throw RuntimeError (Text("Bus: ") << "read error");
             }
         }
 
         void write (byte command, int size, byte* data) {
             BusControl control (I2C_SMBUS_WRITE, command, size, data);
-            if (ioctl (handle, I2C_SMBUS, &control) != 0) {
+            BusOperation operation = (size == I2C_SMBUS_I2C_BLOCK_DATA) ? BusOperation::SMBUS_BLOCK_WRITE : BusOperation::SMBUS_WRITE;
+            uint written = (size == I2C_SMBUS_I2C_BLOCK_DATA) ? data[0] : ((size == I2C_SMBUS_BYTE) ? 0 : 1);
+            if (not timedIoctl (operation, I2C_SMBUS, &control, 0, written + 1)) {
                 throw RuntimeError (Text("Bus: ") << "write error");
             }
         }
 
-        Bus (uint _id, const Text& _filePath) : id (_id), filePath (_filePath), handle(BUS_INVALID) {
+        Bus (uint _id, const Text& _filePath, const Text& _name, PtrToBusBackend _backend) : id (_id), filePath (_filePath), name (_name), backend (_backend), handle(BUS_INVALID), functionality (0), functionalityKnown (false), currentAddress (BUS_NO_ADDRESS), parent (0), serialize (false), handlePoolSize (BUS_DEFAULT_HANDLE_POOL_SIZE) {
             // NOTE: constructing a bus doesn't "open" it - that is done lazily to avoid allocating
             // resources unnecessarily, but once it's opened it stays open until the program
             // terminates
-            if (pthread_mutexattr_settype(&mutexAttribute, PTHREAD_MUTEX_RECURSIVE) == 0) {
+            initMutex ();
+        }
+
+        // a dedicated bus opens its own handle right away, and binds it to the device address
+        Bus (Bus* _parent, uint address, bool _serialize) : id (_parent->id), filePath (_parent->filePath), name (_parent->name), backend (_parent->backend), handle(BUS_INVALID), functionality (0), functionalityKnown (false), currentAddress (BUS_NO_ADDRESS), parent (_parent), serialize (_serialize), handlePoolSize (0) {
+            initMutex ();
+            begin (address);
+            end ();
+            Log::debug () << "Bus: " << "dedicated handle (" << hex (handle) << ") bound to " << hex (address) << (serialize ? " (serialized)" : "") << endl;
+        }
+
+        void initMutex () {
+            realtimeWaiting = 0;
+            lockDepth = 0;
+            if ((pthread_mutexattr_init (&mutexAttribute) == 0) and (pthread_mutexattr_settype(&mutexAttribute, PTHREAD_MUTEX_RECURSIVE) == 0)) {
+                // priority inheritance keeps a low priority holder from being starved while a
+                // high priority thread waits on it, but not every platform has it
+                if (pthread_mutexattr_setprotocol (&mutexAttribute, PTHREAD_PRIO_INHERIT) != 0) {
+                    Log::info () << "Bus: " << "no priority inheritance for the bus mutex" << endl;
+                }
                 if (pthread_mutex_init (&mutex, &mutexAttribute) != 0) {
                     throw RuntimeError (Text ("Bus: ") << "can't create mutex");
                 } else {
@@ -93,52 +149,311 @@ MAKE_PTR_TO(Bus) {
             } else {
                 throw RuntimeError (Text ("Bus: ") << "can't create mutex attribute [PTHREAD_MUTEX_RECURSIVE]");
             }
+        }
+
+        void lock (BusPriority priority = BusPriority::BACKGROUND) {
+            uint64_t start = BusStatistics::now ();
+            if (priority == BusPriority::REALTIME) {
+                ++realtimeWaiting;
+                int result = pthread_mutex_lock(&mutex);
+                --realtimeWaiting;
+                if (result != 0) {
+                    throw RuntimeError (Text("Bus: ") << "can't lock mutex");
+                }
+            } else {
+                // a background caller doesn't queue up behind a waiting real-time caller, it only
+                // tries for the mutex, and if it gets it anyway it gives it back - unless it
+                // already held it (the mutex is recursive)
+                for (;;) {
+                    int result = (realtimeWaiting.load () > 0) ? pthread_mutex_trylock (&mutex) : pthread_mutex_lock (&mutex);
+                    if (result == 0) {
+                        if ((lockDepth > 0) or (realtimeWaiting.load () == 0)) {
+                            break;
+                        }
+                        pthread_mutex_unlock (&mutex);
+                    } else if (result != EBUSY) {
+                        throw RuntimeError (Text("Bus: ") << "can't lock mutex");
+                    }
+                    sched_yield ();
+                }
+            }
+            ++lockDepth;
+            statistics.recordMutexWait (priority, BusStatistics::now () - start);
+            if (serialize) {
+                parent->lock (priority);
+            }
+        }
 
+        void unlock () {
+            if (serialize) {
+                parent->unlock ();
+            }
+            --lockDepth;
+            if (pthread_mutex_unlock (&mutex) != 0) {
+                throw RuntimeError (Text("Bus: ") << "can't unlock mutex");
+            }
         }
 
         void close () {
             if (handle != BUS_INVALID) {
-                ::close (handle);
+                backend->close (handle);
                 Log::info () << "Bus: " << "closed bus " << id << " (" << hex (handle) << ") on " << filePath << endl;
                 handle = BUS_INVALID;
+                currentAddress = BUS_NO_ADDRESS;
+            }
+        }
+
+        void open () {
+            // if the bus is not already open, open it
+            if (handle == BUS_INVALID) {
+                if ((handle = backend->open (filePath)) != BUS_INVALID) {
+                    Log::info () << "Bus: " << "opened bus " << id << " (" << hex (handle) << ") on " << filePath << endl;
+
+                    // set it to use 7-bit addressing
+                    if (timedIoctl (BusOperation::CONFIGURE, I2C_TENBIT, 0)) {
+                        Log::debug () << "Bus: " << "    ...and set it to use 7-bit addressing" << endl;
+                    } else {
+                        close ();
+                        throw RuntimeError (Text("Bus:") << "can't set 7-bit addressing (" << errno << ")");
+                    }
+                } else {
+                    throw RuntimeError (Text("Bus: ") << "can't open bus on " << filePath);
+                }
+            }
+        }
+
+        // add a bus for every "i2c-N" entry in a directory, returns false if the directory isn't
+        // there
+        static bool scanBuses (const char* directoryPath, bool hasNames) {
+            DIR* directory = opendir (directoryPath);
+            if (directory) {
+                const size_t prefixLength = strlen (BUS_FILE_PREFIX);
+                for (struct dirent* entry = readdir (directory); entry; entry = readdir (directory)) {
+                    char* end = 0;
+                    if ((strncmp (entry->d_name, BUS_FILE_PREFIX, prefixLength) == 0) and isdigit (entry->d_name[prefixLength])) {
+                        uint i = strtoul (entry->d_name + prefixLength, &end, 10);
+                        if ((*end == 0) and (i < BUS_MAX_COUNT)) {
+                            Text name;
+                            if (hasNames) {
+                                ifstream nameFile ((Text (directoryPath) << "/" << entry->d_name << "/name").get ());
+                                string line;
+                                if (getline (nameFile, line)) {
+                                    name << line.c_str ();
+                                }
+                            }
+                            buses[i] = new Bus (i, Text (BUS_FILE_PATH) << i, name, KernelBusBackend::get ());
+                        }
+                    }
+                }
+                closedir (directory);
+                return true;
+            }
+            return false;
+        }
+
+        // the buses in id order, so getting one by index is a lookup
+        static void indexBuses () {
+            busIndex.clear ();
+            for (map<int, PtrToBus>::iterator iter = buses.begin (); iter != buses.end (); ++iter) {
+                busIndex.push_back (iter->second);
             }
         }
 
     public:
         static void identifyBuses () {
             // only do this once (or not, if there are no I2Cs on this system)
-            if (buses.size () == 0) {
-                for (uint i = 0; i < BUS_MAX_COUNT; ++i) {
-                    auto smbusFilePath  = Text (BUS_FILE_PATH) << i;
-                    if (File (smbusFilePath).getExists ()) {
-                        buses[i] = new Bus (i, smbusFilePath);
-                    }
+            if (not identified) {
+                if (not scanBuses (BUS_SYSFS_PATH, true)) {
+                    scanBuses (BUS_DEVICE_PATH, false);
+                }
+                indexBuses ();
+                identified = true;
+                for (vector<PtrToBus>::iterator iter = busIndex.begin (); iter != busIndex.end (); ++iter) {
+                    Log::debug () << "Bus: " << "found bus " << (*iter)->id << " (" << (*iter)->name << ")" << endl;
                 }
             }
         }
 
+        // add a bus that does its I/O through some other backend, like a simulator. use an id at or
+        // above BUS_MAX_COUNT so it can't collide with a real bus, it will sort after them when
+        // getting buses by index.
+        static PtrToBus addBus (uint id, const Text& filePath, PtrToBusBackend backend) {
+            identifyBuses ();
+            if (buses.find (id) != buses.end ()) {
+                throw RuntimeError (Text("Bus: ") << "bus " << id << " already exists");
+            }
+            PtrToBus bus = new Bus (id, filePath, filePath, backend);
+            buses[id] = bus;
+            indexBuses ();
+            Log::info () << "Bus: " << "added bus " << id << " on " << filePath << endl;
+            return bus;
+        }
+
+        // the lowest id at or above the given one that no bus has, for adding buses
+        static uint getUnusedId (uint from = BUS_MAX_COUNT) {
+            identifyBuses ();
+            while (buses.find (from) != buses.end ()) {
+                ++from;
+            }
+            return from;
+        }
+
         // get bus by their file id (0..BUS_MAX_COUNT)
         static PtrToBus getBusById (uint id) {
             identifyBuses ();
             return buses.at (id);
         }
 
-        // get bus by their index in the buses map, this might be the common case if you don't know
+        // get bus by their index in id order, this might be the common case if you don't know
         // what bus to try to open - it will be consistent from run to run on a single platform, so
         // long as the file mappings of the buses don't change.
         static PtrToBus getBusByIndex (uint index) {
             identifyBuses ();
-            if (index < buses.size()) {
-                map<int, PtrToBus>::iterator iter = buses.begin();
-               for (uint i = 0; i < index; ++i) {
-                    ++iter;
-                }
-                return iter->second;
+            if (index < busIndex.size()) {
+                return busIndex[index];
             } else {
                 throw RuntimeError (Text("Bus: ") << "index out of range (" << index << ")");
             }
         }
 
+        // close every handle on every bus, dedicated ones included. this is for a clean shutdown,
+        // nothing should be using the buses while it runs (a bus will reopen if it's used again,
+        // but dedicated handles handed out before this are no longer bound)
+        static void closeAll () {
+            for (map<int, PtrToBus>::iterator iter = buses.begin (); iter != buses.end (); ++iter) {
+                Bus* bus = iter->second.operator -> ();
+                for (vector<PtrToBus>::iterator dedicated = bus->dedicatedBuses.begin (); dedicated != bus->dedicatedBuses.end (); ++dedicated) {
+                    (*dedicated)->close ();
+                }
+                bus->dedicatedBuses.clear ();
+                bus->close ();
+            }
+        }
+
+        uint getId () {
+            return id;
+        }
+
+        // the adapter name the kernel reports (like "bcm2835 (i2c@7e804000)"), if it does
+        const Text& getName () {
+            return name;
+        }
+
+        // the adapter functionality mask (I2C_FUNC_*), queried the first time it is asked for. a
+        // dedicated bus is the same adapter as its parent, so it asks the parent.
+        unsigned long getFunctionality () {
+            if (parent) {
+                return parent->getFunctionality ();
+            }
+            if (not functionalityKnown.load (memory_order_acquire)) {
+                lock ();
+                try {
+                    // another thread might have asked while this one waited for the lock
+                    if (not functionalityKnown.load (memory_order_relaxed)) {
+                        open ();
+                        if (timedIoctl (BusOperation::CONFIGURE, I2C_FUNCS, &functionality)) {
+                            Log::debug () << "Bus: " << "bus " << id << " functionality (" << hex (uint (functionality)) << ")" << endl;
+                        } else {
+                            // assume the least, every adapter does byte data
+                            functionality = I2C_FUNC_SMBUS_BYTE | I2C_FUNC_SMBUS_BYTE_DATA;
+                            Log::info () << "Bus: " << "can't get functionality for bus " << id << " (" << errno << "), assuming byte writes" << endl;
+                        }
+                        functionalityKnown.store (true, memory_order_release);
+                    }
+                } catch (RuntimeError& runtimeError) {
+                    unlock ();
+                    throw;
+                }
+                unlock ();
+            }
+            return functionality;
+        }
+
+        // the fastest way this adapter can write a run of registers
+        BusWriteMode getWriteMode () {
+            unsigned long mask = getFunctionality ();
+            return (mask & I2C_FUNC_I2C) ? BusWriteMode::TRANSFER : ((mask & I2C_FUNC_SMBUS_WRITE_I2C_BLOCK) ? BusWriteMode::I2C_BLOCK : BusWriteMode::BYTE);
+        }
+
+        bool canTransfer () {
+            return (getFunctionality () & I2C_FUNC_I2C) != 0;
+        }
+
+        // get a bus with a handle of its own, bound to a single device address. dedicated handles
+        // come from a pool on the shared bus, devices asking for the same address and mode share
+        // one, and when the pool is used up the shared bus is returned instead
+        PtrToBus getDedicatedBus (uint address, bool _serialize = false) {
+            if (parent) {
+                return parent->getDedicatedBus (address, _serialize);
+            }
+            for (vector<PtrToBus>::iterator iter = dedicatedBuses.begin (); iter != dedicatedBuses.end (); ++iter) {
+                if (((*iter)->currentAddress == address) and ((*iter)->serialize == _serialize)) {
+                    return *iter;
+                }
+            }
+            if (dedicatedBuses.size () < handlePoolSize) {
+                PtrToBus dedicated = new Bus (this, address, _serialize);
+                dedicatedBuses.push_back (dedicated);
+                return dedicated;
+            }
+            Log::info () << "Bus: " << "handle pool exhausted (" << handlePoolSize << "), " << hex (address) << " uses the shared handle" << endl;
+            return this;
+        }
+
+        // the most dedicated handles this bus will open, set it to the number of devices that want
+        // one - it has to be set before they are made
+        Bus* setHandlePoolSize (uint size) {
+            handlePoolSize = size;
+            return this;
+        }
+
+        uint64_t getIoctlCount () {
+            return statistics.getIoctlCount ();
+        }
+
+        BusStatistics& getStatistics () {
+            return statistics;
+        }
+
+        // the statistics for every bus, dedicated handles included, as text or JSON
+        static Text getStatisticsText () {
+            Text text;
+            for (map<int, PtrToBus>::iterator iter = buses.begin (); iter != buses.end (); ++iter) {
+                Bus* bus = iter->second.operator -> ();
+                text << "bus " << bus->id << " (" << bus->filePath << "): " << bus->statistics.toText ();
+                for (vector<PtrToBus>::iterator dedicated = bus->dedicatedBuses.begin (); dedicated != bus->dedicatedBuses.end (); ++dedicated) {
+                    text << "bus " << bus->id << " dedicated to " << hex ((*dedicated)->currentAddress) << ": " << (*dedicated)->statistics.toText ();
+                }
+            }
+            return text;
+        }
+
+        static Text getStatisticsJson () {
+            Text json;
+            json << "[";
+            bool first = true;
+            for (map<int, PtrToBus>::iterator iter = buses.begin (); iter != buses.end (); ++iter) {
+                Bus* bus = iter->second.operator -> ();
+                json << (first ? "" : ",") << "{\"id\":" << bus->id << ",\"statistics\":" << bus->statistics.toJson () << ",\"dedicated\":[";
+                for (vector<PtrToBus>::iterator dedicated = bus->dedicatedBuses.begin (); dedicated != bus->dedicatedBuses.end (); ++dedicated) {
+                    json << ((dedicated != bus->dedicatedBuses.begin ()) ? "," : "") << "{\"address\":\"" << hex ((*dedicated)->currentAddress) << "\",\"statistics\":" << (*dedicated)->statistics.toJson () << "}";
+                }
+                json << "]}";
+                first = false;
+            }
+            return json << "]";
+        }
+
+        static void resetStatistics () {
+            for (map<int, PtrToBus>::iterator iter = buses.begin (); iter != buses.end (); ++iter) {
+                Bus* bus = iter->second.operator -> ();
+                bus->statistics.reset ();
+                for (vector<PtrToBus>::iterator dedicated = bus->dedicatedBuses.begin (); dedicated != bus->dedicatedBuses.end (); ++dedicated) {
+                    (*dedicated)->statistics.reset ();
+                }
+            }
+        }
+
         // destructor
         ~Bus () {
             if (handle >= 0) {
@@ -148,33 +463,23 @@ MAKE_PTR_TO(Bus) {
             pthread_mutex_destroy(&mutex);
         }
 
-        // start the read/write cycle on a bus
-        Bus* begin (uint address) {
+        // start the read/write cycle on a bus, real-time callers get the bus ahead of background
+        // callers that are waiting for it
+        Bus* begin (uint address, BusPriority priority = BusPriority::BACKGROUND) {
             // lock the mutex and increment the lock count
-            if (pthread_mutex_lock(&mutex) != 0) {
-                throw RuntimeError (Text("Bus: ") << "can't lock mutex");
-            }
-
-            // if the bus is not already open, open it
-            if (handle == BUS_INVALID) {
-                if ((handle = ::open (filePath.get (), O_RDWR)) != BUS_INVALID) {
-                    Log::info () << "Bus: " << "opened bus " << id << " (" << hex (handle) << ") on " << filePath << endl;
+            lock (priority);
 
-                    // set it to use 7-bit addressing
-                    if (ioctl (handle, I2C_TENBIT, 0) == 0) {
-                        Log::debug () << "Bus: " << "    ...and set it to use 7-bit addressing" << endl;
-                    } else {
-                        close ();
-                        throw RuntimeError (Text("Bus:") << "can't set 7-bit addressing (" << errno << ")");
-                    }
-                } else {
-                    throw RuntimeError (Text("Bus: ") << "can't open bus on " << filePath);
+            // open the bus if needed, and only set the slave address if it changed
+            open ();
+            if (address != currentAddress) {
+                if (parent and (currentAddress != BUS_NO_ADDRESS)) {
+                    throw RuntimeError (Text("Bus: ") << "dedicated handle is bound to " << hex (currentAddress) << ", not " << hex (address));
                 }
-            }
-
-            // set the slave address
-            if (ioctl (handle, I2C_SLAVE, address) != 0) {
-                throw RuntimeError (Text("Bus: ") << "can't set slave address");
+                if (not timedIoctl (BusOperation::SET_ADDRESS, I2C_SLAVE, reinterpret_cast<void*> (uintptr_t (address)))) {
+                    currentAddress = BUS_NO_ADDRESS;
+                    throw RuntimeError (Text("Bus: ") << "can't set slave address");
+                }
+                currentAddress = address;
             }
 
             // ready to do some work
@@ -183,9 +488,86 @@ MAKE_PTR_TO(Bus) {
 
         // finish working with the device
         void end () {
-            if (pthread_mutex_unlock (&mutex) != 0) {
-                throw RuntimeError (Text("Bus: ") << "can't unlock mutex");
+            unlock ();
+        }
+
+        // perform a combined transfer of raw I2C messages - each message carries its own slave
+        // address, and they are separated by repeated starts, with a single STOP at the end. this
+        // is a complete cycle on its own, it doesn't need to be wrapped in begin/end.
+        Bus* transfer (struct i2c_msg* messages, uint count, BusPriority priority = BusPriority::BACKGROUND) {
+            lock (priority);
+            try {
+                open ();
+                struct i2c_rdwr_ioctl_data data;
+                data.msgs = messages;
+                data.nmsgs = count;
+                uint64_t start = BusStatistics::now ();
+                bool success = (backend->ioctl (handle, I2C_RDWR, &data) >= 0);
+                uint64_t nanoseconds = BusStatistics::now () - start;
+
+                // the transfer is timed as a whole, but the traffic is recorded per message so it
+                // is attributed to the right addresses
+                statistics.getLatency (BusOperation::TRANSFER).record (nanoseconds);
+                for (uint i = 0; i < count; ++i) {
+                    bool isRead = (messages[i].flags & I2C_M_RD) != 0;
+                    statistics.recordTraffic (messages[i].addr, (success and isRead) ? messages[i].len : 0, (success and not isRead) ? messages[i].len : 0, not success);
+                }
+                if (not success) {
+                    throw RuntimeError (Text("Bus: ") << "transfer error (" << errno << ")");
+                }
+            } catch (RuntimeError& runtimeError) {
+                end ();
+                throw;
             }
+            end ();
+            return this;
+        }
+
+        // write a run of registers as one raw message to the current address, the register first
+        Bus* writeMessageAt (byte at, const byte* values, uint count) {
+            byte data[BUS_MESSAGE_MAX];
+            if (count >= BUS_MESSAGE_MAX) {
+                throw RuntimeError (Text("Bus: ") << "message too long (" << count << ")");
+            }
+            data[0] = at;
+            for (uint i = 0; i < count; ++i) {
+                data[i + 1] = values[i];
+            }
+            struct i2c_msg message;
+            message.addr = currentAddress;
+            message.flags = 0;
+            message.len = count + 1;
+            message.buf = data;
+            struct i2c_rdwr_ioctl_data transferData;
+            transferData.msgs = &message;
+            transferData.nmsgs = 1;
+            if (not timedIoctl (BusOperation::TRANSFER, I2C_RDWR, &transferData, 0, count + 1)) {
+                throw RuntimeError (Text("Bus: ") << "write error");
+            }
+            return this;
+        }
+
+        // read a run of registers starting at "at" as one combined transfer to the current address,
+        // the register is written first, and the read follows a repeated start
+        Bus* readMessageAt (byte at, byte* values, uint count) {
+            if (count >= BUS_MESSAGE_MAX) {
+                throw RuntimeError (Text("Bus: ") << "message too long (" << count << ")");
+            }
+            struct i2c_msg messages[2];
+            messages[0].addr = messages[1].addr = currentAddress;
+            messages[0].flags = 0;
+            messages[0].len = 1;
+            messages[0].buf = &at;
+            messages[1].flags = I2C_M_RD;
+            messages[1].len = count;
+            messages[1].buf = values;
+            struct i2c_rdwr_ioctl_data transferData;
+            transferData.msgs = messages;
+            transferData.nmsgs = 2;
+            if (not timedIoctl (BusOperation::TRANSFER, I2C_RDWR, &transferData, count, 1)) {
+                throw RuntimeError (Text("Bus: ") << "read error");
+            }
+            return this;
         }
 
         byte readByte () {
@@ -205,9 +587,78 @@ MAKE_PTR_TO(Bus) {
             return data[0];
         }
 
+        // read a run of consecutive registers starting at "at", in as few calls as the adapter
+        // allows, the same way writeBlockAt writes them
+        Bus* readBlockAt (byte at, byte* values, uint count) {
+            unsigned long mask = getFunctionality ();
+            if (mask & I2C_FUNC_I2C) {
+                return readMessageAt (at, values, count);
+            }
+            if (not (mask & I2C_FUNC_SMBUS_READ_I2C_BLOCK)) {
+                for (uint i = 0; i < count; ++i) {
+                    values[i] = readAt (byte (at + i));
+                }
+                return this;
+            }
+            while (count > 0) {
+                uint blockSize = min (count, uint (I2C_SMBUS_BLOCK_MAX));
+
+                // the first byte of an SMBus block is the length of the block
+                byte data[I2C_SMBUS_BLOCK_MAX + 2];
+                data[0] = byte (blockSize);
+                BusControl control (I2C_SMBUS_READ, at, I2C_SMBUS_I2C_BLOCK_DATA, data);
+                if (not timedIoctl (BusOperation::SMBUS_READ, I2C_SMBUS, &control, blockSize)) {
+                    throw RuntimeError (Text("Bus: ") << "read error");
+                }
+                for (uint i = 0; i < blockSize; ++i) {
+                    values[i] = data[i + 1];
+                }
+
+                at += blockSize;
+                values += blockSize;
+                count -= blockSize;
+            }
+            return this;
+        }
+
         Bus* writeAt (byte at, byte value) {
             byte data[2] = {value, 0x00};
             write (at, I2C_SMBUS_BYTE_DATA, &data[0]);
             return this;
         }
+
+        // write a run of consecutive registers starting at "at", in as few calls as the adapter
+        // allows - a single raw message if it can, SMBus blocks (split at the block limit) if it
+        // can't, and a register at a time as the last resort. the device has to be configured to
+        // auto-increment its register pointer for this to land where you expect.
+        Bus* writeBlockAt (byte at, const byte* values, uint count) {
+            switch (getWriteMode ()) {
+                case BusWriteMode::TRANSFER:
+                    writeMessageAt (at, values, count);
+                    return this;
+                case BusWriteMode::BYTE:
+                    for (uint i = 0; i < count; ++i) {
+                        writeAt (byte (at + i), values[i]);
+                    }
+                    return this;
+                default:
+                    break;
+            }
+            while (count > 0) {
+                uint blockSize = min (count, uint (I2C_SMBUS_BLOCK_MAX));
+
+                // the first byte of an SMBus block is the length of the block
+                byte data[I2C_SMBUS_BLOCK_MAX + 2];
+                data[0] = byte (blockSize);
+                for (uint i = 0; i < blockSize; ++i) {
+                    data[i + 1] = values[i];
+                }
+                write (at, I2C_SMBUS_I2C_BLOCK_DATA, &data[0]);
+
+                at += blockSize;
+                values += blockSize;
+                count -= blockSize;
+            }
+            return this;
+        }
 };
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "Log.h"
+
+// headers needed for open, close, and ioctl
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+
+#ifndef __APPLE__
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#else
+// shamelessly copied from a linux i2c.h and i2c-dev.h headers to facilitate compilation and unit
+// testing on platforms other than linux, or that don't have an I2C bus. prefer the linux source if
+// it is available
+
+#define I2C_SLAVE               0x0703  // use this slave address
+#define I2C_TENBIT              0x0704  // set to 0 for 7 bit addrs (pretty much everything we care about)
+#define I2C_SMBUS               0x0720  // perform a SMBus operation
+#define I2C_FUNCS               0x0705  // get the adapter functionality mask
+#define I2C_RDWR                0x0707  // perform a combined read/write transfer (one STOP only)
+
+// SMBus read or write markers
+#define I2C_SMBUS_READ          1
+#define I2C_SMBUS_WRITE         0
+
+// sizes of transfers for byte and byte data, and the block transfer that writes a run of
+// consecutive registers in one message
+#define I2C_SMBUS_BYTE          1
+#define I2C_SMBUS_BYTE_DATA     2
+#define I2C_SMBUS_I2C_BLOCK_DATA 8
+
+// the largest block the SMBus interface will carry in one transfer
+#define I2C_SMBUS_BLOCK_MAX     32
+
+// adapter functionality bits (the ones we care about)
+#define I2C_FUNC_I2C                    0x00000001  // plain I2C messages (I2C_RDWR)
+#define I2C_FUNC_SMBUS_BYTE             0x00060000
+#define I2C_FUNC_SMBUS_BYTE_DATA        0x00180000
+#define I2C_FUNC_SMBUS_READ_I2C_BLOCK   0x04000000
+#define I2C_FUNC_SMBUS_WRITE_I2C_BLOCK  0x08000000
+
+// raw I2C messages, a combined transfer is a list of messages separated by repeated starts
+#define I2C_M_RD                0x0001  // this message is a read
+#define I2C_RDWR_IOCTL_MAX_MSGS 42      // the most messages the kernel accepts in one transfer
+
+struct i2c_msg {
+    u2 addr;
+    u2 flags;
+    u2 len;
+    byte* buf;
+};
+
+struct i2c_rdwr_ioctl_data {
+    struct i2c_msg* msgs;
+    uint nmsgs;
+};
+
+#endif
+
+const int BUS_INVALID = -1;
+
+// the argument to an SMBus ioctl (i2c_smbus_ioctl_data in the linux headers)
+struct BusControl {
+    byte readWrite;
+    byte command;
+    uint size;
+    byte* data;
+
+    BusControl (byte _readWrite, byte _command, uint _size, byte*_data) :
+        readWrite (_readWrite), command (_command), size (_size), data(_data) {}
+};
+
+// the bus does its real I/O through a backend, which has the shape of the kernel interface: open a
+// bus file, make ioctl calls on the handle, close it. the default backend is the kernel itself,
+// another backend can stand in for it (a simulator, for instance) so the bus and everything above
+// it runs unchanged on a machine with no I2C hardware.
+MAKE_PTR_TO(BusBackend) {
+    public:
+        virtual ~BusBackend () {}
+
+        // returns a handle, or BUS_INVALID
+        virtual int open (const Text& filePath) = 0;
+
+        virtual void close (int handle) = 0;
+
+        // returns a negative value on failure, with errno set
+        virtual int ioctl (int handle, unsigned long request, void* argument) = 0;
+};
+
+class KernelBusBackend : public BusBackend {
+    public:
+        // there is only one kernel
+        static PtrToBusBackend get () {
+            static PtrToBusBackend kernel = new KernelBusBackend ();
+            return kernel;
+        }
+
+        int open (const Text& filePath) {
+            return ::open (filePath.get (), O_RDWR);
+        }
+
+        void close (int handle) {
+            ::close (handle);
+        }
+
+        int ioctl (int handle, unsigned long request, void* argument) {
+            return ::ioctl (handle, request, argument);
+        }
+};
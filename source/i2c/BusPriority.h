@@ -0,0 +1,23 @@
+#pragma once
+
+#include "Common.h"
+
+// the classes of traffic on a bus. real-time transfers (motor and stepper updates, where being late
+// means a missed step) go ahead of background transfers (sensor polling, configuration) waiting for
+// the same bus.
+enum class BusPriority : byte {
+    REALTIME, BACKGROUND
+};
+
+const uint BUS_PRIORITY_COUNT = static_cast<byte>(BusPriority::BACKGROUND) + 1;
+
+static inline
+const char* getBusPriorityName (BusPriority priority) {
+    static const char* names[BUS_PRIORITY_COUNT] = { "realtime", "background" };
+    return names[static_cast<byte>(priority)];
+}
+
+static inline
+ostream& operator << (ostream& stream, BusPriority priority) {
+    return (stream << getBusPriorityName (priority));
+}
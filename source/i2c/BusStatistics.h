@@ -0,0 +1,300 @@
+#pragma once
+
+#include "Text.h"
+#include "BusPriority.h"
+
+#include <atomic>
+#include <stdint.h>
+#include <time.h>
+
+// always-on counters and latency histograms for a bus. everything is a fixed-size array of relaxed
+// atomics, so recording never allocates or locks, and the statistics can be read (or reset) from
+// any thread while the bus is in use. a snapshot taken while the bus is busy might be off by the
+// operations in flight, which is fine for what these are for.
+
+// the operations we time, one histogram each
+enum class BusOperation : byte {
+    SMBUS_READ,
+    SMBUS_WRITE,
+    SMBUS_BLOCK_WRITE,
+    TRANSFER,
+    SET_ADDRESS,
+    CONFIGURE
+};
+
+const uint BUS_OPERATION_COUNT = static_cast<byte>(BusOperation::CONFIGURE) + 1;
+
+static inline
+const char* getBusOperationName (BusOperation operation) {
+    static const char* names[BUS_OPERATION_COUNT] = {
+        "smbusRead", "smbusWrite", "smbusBlockWrite", "transfer", "setAddress", "configure"
+    };
+    return names[static_cast<byte>(operation)];
+}
+
+// bucket i counts the samples from 2^i up to 2^(i + 1) nanoseconds, the last bucket also gets
+// anything longer (about 2 seconds and up)
+const uint LATENCY_HISTOGRAM_BUCKET_COUNT = 32;
+
+class LatencyHistogram {
+    private:
+        atomic<uint64_t> buckets[LATENCY_HISTOGRAM_BUCKET_COUNT];
+        atomic<uint64_t> count;
+        atomic<uint64_t> totalNanoseconds;
+        atomic<uint64_t> maxNanoseconds;
+
+    public:
+        LatencyHistogram () {
+            reset ();
+        }
+
+        void record (uint64_t nanoseconds) {
+            uint bucket = 0;
+            for (uint64_t value = nanoseconds >> 1; (value > 0) and (bucket < (LATENCY_HISTOGRAM_BUCKET_COUNT - 1)); value >>= 1) {
+                ++bucket;
+            }
+            buckets[bucket].fetch_add (1, memory_order_relaxed);
+            count.fetch_add (1, memory_order_relaxed);
+            totalNanoseconds.fetch_add (nanoseconds, memory_order_relaxed);
+            uint64_t previousMax = maxNanoseconds.load (memory_order_relaxed);
+            while ((nanoseconds > previousMax) and (not maxNanoseconds.compare_exchange_weak (previousMax, nanoseconds, memory_order_relaxed))) {}
+        }
+
+        void reset () {
+            for (uint i = 0; i < LATENCY_HISTOGRAM_BUCKET_COUNT; ++i) {
+                buckets[i].store (0, memory_order_relaxed);
+            }
+            count.store (0, memory_order_relaxed);
+            totalNanoseconds.store (0, memory_order_relaxed);
+            maxNanoseconds.store (0, memory_order_relaxed);
+        }
+
+        uint64_t getCount () {
+            return count.load (memory_order_relaxed);
+        }
+
+        uint64_t getTotalNanoseconds () {
+            return totalNanoseconds.load (memory_order_relaxed);
+        }
+
+        uint64_t getMaxNanoseconds () {
+            return maxNanoseconds.load (memory_order_relaxed);
+        }
+
+        uint64_t getMeanNanoseconds () {
+            uint64_t samples = getCount ();
+            return (samples > 0) ? (getTotalNanoseconds () / samples) : 0;
+        }
+
+        // the upper bound of the bucket that holds the given fraction (0..1) of the samples
+        uint64_t getPercentileNanoseconds (double fraction) {
+            uint64_t samples = getCount ();
+            uint64_t target = uint64_t (ceil (fraction * samples));
+            uint64_t sum = 0;
+            for (uint i = 0; i < LATENCY_HISTOGRAM_BUCKET_COUNT; ++i) {
+                sum += buckets[i].load (memory_order_relaxed);
+                if ((sum >= target) and (sum > 0)) {
+                    return uint64_t (2) << i;
+                }
+            }
+            return 0;
+        }
+
+        Text toText () {
+            return Text () << "count " << getCount () << ", mean " << (getMeanNanoseconds () / 1000) << "us, p50 <" << (getPercentileNanoseconds (0.5) / 1000) << "us, p99 <" << (getPercentileNanoseconds (0.99) / 1000) << "us, max " << (getMaxNanoseconds () / 1000) << "us";
+        }
+
+        Text toJson () {
+            Text json;
+            json << "{\"count\":" << getCount () << ",\"totalNanoseconds\":" << getTotalNanoseconds () << ",\"maxNanoseconds\":" << getMaxNanoseconds () << ",\"buckets\":[";
+            for (uint i = 0; i < LATENCY_HISTOGRAM_BUCKET_COUNT; ++i) {
+                json << ((i > 0) ? "," : "") << buckets[i].load (memory_order_relaxed);
+            }
+            return json << "]}";
+        }
+};
+
+// traffic to one device address
+class AddressStatistics {
+    private:
+        atomic<uint64_t> transactions;
+        atomic<uint64_t> bytesRead;
+        atomic<uint64_t> bytesWritten;
+        atomic<uint64_t> errors;
+
+    public:
+        AddressStatistics () {
+            reset ();
+        }
+
+        void record (uint64_t read, uint64_t written, bool error) {
+            transactions.fetch_add (1, memory_order_relaxed);
+            bytesRead.fetch_add (read, memory_order_relaxed);
+            bytesWritten.fetch_add (written, memory_order_relaxed);
+            if (error) {
+                errors.fetch_add (1, memory_order_relaxed);
+            }
+        }
+
+        void reset () {
+            transactions.store (0, memory_order_relaxed);
+            bytesRead.store (0, memory_order_relaxed);
+            bytesWritten.store (0, memory_order_relaxed);
+            errors.store (0, memory_order_relaxed);
+        }
+
+        uint64_t getTransactions () {
+            return transactions.load (memory_order_relaxed);
+        }
+
+        uint64_t getBytesRead () {
+            return bytesRead.load (memory_order_relaxed);
+        }
+
+        uint64_t getBytesWritten () {
+            return bytesWritten.load (memory_order_relaxed);
+        }
+
+        uint64_t getErrors () {
+            return errors.load (memory_order_relaxed);
+        }
+
+        Text toText () {
+            return Text () << "transactions " << getTransactions () << ", read " << getBytesRead () << " bytes, written " << getBytesWritten () << " bytes, errors " << getErrors ();
+        }
+
+        Text toJson () {
+            return Text () << "{\"transactions\":" << getTransactions () << ",\"bytesRead\":" << getBytesRead () << ",\"bytesWritten\":" << getBytesWritten () << ",\"errors\":" << getErrors () << "}";
+        }
+};
+
+// the 7-bit address space
+const uint BUS_ADDRESS_COUNT = 128;
+
+class BusStatistics {
+    private:
+        AddressStatistics total;
+        AddressStatistics addresses[BUS_ADDRESS_COUNT];
+        atomic<uint64_t> mutexWaitNanoseconds;
+        LatencyHistogram mutexWaits[BUS_PRIORITY_COUNT];
+        LatencyHistogram latencies[BUS_OPERATION_COUNT];
+
+    public:
+        BusStatistics () {
+            mutexWaitNanoseconds.store (0, memory_order_relaxed);
+        }
+
+        static uint64_t now () {
+            struct timespec time;
+            clock_gettime (CLOCK_MONOTONIC, &time);
+            return (uint64_t (time.tv_sec) * 1000000000) + time.tv_nsec;
+        }
+
+        // record a completed operation, the address may be BUS_NO_ADDRESS for operations that
+        // don't target a device
+        void record (BusOperation operation, uint address, uint64_t nanoseconds, uint64_t read, uint64_t written, bool error) {
+            latencies[static_cast<byte>(operation)].record (nanoseconds);
+            if ((operation != BusOperation::SET_ADDRESS) and (operation != BusOperation::CONFIGURE)) {
+                recordTraffic (address, read, written, error);
+            }
+        }
+
+        // record the data moved to or from an address, without timing it
+        void recordTraffic (uint address, uint64_t read, uint64_t written, bool error) {
+            total.record (read, written, error);
+            if (address < BUS_ADDRESS_COUNT) {
+                addresses[address].record (read, written, error);
+            }
+        }
+
+        // how long a caller of the given class waited to get the bus
+        void recordMutexWait (BusPriority priority, uint64_t nanoseconds) {
+            mutexWaitNanoseconds.fetch_add (nanoseconds, memory_order_relaxed);
+            mutexWaits[static_cast<byte>(priority)].record (nanoseconds);
+        }
+
+        void reset () {
+            total.reset ();
+            for (uint i = 0; i < BUS_ADDRESS_COUNT; ++i) {
+                addresses[i].reset ();
+            }
+            mutexWaitNanoseconds.store (0, memory_order_relaxed);
+            for (uint i = 0; i < BUS_PRIORITY_COUNT; ++i) {
+                mutexWaits[i].reset ();
+            }
+            for (uint i = 0; i < BUS_OPERATION_COUNT; ++i) {
+                latencies[i].reset ();
+            }
+        }
+
+        AddressStatistics& getTotal () {
+            return total;
+        }
+
+        AddressStatistics& getAddress (uint address) {
+            return addresses[address & (BUS_ADDRESS_COUNT - 1)];
+        }
+
+        LatencyHistogram& getLatency (BusOperation operation) {
+            return latencies[static_cast<byte>(operation)];
+        }
+
+        uint64_t getMutexWaitNanoseconds () {
+            return mutexWaitNanoseconds.load (memory_order_relaxed);
+        }
+
+        LatencyHistogram& getMutexWait (BusPriority priority) {
+            return mutexWaits[static_cast<byte>(priority)];
+        }
+
+        // every ioctl made, whether it moved data or not
+        uint64_t getIoctlCount () {
+            uint64_t count = 0;
+            for (uint i = 0; i < BUS_OPERATION_COUNT; ++i) {
+                count += latencies[i].getCount ();
+            }
+            return count;
+        }
+
+        Text toText () {
+            Text text;
+            text << total.toText () << ", mutex wait " << (getMutexWaitNanoseconds () / 1000) << "us" << "\n";
+            for (uint i = 0; i < BUS_PRIORITY_COUNT; ++i) {
+                if (mutexWaits[i].getCount () > 0) {
+                    text << "    " << getBusPriorityName (static_cast<BusPriority>(i)) << " wait: " << mutexWaits[i].toText () << "\n";
+                }
+            }
+            for (uint i = 0; i < BUS_OPERATION_COUNT; ++i) {
+                if (latencies[i].getCount () > 0) {
+                    text << "    " << getBusOperationName (static_cast<BusOperation>(i)) << ": " << latencies[i].toText () << "\n";
+                }
+            }
+            for (uint i = 0; i < BUS_ADDRESS_COUNT; ++i) {
+                if (addresses[i].getTransactions () > 0) {
+                    text << "    address " << hex (i) << ": " << addresses[i].toText () << "\n";
+                }
+            }
+            return text;
+        }
+
+        Text toJson () {
+            Text json;
+            json << "{\"total\":" << total.toJson () << ",\"mutexWaitNanoseconds\":" << getMutexWaitNanoseconds () << ",\"mutexWait\":{";
+            for (uint i = 0; i < BUS_PRIORITY_COUNT; ++i) {
+                json << ((i > 0) ? "," : "") << "\"" << getBusPriorityName (static_cast<BusPriority>(i)) << "\":" << mutexWaits[i].toJson ();
+            }
+            json << "},\"latency\":{";
+            for (uint i = 0; i < BUS_OPERATION_COUNT; ++i) {
+                json << ((i > 0) ? "," : "") << "\"" << getBusOperationName (static_cast<BusOperation>(i)) << "\":" << latencies[i].toJson ();
+            }
+            json << "},\"addresses\":{";
+            bool first = true;
+            for (uint i = 0; i < BUS_ADDRESS_COUNT; ++i) {
+                if (addresses[i].getTransactions () > 0) {
+                    json << (first ? "" : ",") << "\"" << hex (i) << "\":" << addresses[i].toJson ();
+                    first = false;
+                }
+            }
+            return json << "}}";
+        }
+};
@@ -0,0 +1,3 @@
+#include "BusWorker.h"
+
+map<uint, PtrToBusWorker> BusWorker::workers;
@@ -0,0 +1,271 @@
+#pragma once
+
+#include "Transaction.h"
+#include "Pause.h"
+
+#include <atomic>
+#include <functional>
+#include <future>
+#include <sched.h>
+#include <semaphore.h>
+
+// an optional asynchronous mode for a bus. the worker owns a thread that drains a bounded,
+// lock-free, multiple-producer single-consumer ring of prepared transactions and submits them to
+// the bus one at a time. producers only touch atomics to claim a slot (the wake-up semaphore only
+// enters the kernel when the worker is actually asleep), so a thread that submits work never
+// waits on the bus lock or on the ioctl. the blocking API on the bus keeps working alongside the
+// worker - both go through the bus mutex, so their transactions simply interleave. there is a ring
+// for each priority class, and the worker always drains the real-time ring first.
+
+const uint BUS_WORKER_DEFAULT_QUEUE_DEPTH = 64;
+const uint BUS_WORKER_MAX_QUEUE_DEPTH = 1024;
+
+// how long a producer waits before trying again when the queue is full and it was asked to block
+const int BUS_WORKER_BACKOFF_MICROSECONDS = 100;
+
+// called on the worker thread when a submitted transaction has been sent, with true for success
+typedef function<void (bool)> BusCompletion;
+
+MAKE_PTR_TO(BusWorker) {
+    public:
+        // what to do when a producer finds the queue full
+        enum Backpressure {
+            BLOCK,  // wait for the worker to make room
+            REJECT  // fail the submit immediately
+        };
+
+    private:
+        struct Slot {
+            atomic<uint> sequence;
+            Transaction transaction;
+            BusCompletion completion;
+        };
+
+        struct Ring {
+            Slot* slots;
+            uint mask;
+            atomic<uint> enqueuePosition;
+
+            // only the worker moves it, it is atomic so producers can read the queue length
+            atomic<uint> dequeuePosition;
+        };
+
+        PtrToBus bus;
+        Backpressure backpressure;
+        Ring rings[BUS_PRIORITY_COUNT];
+        atomic<bool> running;
+
+        // the submits in progress, shutdown waits for them so nothing is left in a ring after the
+        // worker has stopped draining it
+        atomic<uint> submitting;
+        sem_t available;
+        pthread_t thread;
+
+        static map<uint, PtrToBusWorker> workers;
+
+        BusWorker (PtrToBus _bus, uint queueDepth, Backpressure _backpressure) : bus (_bus), backpressure (_backpressure), running (true), submitting (0) {
+            // the ring size has to be a power of 2 so positions can wrap with a mask, and at least 2
+            // - with one slot, a published slot's sequence looks free to the next producer
+            uint size = 2;
+            while ((size < queueDepth) and (size < BUS_WORKER_MAX_QUEUE_DEPTH)) {
+                size <<= 1;
+            }
+            for (uint priority = 0; priority < BUS_PRIORITY_COUNT; ++priority) {
+                Ring& ring = rings[priority];
+                ring.mask = size - 1;
+                ring.slots = new Slot[size];
+                for (uint i = 0; i < size; ++i) {
+                    ring.slots[i].sequence.store (i, memory_order_relaxed);
+                }
+                ring.enqueuePosition.store (0, memory_order_relaxed);
+                ring.dequeuePosition.store (0, memory_order_relaxed);
+            }
+
+            if (sem_init (&available, 0, 0) != 0) {
+                deleteRings ();
+                throw RuntimeError (Text ("BusWorker: ") << "can't create semaphore");
+            }
+            if (pthread_create (&thread, 0, run, this) != 0) {
+                sem_destroy (&available);
+                deleteRings ();
+                throw RuntimeError (Text ("BusWorker: ") << "can't create thread");
+            }
+            Log::info () << "BusWorker: " << "started on bus " << bus->getId () << " with queue depth " << size << endl;
+        }
+
+        void deleteRings () {
+            for (uint priority = 0; priority < BUS_PRIORITY_COUNT; ++priority) {
+                delete[] rings[priority].slots;
+            }
+        }
+
+        static void* run (void* context) {
+            static_cast<BusWorker*> (context)->drain ();
+            return 0;
+        }
+
+        // send the oldest transaction in the most urgent ring that has one, returns false if both
+        // rings are empty. a producer claims a slot before it fills it in, so a claimed head that
+        // isn't published yet will be very soon - wait for it rather than lose track of it
+        bool sendNext () {
+            for (uint i = 0; i < BUS_PRIORITY_COUNT; ++i) {
+                Ring& ring = rings[i];
+                uint position = ring.dequeuePosition.load (memory_order_relaxed);
+                if (ring.enqueuePosition.load (memory_order_acquire) != position) {
+                    Slot& slot = ring.slots[position & ring.mask];
+                    while (slot.sequence.load (memory_order_acquire) != (position + 1)) {
+                        sched_yield ();
+                    }
+
+                    bool success = true;
+                    try {
+                        slot.transaction.submit (bus, static_cast<BusPriority> (i));
+                    } catch (RuntimeError& runtimeError) {
+                        Log::exception (runtimeError);
+                        success = false;
+                    }
+                    if (slot.completion) {
+                        slot.completion (success);
+                    }
+
+                    // release the slot back to the producers
+                    slot.transaction.reset ();
+                    slot.completion = nullptr;
+                    slot.sequence.store (position + ring.mask + 1, memory_order_release);
+                    ring.dequeuePosition.store (position + 1, memory_order_release);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void drain () {
+            // every publish posts the semaphore, and so does stopping. each wake sends everything
+            // that is ready, so the worker only sleeps with both rings empty - a post is never
+            // needed to find a transaction, and the leftover posts just wake it to find nothing.
+            for (;;) {
+                while (sem_wait (&available) != 0) {}
+                while (sendNext ()) {}
+                if (not running.load (memory_order_acquire)) {
+                    break;
+                }
+            }
+        }
+
+        bool tryEnqueue (Ring& ring, const Transaction& transaction, const BusCompletion& completion) {
+            uint position = ring.enqueuePosition.load (memory_order_relaxed);
+            for (;;) {
+                Slot& slot = ring.slots[position & ring.mask];
+                int difference = int (slot.sequence.load (memory_order_acquire) - position);
+                if (difference == 0) {
+                    if (ring.enqueuePosition.compare_exchange_weak (position, position + 1, memory_order_relaxed)) {
+                        slot.transaction = transaction;
+                        slot.completion = completion;
+                        slot.sequence.store (position + 1, memory_order_release);
+                        sem_post (&available);
+                        return true;
+                    }
+                } else if (difference < 0) {
+                    // the slot hasn't been released by the worker yet, so the queue is full
+                    return false;
+                } else {
+                    position = ring.enqueuePosition.load (memory_order_relaxed);
+                }
+            }
+        }
+
+    public:
+        // start an asynchronous worker on a bus, or get the one that is already running
+        static PtrToBusWorker start (PtrToBus bus, uint queueDepth = BUS_WORKER_DEFAULT_QUEUE_DEPTH, Backpressure backpressure = BLOCK) {
+            map<uint, PtrToBusWorker>::iterator iter = workers.find (bus->getId ());
+            if (iter == workers.end ()) {
+                PtrToBusWorker worker = new BusWorker (bus, queueDepth, backpressure);
+                workers[bus->getId ()] = worker;
+                return worker;
+            }
+            return iter->second;
+        }
+
+        // stop the worker on a bus after it sends everything already queued
+        static void stop (PtrToBus bus) {
+            map<uint, PtrToBusWorker>::iterator iter = workers.find (bus->getId ());
+            if (iter != workers.end ()) {
+                PtrToBusWorker worker = iter->second;
+                workers.erase (iter);
+                worker->shutdown ();
+            }
+        }
+
+        // find the worker for a bus - the map is only changed by start and stop, which should be
+        // called from setup code, not while other threads are submitting
+        static BusWorker* getWorker (PtrToBus bus) {
+            map<uint, PtrToBusWorker>::iterator iter = workers.find (bus->getId ());
+            return (iter != workers.end ()) ? iter->second.operator -> () : 0;
+        }
+
+        ~BusWorker () {
+            shutdown ();
+            sem_destroy (&available);
+            deleteRings ();
+        }
+
+        void shutdown () {
+            if (running.exchange (false)) {
+                sem_post (&available);
+                pthread_join (thread, 0);
+
+                // a submit that got in before running went false might have published after the
+                // worker's last pass, so once the submits in progress are done, what they left is
+                // sent here (and the completions are called on this thread)
+                while (submitting.load () > 0) {
+                    sched_yield ();
+                }
+                while (sendNext ()) {}
+                Log::info () << "BusWorker: " << "stopped on bus " << bus->getId () << endl;
+            }
+        }
+
+        // queue a transaction for the worker. returns false if the queue is full and the worker
+        // rejects, otherwise waits for room (or until the worker is stopped, which rejects too).
+        // real-time transactions are sent before any background transactions that are still
+        // waiting.
+        bool submit (const Transaction& transaction, const BusCompletion& completion = nullptr, BusPriority priority = BusPriority::BACKGROUND) {
+            // counted before running is checked, so shutdown either sees this submit or this
+            // submit sees the worker stopped
+            ++submitting;
+            if (not running.load ()) {
+                --submitting;
+                throw RuntimeError (Text ("BusWorker: ") << "not running");
+            }
+            bool queued = true;
+            while (not tryEnqueue (rings[static_cast<byte>(priority)], transaction, completion)) {
+                if ((backpressure == REJECT) or (not running.load ())) {
+                    Log::debug () << "BusWorker: " << "queue full, rejected" << endl;
+                    queued = false;
+                    break;
+                }
+                Pause::micro (BUS_WORKER_BACKOFF_MICROSECONDS);
+            }
+            --submitting;
+            return queued;
+        }
+
+        // the number of transactions waiting to be sent, in one class or all of them
+        uint getQueueLength (BusPriority priority) {
+            Ring& ring = rings[static_cast<byte>(priority)];
+            return ring.enqueuePosition.load (memory_order_relaxed) - ring.dequeuePosition.load (memory_order_acquire);
+        }
+
+        uint getQueueLength () {
+            uint length = 0;
+            for (uint priority = 0; priority < BUS_PRIORITY_COUNT; ++priority) {
+                length += getQueueLength (static_cast<BusPriority> (priority));
+            }
+            return length;
+        }
+
+        // the depth of each class's queue
+        uint getQueueDepth () {
+            return rings[0].mask + 1;
+        }
+};
@@ -1,10 +1,11 @@
 #pragma once
 
-#include "Bus.h"
+#include "BusWorker.h"
 
 // a general abstraction for a device on an I2C bus
 
 const int DEVICE_I2C_ATVALUE_BUFFER_SIZE = 128;
+const int DEVICE_I2C_REGISTER_COUNT = 256;
 
 MAKE_PTR_TO(DeviceI2C) {
     protected:
@@ -18,28 +19,248 @@ MAKE_PTR_TO(DeviceI2C) {
 
         PtrToBus bus;
         uint address;
+        BusPriority priority;
         uint length;
         Couplet couplets[DEVICE_I2C_ATVALUE_BUFFER_SIZE];
 
+        // whether the device auto-increments its register pointer across a write, so couplets
+        // that address consecutive registers can go as one block. not every device does (or does
+        // it by default), so it is off until the device's driver turns it on.
+        bool autoIncrement;
+
+        // the shadow is an optional image of the registers we have written to the device, over a
+        // range of registers that hold plain values (no side effects on write). a write that
+        // matches the shadow, or that is overridden by a later write in the same flush, is
+        // dropped instead of being sent. it is for devices whose driver doesn't keep an image of
+        // its own - a driver that does (like PCA9685) owns the register image, and refuses a
+        // device with the shadow enabled.
+        bool shadowEnabled;
+        byte shadowFirst;
+        byte shadowLast;
+        byte shadow[DEVICE_I2C_REGISTER_COUNT];
+        bool shadowValid[DEVICE_I2C_REGISTER_COUNT];
+        uint64_t shadowBytesSent;
+        uint64_t shadowBytesSaved;
+
+        // bookkeeping for writes handed to the bus worker - the device waits for them before it
+        // goes away, and a failed write makes the shadow untrustworthy
+        atomic<uint> pendingSubmits;
+        atomic<bool> submitFailed;
+
+        bool isShadowed (byte at) {
+            return shadowEnabled and (at >= shadowFirst) and (at <= shadowLast);
+        }
+
+        // remove the couplets that don't need to go to the device, and bring the shadow up to date
+        // with the ones that do
+        void filterCouplets () {
+            if (submitFailed.exchange (false)) {
+                invalidate ();
+            }
+
+            // find the last write to each register in the buffer
+            int lastWrite[DEVICE_I2C_REGISTER_COUNT];
+            for (uint i = 0; i < length; ++i) {
+                lastWrite[couplets[i].at] = i;
+            }
+
+            uint kept = 0;
+            for (uint i = 0; i < length; ++i) {
+                Couplet& couplet = couplets[i];
+                if (isShadowed (couplet.at)) {
+                    if ((lastWrite[couplet.at] != int (i)) or (shadowValid[couplet.at] and (shadow[couplet.at] == couplet.value))) {
+                        ++shadowBytesSaved;
+                        continue;
+                    }
+                    shadow[couplet.at] = couplet.value;
+                    shadowValid[couplet.at] = true;
+                    ++shadowBytesSent;
+                }
+                couplets[kept++] = couplet;
+            }
+            if (kept < length) {
+                Log::trace () << "DeviceI2C: " << "shadow dropped " << (length - kept) << " couplet" << (((length - kept) != 1) ? "s" : "") << endl;
+            }
+            length = kept;
+        }
+
+        // find the end of the run of couplets starting at i that can be sent as a single block -
+        // consecutive registers if the device auto-increments, otherwise just the one couplet
+        uint findRunEnd (uint i) {
+            uint end = i + 1;
+            if (autoIncrement) {
+                while ((end < length) and (couplets[end].at == (couplets[end - 1].at + 1))) {
+                    ++end;
+                }
+            }
+            return end;
+        }
+
+        // send the buffered couplets - with auto-increment, couplets that address consecutive
+        // registers are sent together as a single block transfer
+        uint sendCouplets () {
+            uint transfers = 0;
+            for (uint i = 0; i < length;) {
+                uint end = findRunEnd (i);
+                uint runLength = end - i;
+                if (runLength == 1) {
+                    bus->writeAt (couplets[i].at, couplets[i].value);
+                } else {
+                    byte values[DEVICE_I2C_ATVALUE_BUFFER_SIZE];
+                    for (uint j = 0; j < runLength; ++j) {
+                        values[j] = couplets[i + j].value;
+                    }
+                    bus->writeBlockAt (couplets[i].at, values, runLength);
+                }
+                ++transfers;
+                i = end;
+            }
+            return transfers;
+        }
+
+        // move the buffered couplets into transactions for the bus worker. a transaction holds a
+        // limited number of messages, so a scattered buffer might take more than one, and only the
+        // last one carries the caller's completion.
+        bool submitCouplets (BusWorker* worker, const BusCompletion& completion) {
+            if (shadowEnabled) {
+                filterCouplets ();
+            }
+
+            // the couplets from "first" on are in the transaction being built, the ones before it
+            // have already gone to the worker
+            shared_ptr<atomic<bool> > success = make_shared<atomic<bool> > (true);
+            Transaction transaction;
+            uint first = 0;
+            for (uint i = 0; i < length;) {
+                uint end = findRunEnd (i);
+                uint runLength = end - i;
+                if (not transaction.hasRoom (runLength + 1)) {
+                    if (not enqueue (worker, transaction, success, nullptr)) {
+                        return rejectCouplets (first);
+                    }
+                    transaction.reset ();
+                    first = i;
+                }
+                byte values[DEVICE_I2C_ATVALUE_BUFFER_SIZE];
+                for (uint j = 0; j < runLength; ++j) {
+                    values[j] = couplets[i + j].value;
+                }
+                transaction.writeAt (address, couplets[i].at, values, runLength);
+                i = end;
+            }
+            if (not enqueue (worker, transaction, success, completion)) {
+                return rejectCouplets (first);
+            }
+            Log::trace () << "DeviceI2C: " << "submit " << length << " couplet" << ((length != 1) ? "s" : "") << endl;
+            length = 0;
+            return true;
+        }
+
+        bool enqueue (BusWorker* worker, const Transaction& transaction, shared_ptr<atomic<bool> > success, const BusCompletion& completion) {
+            ++pendingSubmits;
+            bool queued;
+            try {
+                queued = worker->submit (transaction, [this, success, completion] (bool sent) {
+                    if (not sent) {
+                        *success = false;
+                        submitFailed = true;
+                    }
+                    if (completion) {
+                        completion (success->load ());
+                    }
+                    --pendingSubmits;
+                }, priority);
+            } catch (RuntimeError& runtimeError) {
+                --pendingSubmits;
+                throw;
+            }
+            if (not queued) {
+                --pendingSubmits;
+            }
+            return queued;
+        }
+
+        // the worker refused the writes from "first" on, they stay in the buffer for a later flush
+        // or submit, and the shadow forgets them so they won't be filtered out
+        bool rejectCouplets (uint first) {
+            uint kept = 0;
+            for (uint i = first; i < length; ++i) {
+                shadowValid[couplets[i].at] = false;
+                couplets[kept++] = couplets[i];
+            }
+            length = kept;
+            return false;
+        }
+
+        static PtrToBus getBus (uint address, int busId, BusHandle busHandle) {
+            PtrToBus bus = (busId >= 0) ? Bus::getBusById(busId) : Bus::getBusByIndex(-1 - busId);
+            switch (busHandle) {
+                case BusHandle::DEDICATED: return bus->getDedicatedBus (address);
+                case BusHandle::DEDICATED_SERIALIZED: return bus->getDedicatedBus (address, true);
+                default: return bus;
+            }
+        }
 
         // for testing purposes
-        DeviceI2C () : address (0), length (0) {}
+        DeviceI2C () : address (0), priority (BusPriority::BACKGROUND), length (0), autoIncrement (false), shadowEnabled (false), shadowBytesSent (0), shadowBytesSaved (0), pendingSubmits (0), submitFailed (false) {}
 
     public:
-        DeviceI2C (uint _address, int _bus = -1) : bus ((_bus >= 0) ? Bus::getBusById(_bus) : Bus::getBusByIndex(-1 - _bus)), address(_address), length (0) {}
+        DeviceI2C (uint _address, int _bus = -1, BusHandle busHandle = BusHandle::SHARED) : bus (getBus (_address, _bus, busHandle)), address(_address), priority (BusPriority::BACKGROUND), length (0), autoIncrement (false), shadowEnabled (false), shadowBytesSent (0), shadowBytesSaved (0), pendingSubmits (0), submitFailed (false) {}
 
-        ~DeviceI2C () {}
+        ~DeviceI2C () {
+            // the worker still refers to this device until everything we gave it is done
+            while (pendingSubmits.load () > 0) {
+                Pause::micro (BUS_WORKER_BACKOFF_MICROSECONDS);
+            }
+        }
 
         DeviceI2C*  begin () {
-            bus->begin (address);
+            bus->begin (address, priority);
+            return this;
+        }
+
+        // the class of all the traffic to this device, real-time traffic gets the bus (and the
+        // bus worker) ahead of background traffic
+        DeviceI2C* setPriority (BusPriority _priority) {
+            priority = _priority;
+            return this;
+        }
+
+        BusPriority getPriority () {
+            return priority;
+        }
+
+        // the device auto-increments its register pointer (the driver has set it up that way), so
+        // buffered writes to consecutive registers can be sent as blocks. without it, every couplet
+        // is its own transfer.
+        DeviceI2C* enableAutoIncrement () {
+            flush ();
+            autoIncrement = true;
             return this;
         }
 
-        // reads are always immediate, after a flush
+        DeviceI2C* disableAutoIncrement () {
+            flush ();
+            autoIncrement = false;
+            return this;
+        }
+
+        // reads are always immediate, after a flush. reads of shadowed registers with a known
+        // value are served from the shadow, which is how write-only registers can be read back.
         byte read (byte at) {
             flush ();
-            byte result = bus->readAt(at);
-            Log::trace () << "DeviceI2C: " << "read (@" << hex (at) << ", got -> " << hex (result) << ")" << endl;
+            byte result;
+            if (isShadowed (at) and shadowValid[at]) {
+                result = shadow[at];
+                Log::trace () << "DeviceI2C: " << "read (@" << hex (at) << ", shadow -> " << hex (result) << ")" << endl;
+            } else {
+                result = bus->readAt(at);
+                Log::trace () << "DeviceI2C: " << "read (@" << hex (at) << ", got -> " << hex (result) << ")" << endl;
+                if (isShadowed (at)) {
+                    shadow[at] = result;
+                    shadowValid[at] = true;
+                }
+            }
             return result;
         }
 
@@ -48,6 +269,22 @@ MAKE_PTR_TO(DeviceI2C) {
             return this;
         }
 
+        // read a run of consecutive registers in one go (the device has to auto-increment its
+        // register pointer), the values read are taken into the shadow
+        DeviceI2C* readBlock (byte at, byte* out, uint count) {
+            flush ();
+            bus->readBlockAt (at, out, count);
+            Log::trace () << "DeviceI2C: " << "read block (@" << hex (at) << ", " << count << " byte" << ((count != 1) ? "s" : "") << ")" << endl;
+            for (uint i = 0; i < count; ++i) {
+                byte next = byte (at + i);
+                if (isShadowed (next)) {
+                    shadow[next] = out[i];
+                    shadowValid[next] = true;
+                }
+            }
+            return this;
+        }
+
         // writes are buffered
         DeviceI2C* write (byte at, byte value) {
             if (length < DEVICE_I2C_ATVALUE_BUFFER_SIZE) {
@@ -62,20 +299,178 @@ MAKE_PTR_TO(DeviceI2C) {
         // finish any writes
         DeviceI2C* flush () {
             if (length > 0) {
-                for (uint i = 0; i < length; ++i) {
-                    Couplet& couplet = couplets[i];
-                    bus->writeAt (couplet.at, couplet.value);
+                uint requested = length;
+                if (shadowEnabled) {
+                    filterCouplets ();
+                }
+                try {
+                    uint transfers = sendCouplets ();
+                    Log::trace () << "DeviceI2C: " << "flush " << requested << " couplet" << ((requested != 1) ? "s" : "") << " in " << transfers << " transfer" << ((transfers != 1) ? "s" : "") << endl;
+                } catch (RuntimeError& runtimeError) {
+                    // we don't know what made it to the device, so the shadow can't be trusted
+                    length = 0;
+                    invalidate ();
+                    throw;
+                }
+                length = 0;
+            }
+            return this;
+        }
+
+        // finish any writes as a single combined transfer - the runs are separated by repeated
+        // starts, and there is only one STOP, at the very end. a device that latches its outputs on
+        // the STOP (like the PCA9685) sees all the writes take effect at once. if the adapter can't
+        // do raw transfers, or the writes don't fit in one transaction, this is a plain flush.
+        DeviceI2C* flushCombined () {
+            if (length > 0) {
+                if (shadowEnabled) {
+                    filterCouplets ();
+                }
+                Transaction transaction;
+                bool combined = bus->canTransfer ();
+                for (uint i = 0; combined and (i < length);) {
+                    uint end = findRunEnd (i);
+                    uint runLength = end - i;
+                    combined = transaction.hasRoom (runLength + 1);
+                    if (combined) {
+                        byte values[DEVICE_I2C_ATVALUE_BUFFER_SIZE];
+                        for (uint j = 0; j < runLength; ++j) {
+                            values[j] = couplets[i + j].value;
+                        }
+                        transaction.writeAt (address, couplets[i].at, values, runLength);
+                    }
+                    i = end;
+                }
+                try {
+                    if (combined) {
+                        transaction.submit (bus, priority);
+                        Log::trace () << "DeviceI2C: " << "flush " << length << " couplet" << ((length != 1) ? "s" : "") << " combined in " << transaction.getMessageCount () << " message" << ((transaction.getMessageCount () != 1) ? "s" : "") << endl;
+                    } else {
+                        uint transfers = sendCouplets ();
+                        Log::debug () << "DeviceI2C: " << "can't combine, flush " << length << " couplet" << ((length != 1) ? "s" : "") << " in " << transfers << " transfer" << ((transfers != 1) ? "s" : "") << endl;
+                    }
+                } catch (RuntimeError& runtimeError) {
+                    length = 0;
+                    invalidate ();
+                    throw;
                 }
-                Log::trace () << "DeviceI2C: " << "flush " << length << " couplet" << ((length != 1) ? "s" : "") << endl;
                 length = 0;
             }
             return this;
         }
 
+        // the bus is let go even if the writes fail, so a failed write doesn't leave the bus
+        // locked by this thread
         void end () {
-            flush ();
+            try {
+                flush ();
+            } catch (RuntimeError& runtimeError) {
+                bus->end ();
+                throw;
+            }
             bus->end ();
         }
+
+        // hand the buffered writes to the bus worker as a single transaction instead of sending
+        // them now, and return without waiting for the bus. this doesn't need begin/end. if the
+        // bus has no worker (or the adapter can't do raw transfers), the writes are sent right away. the completion (if any) is called on
+        // the worker thread when the writes have been sent. returns false if the worker's queue is
+        // full and it rejects - the writes stay buffered.
+        bool submit (const BusCompletion& completion = nullptr) {
+            BusWorker* worker = BusWorker::getWorker (bus);
+            if (worker and bus->canTransfer ()) {
+                return submitCouplets (worker, completion);
+            }
+
+            bool success = true;
+            try {
+                begin ();
+                end ();
+            } catch (RuntimeError& runtimeError) {
+                Log::exception (runtimeError);
+                success = false;
+            }
+            if (completion) {
+                completion (success);
+            }
+            return true;
+        }
+
+        // as submit, but the result is delivered through a future. if the submit was rejected,
+        // the future is already resolved to false
+        future<bool> submitFuture () {
+            shared_ptr<promise<bool> > result = make_shared<promise<bool> > ();
+            if (not submit ([result] (bool success) { result->set_value (success); })) {
+                result->set_value (false);
+            }
+            return result->get_future ();
+        }
+
+        // keep a shadow image of the registers in the range first..last. only registers that
+        // simply hold the value written to them (like the PCA9685 LED registers) should be
+        // shadowed, as writes to them may be dropped or reordered with respect to each other.
+        DeviceI2C* enableShadow (byte first = 0x00, byte last = 0xff) {
+            flush ();
+            shadowEnabled = true;
+            shadowFirst = first;
+            shadowLast = last;
+            return invalidate ();
+        }
+
+        DeviceI2C* disableShadow () {
+            flush ();
+            shadowEnabled = false;
+            return this;
+        }
+
+        bool isShadowEnabled () {
+            return shadowEnabled;
+        }
+
+        // forget what we know about the registers in the range, the next write to each one will be
+        // sent to the device. use this when something other than this object changed the device
+        // (a reset, an "all" register that fans out to others, another process, etc.)
+        DeviceI2C* invalidate (byte first = 0x00, byte last = 0xff) {
+            for (uint at = first; at <= last; ++at) {
+                shadowValid[at] = false;
+            }
+            return this;
+        }
+
+        // re-read the shadowed registers from the device
+        DeviceI2C* resync () {
+            if (shadowEnabled) {
+                begin ();
+                flush ();
+                for (uint at = shadowFirst; at <= shadowLast; ++at) {
+                    shadow[at] = bus->readAt (byte (at));
+                    shadowValid[at] = true;
+                }
+                end ();
+                Log::debug () << "DeviceI2C: " << "resync shadow (@" << hex (shadowFirst) << "..@" << hex (shadowLast) << ")" << endl;
+            }
+            return this;
+        }
+
+        // the number of bytes to shadowed registers that were sent, and that were dropped
+        uint64_t getShadowBytesSent () {
+            return shadowBytesSent;
+        }
+
+        uint64_t getShadowBytesSaved () {
+            return shadowBytesSaved;
+        }
+
+        // the traffic to this device's address on its bus
+        AddressStatistics& getStatistics () {
+            return bus->getStatistics ().getAddress (address);
+        }
+
+        DeviceI2C* resetShadowCounters () {
+            shadowBytesSent = 0;
+            shadowBytesSaved = 0;
+            return this;
+        }
 };
 
 //------------------------------------------------------------------------------------------------------
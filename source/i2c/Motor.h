@@ -2,18 +2,37 @@
 
 #include "Log.h"
 #include "MotorId.h"
+#include "MotorRamp.h"
 
 /**
 * Motor
 * brushed motors have relatively simple controllers that use two wires, and control the speed by
 * switching the power on and off really fast using a modulated width pulse, a.k.a. PWM.
+*
+* speed changes can be immediate (run, stop) or ramped (rampTo), where a background scheduler
+* moves the speed toward the target no faster than a given acceleration. while any motor is
+* ramping, the motors on its driver should only be changed through their Motor objects, so the
+* scheduler can keep the updates to the driver in order.
 */
 template<typename DriverType>
 class Motor : public ReferenceCountedObject {
     private:
         PtrTo<DriverType> driver;
         MotorId motorId;
-        double speed;
+        atomic<double> speed;
+
+        friend class MotorRampScheduler<DriverType>;
+
+        // called by the scheduler, with its lock held
+        void apply (double _speed) {
+            speed = _speed;
+            Log::trace () << "Motor: " << "MOTOR_" << motorId << " @ " << _speed << endl;
+            driver->runMotor (motorId, _speed);
+        }
+
+        static MotorRampScheduler<DriverType>* getScheduler () {
+            return MotorRampScheduler<DriverType>::get ();
+        }
 
     public:
 
@@ -24,19 +43,25 @@ class Motor : public ReferenceCountedObject {
     * @param servoController the controller to use for this servo
     * @param servoId         the id corresponding to the driver pins for this servo on the controller
     */
-    Motor (PtrTo<DriverType> _driver, MotorId _motorId) : driver (_driver), motorId (_motorId) {
+    Motor (PtrTo<DriverType> _driver, MotorId _motorId) : driver (_driver), motorId (_motorId), speed (0) {
         stop ();
     }
 
+    /**
+    * a motor that is still ramping is cancelled, so the scheduler never steps a motor that is gone
+    */
+    ~Motor () {
+        getScheduler ()->cancel (this);
+    }
+
     /**
     * @param speed - setting the speed at the controller (-1..1)
     *              -1 = full speed backward, 0 = stopped, 1 = full speed forward
+    *              any ramp in progress is cancelled
     * @return
     */
     Motor* run (double _speed) {
-        speed = min (max (_speed, -1.0), 1.0);
-        Log::trace () << "Motor: " << "MOTOR_" << motorId << " @ " << speed << endl;
-        driver->runMotor (motorId, speed);
+        getScheduler ()->set (this, min (max (_speed, -1.0), 1.0));
         return this;
     }
 
@@ -44,12 +69,50 @@ class Motor : public ReferenceCountedObject {
      * @return
      */
     Motor* stop () {
-        speed = 0;
-        //Log::trace () << "Motor: " << "MOTOR_" << motorId << " @ STOP" << endl;
-        driver->runMotor (motorId, speed);
+        getScheduler ()->set (this, 0);
+        return this;
+    }
+
+    /**
+    * move the speed toward a target no faster than an acceleration limit, any ramp already in
+    * progress is replaced (and completes as cancelled)
+    * @param target       - the speed to end at (-1..1)
+    * @param acceleration - the largest change in speed per second, must be positive
+    * @param completion   - called with true when the target is reached, or false if the ramp is
+    *                       cancelled (by cancelRamp, run, stop, or another rampTo) or the driver
+    *                       fails
+    * @return
+    */
+    Motor* rampTo (double target, double acceleration, const MotorRampCompletion& completion = nullptr) {
+        getScheduler ()->add (this, min (max (target, -1.0), 1.0), acceleration, completion);
         return this;
     }
 
+    /**
+    * as rampTo, but the result is delivered through a future
+    * @return
+    */
+    future<bool> rampToFuture (double target, double acceleration) {
+        shared_ptr<promise<bool> > result = make_shared<promise<bool> > ();
+        rampTo (target, acceleration, [result] (bool success) { result->set_value (success); });
+        return result->get_future ();
+    }
+
+    /**
+    * stop ramping, leaving the speed wherever the ramp had gotten to
+    * @return true if the motor was ramping
+    */
+    bool cancelRamp () {
+        return getScheduler ()->cancel (this);
+    }
+
+    /**
+     * @return
+     */
+    bool isRamping () {
+        return getScheduler ()->isRamping (this);
+    }
+
     /**
      * @return
      */
@@ -63,4 +126,11 @@ class Motor : public ReferenceCountedObject {
     double getSpeed () {
         return speed;
     }
+
+    /**
+     * @return
+     */
+    DriverType* getDriver () {
+        return driver.getPtr ();
+    }
 };
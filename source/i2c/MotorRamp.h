@@ -0,0 +1,261 @@
+#pragma once
+
+#include "Log.h"
+#include "MotorId.h"
+
+#include <functional>
+#include <atomic>
+#include <future>
+#include <pthread.h>
+#include <time.h>
+
+// the ramp scheduler moves motors toward a target speed no faster than an acceleration limit. a
+// single thread (per driver type) steps every ramping motor at a fixed tick, and all the motors on
+// the same driver are stepped inside one frame, so each driver gets one transaction per tick no
+// matter how many of its motors are ramping. the thread is started by the first ramp, and sleeps
+// while there is nothing to do.
+
+// 100 ticks per second
+const uint MOTOR_RAMP_DEFAULT_TICK_MICROSECONDS = 10000;
+
+// called when a ramp ends, with true if it reached its target and false if it was cancelled (or
+// the driver failed), on the scheduler thread or the thread that cancelled it
+typedef function<void (bool)> MotorRampCompletion;
+
+template<typename DriverType> class Motor;
+
+template<typename DriverType>
+class MotorRampScheduler {
+    protected:
+        struct Ramp {
+            Motor<DriverType>* motor;
+            double target;
+            double acceleration;
+            MotorRampCompletion completion;
+        };
+
+        // the mutex also guards the drivers, every motor update goes through the scheduler so the
+        // ramps and the callers never write to a driver at the same time
+        pthread_mutex_t mutex;
+        pthread_cond_t wake;
+        pthread_t thread;
+        bool started;
+        bool running;
+        uint tickMicroseconds;
+        uint64_t tickCount;
+        vector<Ramp> ramps;
+
+        MotorRampScheduler () : started (false), running (true), tickMicroseconds (MOTOR_RAMP_DEFAULT_TICK_MICROSECONDS), tickCount (0) {
+            pthread_mutexattr_t attributes;
+            pthread_mutexattr_init (&attributes);
+            pthread_mutexattr_settype (&attributes, PTHREAD_MUTEX_RECURSIVE);
+            pthread_mutex_init (&mutex, &attributes);
+            pthread_mutexattr_destroy (&attributes);
+            pthread_cond_init (&wake, 0);
+        }
+
+        ~MotorRampScheduler () {
+            pthread_mutex_lock (&mutex);
+            running = false;
+            pthread_cond_signal (&wake);
+            pthread_mutex_unlock (&mutex);
+            if (started) {
+                pthread_join (thread, 0);
+            }
+            pthread_cond_destroy (&wake);
+            pthread_mutex_destroy (&mutex);
+        }
+
+        static void* run (void* context) {
+            static_cast<MotorRampScheduler<DriverType>*> (context)->tickLoop ();
+            return 0;
+        }
+
+        static void advance (struct timespec& time, uint microseconds) {
+            time.tv_nsec += long (microseconds) * 1000;
+            while (time.tv_nsec >= 1000000000) {
+                time.tv_nsec -= 1000000000;
+                ++time.tv_sec;
+            }
+        }
+
+        void tickLoop () {
+            struct timespec next;
+            clock_gettime (CLOCK_MONOTONIC, &next);
+            pthread_mutex_lock (&mutex);
+            while (running) {
+                if (ramps.empty ()) {
+                    // nothing to do, wait for a ramp and start the ticks over from now
+                    pthread_cond_wait (&wake, &mutex);
+                    clock_gettime (CLOCK_MONOTONIC, &next);
+                    continue;
+                }
+
+                // the ticks are on absolute deadlines, so the time spent stepping doesn't add up
+                advance (next, tickMicroseconds);
+                pthread_mutex_unlock (&mutex);
+                while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &next, 0) != 0) {}
+                pthread_mutex_lock (&mutex);
+                if (running) {
+                    tick (tickMicroseconds / 1.0e6);
+                }
+            }
+            pthread_mutex_unlock (&mutex);
+        }
+
+        // step every ramp by one tick, a frame per driver. called with the mutex held, the
+        // completions are called after it is released
+        void tick (double seconds) {
+            vector<pair<MotorRampCompletion, bool> > completions;
+            vector<bool> stepped (ramps.size (), false);
+            for (uint i = 0; i < ramps.size (); ++i) {
+                if (not stepped[i]) {
+                    DriverType* driver = ramps[i].motor->getDriver ();
+                    bool success = true;
+                    try {
+                        driver->beginFrame ();
+                        for (uint j = i; j < ramps.size (); ++j) {
+                            if (ramps[j].motor->getDriver () == driver) {
+                                Ramp& ramp = ramps[j];
+                                double speed = ramp.motor->getSpeed ();
+                                double step = ramp.acceleration * seconds;
+                                ramp.motor->apply ((ramp.target > speed) ? min (speed + step, ramp.target) : max (speed - step, ramp.target));
+                                stepped[j] = true;
+                            }
+                        }
+                        driver->commit ();
+                    } catch (RuntimeError& runtimeError) {
+                        Log::exception (runtimeError);
+                        success = false;
+                    }
+
+                    // the ramps on this driver that are done, or that failed, come out
+                    for (uint j = i; j < ramps.size (); ++j) {
+                        Ramp& ramp = ramps[j];
+                        if ((ramp.motor->getDriver () == driver) and ((not success) or (ramp.motor->getSpeed () == ramp.target))) {
+                            if (ramp.completion) {
+                                completions.push_back (make_pair (ramp.completion, success));
+                            }
+                            ramp.motor = 0;
+                        }
+                    }
+                }
+            }
+            uint kept = 0;
+            for (uint i = 0; i < ramps.size (); ++i) {
+                if (ramps[i].motor) {
+                    ramps[kept++] = ramps[i];
+                }
+            }
+            ramps.resize (kept);
+            ++tickCount;
+
+            pthread_mutex_unlock (&mutex);
+            for (typename vector<pair<MotorRampCompletion, bool> >::iterator iter = completions.begin (); iter != completions.end (); ++iter) {
+                iter->first (iter->second);
+            }
+            pthread_mutex_lock (&mutex);
+        }
+
+        // take the motor's ramp out, if it has one, and return its completion
+        bool remove (Motor<DriverType>* motor, MotorRampCompletion& completion) {
+            for (typename vector<Ramp>::iterator iter = ramps.begin (); iter != ramps.end (); ++iter) {
+                if (iter->motor == motor) {
+                    completion = iter->completion;
+                    ramps.erase (iter);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+    public:
+        static MotorRampScheduler<DriverType>* get () {
+            static MotorRampScheduler<DriverType> scheduler;
+            return &scheduler;
+        }
+
+        // start (or replace) a ramp for a motor, a replaced ramp completes as cancelled
+        void add (Motor<DriverType>* motor, double target, double acceleration, const MotorRampCompletion& completion) {
+            if (acceleration <= 0.0) {
+                throw RuntimeError (Text ("MotorRampScheduler: ") << "invalid acceleration (" << acceleration << ")");
+            }
+            pthread_mutex_lock (&mutex);
+            MotorRampCompletion replaced;
+            bool hadRamp = remove (motor, replaced);
+            Ramp ramp;
+            ramp.motor = motor;
+            ramp.target = target;
+            ramp.acceleration = acceleration;
+            ramp.completion = completion;
+            ramps.push_back (ramp);
+            if (not started) {
+                if (pthread_create (&thread, 0, run, this) != 0) {
+                    ramps.pop_back ();
+                    pthread_mutex_unlock (&mutex);
+                    throw RuntimeError (Text ("MotorRampScheduler: ") << "can't create thread");
+                }
+                started = true;
+            }
+            pthread_cond_signal (&wake);
+            pthread_mutex_unlock (&mutex);
+            Log::debug () << "MotorRampScheduler: " << "MOTOR_" << motor->getMotorId () << " ramp to " << target << " @ " << acceleration << "/s" << endl;
+            if (hadRamp and replaced) {
+                replaced (false);
+            }
+        }
+
+        // stop a motor's ramp where it is, returns true if it had one
+        bool cancel (Motor<DriverType>* motor) {
+            pthread_mutex_lock (&mutex);
+            MotorRampCompletion completion;
+            bool hadRamp = remove (motor, completion);
+            pthread_mutex_unlock (&mutex);
+            if (hadRamp and completion) {
+                completion (false);
+            }
+            return hadRamp;
+        }
+
+        bool isRamping (Motor<DriverType>* motor) {
+            pthread_mutex_lock (&mutex);
+            bool ramping = false;
+            for (typename vector<Ramp>::iterator iter = ramps.begin (); (iter != ramps.end ()) and (not ramping); ++iter) {
+                ramping = (iter->motor == motor);
+            }
+            pthread_mutex_unlock (&mutex);
+            return ramping;
+        }
+
+        // set a motor's speed right away, any ramp it had is cancelled
+        void set (Motor<DriverType>* motor, double speed) {
+            cancel (motor);
+            pthread_mutex_lock (&mutex);
+            try {
+                motor->apply (speed);
+            } catch (...) {
+                pthread_mutex_unlock (&mutex);
+                throw;
+            }
+            pthread_mutex_unlock (&mutex);
+        }
+
+        MotorRampScheduler<DriverType>* setTick (uint microseconds) {
+            pthread_mutex_lock (&mutex);
+            tickMicroseconds = max (microseconds, 100u);
+            pthread_mutex_unlock (&mutex);
+            return this;
+        }
+
+        uint getTick () {
+            return tickMicroseconds;
+        }
+
+        // the number of ticks that stepped ramps
+        uint64_t getTickCount () {
+            pthread_mutex_lock (&mutex);
+            uint64_t count = tickCount;
+            pthread_mutex_unlock (&mutex);
+            return count;
+        }
+};
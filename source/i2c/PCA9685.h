@@ -3,22 +3,48 @@
 #include "Log.h"
 #include "Pause.h"
 #include "Text.h"
+#include "BusPriority.h"
 
 // values used for setting the pulse frequency, the default is 1ms per cycle
 const double PCA9685_CLOCK_FREQUENCY = 25000000.0; // PCA9685 has a 25 MHz internal oscillator
 const uint PCA9685_DEFAULT_PULSE_FREQUENCY = 1000;
 
+// one channel's pulse parameters, for updating many channels at once
+struct ChannelPulse {
+    byte channel;
+    u2 on;
+    u2 off;
+};
+
+// when the outputs take on new channel values (MODE2 OCH): on the STOP at the end of a transfer
+// (the power-on default), so everything written in one transfer changes at once, or on the
+// acknowledge of each byte, so the registers of a channel change one by one
+enum class PCA9685OutputChange : byte {
+    STOP,
+    ACK
+};
+
+template<typename DeviceType> class PCA9685Group;
+template<typename DeviceType> class PCA9685BringUp;
+
 // This is a software interface for the PCA9685. It is a 16-channel Pulse Width Modulator (PWM)
 // Controller (designed to drive LEDs) with 12 bits of resolution, and controlled over the I2C bus.
 // The 9685 is used in the Adafruit motor hat and the servo driver board
 // https://cdn-shop.adafruit.com/datasheets/PCA9685.pdf
 template<typename DeviceType>
 class PCA9685 : public ReferenceCountedObject {
+    // a group writes the same registers to several boards at once
+    friend class PCA9685Group<DeviceType>;
+
+    // a bring-up writes the same setup registers to many boards at once
+    friend class PCA9685BringUp<DeviceType>;
+
     protected:
         enum {
             // registers (https://cdn-shop.adafruit.com/datasheets/PCA9685.pdf - table 4)
             MODE1 = 0x00,
             MODE2 = 0x01,
+            SUBADR1 = 0x02,
             PRE_SCALE = 0xfe,
 
             // these registers are used as the base address of the full set of supported channels,
@@ -28,6 +54,7 @@ class PCA9685 : public ReferenceCountedObject {
 
             // values used for offsetting the registers by channel, "ALL" is a special channel
             CHANNEL_OFFSET_MULTIPLIER = 4,
+            CHANNEL_COUNT = 16,
             CHANNEL_ALL = 0x3d,
 
             // the pulse width modulators (PWM) have 12-bit resolution
@@ -36,25 +63,75 @@ class PCA9685 : public ReferenceCountedObject {
 
             // bits (https://cdn-shop.adafruit.com/datasheets/PCA9685.pdf - mode 1, table 5)
             RESTART = 0x80,
+            AUTO_INCREMENT = 0x20,
             SLEEP = 0x10,
+            SUB1 = 0x08,
+            SUB2 = 0x04,
+            SUB3 = 0x02,
             ALLCALL = 0x01,
 
             // bits (https://cdn-shop.adafruit.com/datasheets/PCA9685.pdf - mode 2, table 6)
-            OUTDRV = 0x04
+            OCH = 0x08,
+            OUTDRV = 0x04,
+
+            // the registers from MODE1 through the last channel's LED15_OFF_H, read in one block
+            // when attaching to a running chip
+            REGISTER_FILE_COUNT = 0x46,
+
+            REGISTER_COUNT = 256
         };
 
         // internal variables
         PtrTo<DeviceType> device;
         double pulseFrequency;
 
+        // an image of the chip's registers - the values we last wrote or staged, which ones we
+        // know, and which ones are staged but not yet sent. the known registers let an update fill
+        // the gaps between the registers it changes and still go to the chip as a single run. the
+        // driver owns this image, so the device's own shadow (DeviceI2C::enableShadow) must stay
+        // off - it would only duplicate the image, and drop the gap writes that keep a run whole.
+        byte registerImage[REGISTER_COUNT];
+        bool registerKnown[REGISTER_COUNT];
+        bool registerDirty[REGISTER_COUNT];
+        bool framing;
+        bool attached;
+        PCA9685OutputChange outputChange;
+
         // internal methods
-        void init (uint requestedPulseFrequency) {
-            // init, everything off
-            setChannelPulse (CHANNEL_ALL, 0, 0);
+        void checkNoShadow () {
+            if (device->isShadowEnabled ()) {
+                throw RuntimeError (Text ("PCA9685: ") << "the device has a shadow, the driver keeps the register image");
+            }
+        }
+
+        void init (uint requestedPulseFrequency, byte preScale = 0, double clockFrequency = PCA9685_CLOCK_FREQUENCY, bool attach = false) {
+            checkNoShadow ();
+            framing = false;
+            attached = false;
+            outputChange = PCA9685OutputChange::STOP;
+            for (uint i = 0; i < REGISTER_COUNT; ++i) {
+                registerKnown[i] = false;
+                registerDirty[i] = false;
+            }
+
+            // a chip that is already running the way we would set it up is left alone
+            if (attach and adopt ((preScale > 0) ? preScale : computePreScale (requestedPulseFrequency, clockFrequency), clockFrequency)) {
+                return;
+            }
+
+            // init, with the oscillator still asleep, turn on register auto-increment first so the
+            // device can write runs of consecutive registers (like the ALL_LED block, or a
+            // channel's ON/OFF pair) as a single block, then everything off
+            device
+                ->begin ()
+                ->write (MODE1, ALLCALL | AUTO_INCREMENT | SLEEP)
+                ->end ();
+            device->enableAutoIncrement ();
+            setChannelOff (CHANNEL_ALL);
             device
                 ->begin ()
                 ->write (MODE2, OUTDRV)
-                ->write (MODE1, ALLCALL)
+                ->write (MODE1, ALLCALL | AUTO_INCREMENT)
                 ->end ();
 
             // the chip takes 500 microseconds to recover from changes to the control registers
@@ -71,9 +148,85 @@ class PCA9685 : public ReferenceCountedObject {
 
             Log::info () << "PCA9685: " << "ready to talk" << endl;
 
-            // setup
-            setPulseFrequency (requestedPulseFrequency);
+            // setup, with the pre-scale if it was computed ahead of time
+            if (preScale > 0) {
+                setPreScale (preScale, clockFrequency);
+            } else {
+                setPulseFrequency (requestedPulseFrequency, clockFrequency);
+            }
+        }
+
+        // read the register file of a chip that may already be running (e.g. when a control process
+        // restarts), and if its configuration is what init would have set, take its channels as
+        // they are instead of resetting them - no glitch on the outputs, and no sleeps. returns
+        // false if the chip needs the full init.
+        bool adopt (byte expectedPreScale, double clockFrequency) {
+            byte registers[REGISTER_FILE_COUNT];
+            byte preScale;
+            device
+                ->begin ()
+                ->readBlock (MODE1, registers, REGISTER_FILE_COUNT)
+                ->read (PRE_SCALE, &preScale)
+                ->end ();
+
+            // the mode has to be awake and auto-incrementing (without auto-increment, the block
+            // read would have returned MODE1 over and over), the sub-address bits don't matter
+            byte mode1 = registers[MODE1] & ~(RESTART | SUB1 | SUB2 | SUB3);
+            if ((mode1 != (ALLCALL | AUTO_INCREMENT)) or ((registers[MODE2] & ~OCH) != OUTDRV) or (preScale != expectedPreScale)) {
+                Log::info () << "PCA9685: " << "can't attach (mode1 " << hex (registers[MODE1]) << ", mode2 " << hex (registers[MODE2]) << ", pre-scale " << hex (preScale) << ")" << endl;
+                return false;
+            }
+
+            // the chip's registers are the image
+            for (uint i = 0; i < REGISTER_FILE_COUNT; ++i) {
+                registerImage[i] = registers[i];
+                registerKnown[i] = true;
+            }
+            registerImage[PRE_SCALE] = preScale;
+            registerKnown[PRE_SCALE] = true;
+            outputChange = (registers[MODE2] & OCH) ? PCA9685OutputChange::ACK : PCA9685OutputChange::STOP;
+            attached = true;
+            device->enableAutoIncrement ();
 
+            const double CHANNEL_RESOLUTION = 4096.0;   // 12-bit precision
+            pulseFrequency = clockFrequency / (CHANNEL_RESOLUTION * (preScale + 1));
+            Log::info () << "PCA9685: " << "attached, pre-scale (" << hex (preScale) << "), " << "actual @" << pulseFrequency << "Hz" << endl;
+            return true;
+        }
+
+        // set the pre-scale directly, and compute the *actual* pulse frequency from it
+        void setPreScale (byte preScale, double clockFrequency) {
+            const double CHANNEL_RESOLUTION = 4096.0;   // 12-bit precision
+            pulseFrequency = clockFrequency / (CHANNEL_RESOLUTION * (preScale + 1));
+            Log::info () << "PCA9685: " << "pre-scale (" << hex (preScale) << "), " << "actual @" << pulseFrequency << "Hz" << endl;
+
+            // PRE_SCALE can only be set when the SLEEP bit of the MODE1 register is set to logic 1.
+            byte oldMode = 0x00;
+            device
+                ->begin ()
+                ->read (MODE1, &oldMode)
+                ->write (MODE1, (oldMode & 0x7f) | SLEEP)
+                ->write (PRE_SCALE, preScale)
+                ->write (MODE1, oldMode)
+                ->flush ();
+
+            // SLEEP bit must be 0 for at least 500us before 1 is written into the RESTART bit.
+            Pause::micro (500);
+
+            // restart
+            device
+                ->write (MODE1, oldMode | RESTART)
+                ->end ();
+        }
+
+        // constructors for drivers with a compile-time timing (see PCA9685Timing.h), a pre-scale
+        // of 0 means it is computed from the requested pulse frequency at run time
+        PCA9685 (uint address, uint requestedPulseFrequency, int bus, byte preScale, double clockFrequency, bool attach = false) : device (new DeviceType (address, bus)){
+            init (requestedPulseFrequency, preScale, clockFrequency, attach);
+        }
+
+        PCA9685 (PtrTo<DeviceType> _device, uint requestedPulseFrequency, byte preScale, double clockFrequency, bool attach = false) : device (_device){
+            init (requestedPulseFrequency, preScale, clockFrequency, attach);
         }
 
         // set a channel's pulse parameters - this applies per tick of the clock (set by the
@@ -86,7 +239,18 @@ class PCA9685 : public ReferenceCountedObject {
         //                  the output off for the whole
         void setChannelPulse (byte channel, u2 on, u2 off) {
             // (https://cdn-shop.adafruit.com/datasheets/PCA9685.pdf - Section 7.3.3)
-            Log::debug () << "PCA9685: " << "setChannelPulse - CHANNEL(" << hex(channel) << ") ON(" << hex (on) << ") OFF(" << hex (off) << ")" << endl;
+            Log::debug () << "PCA9685: " << "setChannelPulse - CHANNEL(" << hex(channel) << ") ON(" << hex (on) << ") OFF(" << hex (off) << ")" << (framing ? " (staged)" : "") << endl;
+
+            // in a frame, the change is only staged (the "all" channel is staged as every channel)
+            if (framing) {
+                for (byte i = 0; i < CHANNEL_COUNT; ++i) {
+                    if ((channel == CHANNEL_ALL) or (channel == i)) {
+                        stageChannel (i, on, off);
+                    }
+                }
+                return;
+            }
+
             auto channelOffset = channel * CHANNEL_OFFSET_MULTIPLIER;
             device
                 ->begin ()
@@ -95,24 +259,169 @@ class PCA9685 : public ReferenceCountedObject {
                 ->write (CHANNEL_BASE_OFF + channelOffset, off & 0x00ff)
                 ->write (CHANNEL_BASE_OFF + channelOffset + 1, (off >> 8) & 0x00ff)
                 ->end ();
+
+            // the "all" channel changes every channel on the device, so whatever the device knew
+            // about their registers is no longer true
+            if (channel == CHANNEL_ALL) {
+                device->invalidate (CHANNEL_BASE_ON, CHANNEL_BASE_ON + (CHANNEL_COUNT * CHANNEL_OFFSET_MULTIPLIER) - 1);
+                for (byte i = 0; i < CHANNEL_COUNT; ++i) {
+                    setChannelImage (i, on, off);
+                }
+            } else if (channel < CHANNEL_COUNT) {
+                setChannelImage (channel, on, off);
+            }
         }
 
-        // set a channel's pulse parameters - this applies per tick of the clock (set by the
-        // pulse frequency).
-        // @param channel - which channel of the PCM will be updated
-        // @param width   - proportion of the pulse to be on, 0..4_095 (for 0..1)
-        void setChannelPulse (byte channel, uint width) {
+        // record a channel's registers as written
+        void setChannelImage (byte channel, u2 on, u2 off) {
+            byte at = CHANNEL_BASE_ON + (channel * CHANNEL_OFFSET_MULTIPLIER);
+            byte values[] = { byte (on & 0x00ff), byte ((on >> 8) & 0x00ff), byte (off & 0x00ff), byte ((off >> 8) & 0x00ff) };
+            for (byte i = 0; i < CHANNEL_OFFSET_MULTIPLIER; ++i) {
+                registerImage[at + i] = values[i];
+                registerKnown[at + i] = true;
+            }
+        }
+
+        // stage a register for the next send, unless we know it already has the value
+        void stageRegister (byte at, byte value) {
+            if (not (registerKnown[at] and (registerImage[at] == value))) {
+                registerImage[at] = value;
+                registerKnown[at] = true;
+                registerDirty[at] = true;
+            }
+        }
+
+        void stageChannel (byte channel, u2 on, u2 off) {
+            byte at = CHANNEL_BASE_ON + (channel * CHANNEL_OFFSET_MULTIPLIER);
+            stageRegister (at, on & 0x00ff);
+            stageRegister (at + 1, (on >> 8) & 0x00ff);
+            stageRegister (at + 2, off & 0x00ff);
+            stageRegister (at + 3, (off >> 8) & 0x00ff);
+        }
+
+        // send the staged registers in one cycle on the device, in ascending order. a gap between
+        // two staged registers is filled in with the values we know, so the staged registers and
+        // the gaps go to the chip as a single auto-increment run - a register we know nothing about
+        // splits the run instead. the runs go out as one combined transfer, so with the outputs
+        // changing on STOP, everything sent takes effect at once. returns the number of registers
+        // sent.
+        uint sendStaged () {
+            checkNoShadow ();
+            uint sent = 0;
+            int previous = -1;
+            for (uint at = 0; at < REGISTER_COUNT; ++at) {
+                if (registerDirty[at]) {
+                    if (previous < 0) {
+                        device->begin ();
+                    } else {
+                        bool bridge = true;
+                        for (uint gap = previous + 1; bridge and (gap < at); ++gap) {
+                            bridge = registerKnown[gap];
+                        }
+                        for (uint gap = previous + 1; bridge and (gap < at); ++gap) {
+                            device->write (gap, registerImage[gap]);
+                            ++sent;
+                        }
+                    }
+                    device->write (at, registerImage[at]);
+                    registerDirty[at] = false;
+                    previous = at;
+                    ++sent;
+                }
+            }
+            if (previous >= 0) {
+                try {
+                    device->flushCombined ();
+                } catch (RuntimeError& runtimeError) {
+                    // we don't know how much of it made it to the chip, so the image can't be trusted
+                    device->end ();
+                    invalidateImage ();
+                    throw;
+                }
+                device->end ();
+            }
+            return sent;
+        }
+
+        // set many channels' pulse parameters in one cycle on the device (or stage them, in a
+        // frame). only the registers that change are sent, along with the known registers between
+        // them, so a span of channels goes to the chip as a single run.
+        // @param pulses - the channels to update, in any order (a later entry for the same channel
+        //                 wins), the "all" channel isn't allowed here
+        // @param count  - the number of entries in pulses
+        void setChannelPulses (const ChannelPulse* pulses, uint count) {
+            for (uint i = 0; i < count; ++i) {
+                if (pulses[i].channel >= CHANNEL_COUNT) {
+                    throw RuntimeError (Text ("PCA9685: ") << "invalid channel for setChannelPulses (" << hex (pulses[i].channel) << ")");
+                }
+            }
+            for (uint i = 0; i < count; ++i) {
+                stageChannel (pulses[i].channel, pulses[i].on, pulses[i].off);
+            }
+            Log::debug () << "PCA9685: " << "setChannelPulses - " << count << " pulse" << ((count != 1) ? "s" : "") << (framing ? " (staged)" : "") << endl;
+            if (not framing) {
+                sendStaged ();
+            }
+        }
+
+        // the four register bytes of a channel's pulse (ON_L, ON_H, OFF_L, OFF_H), for drivers
+        // that compute their updates ahead of time
+        static void getChannelRegisters (const ChannelPulse& pulse, byte* registers) {
+            registers[0] = pulse.on & 0x00ff;
+            registers[1] = (pulse.on >> 8) & 0x00ff;
+            registers[2] = pulse.off & 0x00ff;
+            registers[3] = (pulse.off >> 8) & 0x00ff;
+        }
+
+        // set runs of contiguous channels from register bytes computed ahead of time (four per
+        // channel, see getChannelRegisters, with the runs back to back), in one cycle on the
+        // device (or stage them, in a frame). the bytes are only compared against the register
+        // image, so the channels must have been checked when the bytes were computed.
+        // @param runChannels - the first channel of each run
+        // @param runLengths  - the number of channels in each run
+        // @param runCount    - the number of runs
+        // @param registers   - the register bytes for all the runs
+        void setChannelRegisters (const byte* runChannels, const byte* runLengths, uint runCount, const byte* registers) {
+            for (uint run = 0; run < runCount; ++run) {
+                byte at = CHANNEL_BASE_ON + (runChannels[run] * CHANNEL_OFFSET_MULTIPLIER);
+                for (uint i = 0, end = runLengths[run] * CHANNEL_OFFSET_MULTIPLIER; i < end; ++i) {
+                    stageRegister (at + i, *registers++);
+                }
+            }
+            if (not framing) {
+                sendStaged ();
+            }
+        }
+
+        // the pulse parameters for a width out of 4095, with the full on and full off cases
+        static ChannelPulse getChannelPulse (byte channel, uint width) {
+            ChannelPulse pulse;
+            pulse.channel = channel;
             switch (width) {
                 case 0:
-                    setChannelPulse (channel, 0, CHANNEL_FORCE);
+                    pulse.on = 0; pulse.off = CHANNEL_FORCE;
                     break;
                 case CHANNEL_HIGH:
-                    setChannelPulse (channel, CHANNEL_FORCE, 0);
+                    pulse.on = CHANNEL_FORCE; pulse.off = 0;
                     break;
                 default:
-                    setChannelPulse (channel, 0, width);
+                    pulse.on = 0; pulse.off = width;
                     break;
             }
+            return pulse;
+        }
+
+        uint getChannelWidth (double milliseconds) {
+            return (uint) round ((CHANNEL_HIGH * milliseconds * pulseFrequency) / 1.0e3);
+        }
+
+        // set a channel's pulse parameters - this applies per tick of the clock (set by the
+        // pulse frequency).
+        // @param channel - which channel of the PCM will be updated
+        // @param width   - proportion of the pulse to be on, 0..4_095 (for 0..1)
+        void setChannelPulse (byte channel, uint width) {
+            ChannelPulse pulse = getChannelPulse (channel, width);
+            setChannelPulse (channel, pulse.on, pulse.off);
         }
 
         void setChannelOn (byte channel) {
@@ -124,18 +433,125 @@ class PCA9685 : public ReferenceCountedObject {
         }
 
         void setChannelPulseMs (byte channel, double milliseconds) {
-            uint width = (uint) round ((CHANNEL_HIGH * milliseconds * pulseFrequency) / 1.0e3);
-            setChannelPulse (channel, width);
+            setChannelPulse (channel, getChannelWidth (milliseconds));
+        }
+
+        // the width of a channel's pulse (0..4_095) according to the register image, for drivers
+        // that recover their state from an attached chip
+        uint getChannelImageWidth (byte channel) {
+            byte at = CHANNEL_BASE_ON + (channel * CHANNEL_OFFSET_MULTIPLIER);
+            u2 on = registerImage[at] | (registerImage[at + 1] << 8);
+            u2 off = registerImage[at + 2] | (registerImage[at + 3] << 8);
+            return (off & CHANNEL_FORCE) ? 0 : ((on & CHANNEL_FORCE) ? uint (CHANNEL_HIGH) : uint ((off - on) & CHANNEL_HIGH));
         }
 
     public:
 
-        PCA9685 (uint address, uint requestedPulseFrequency = PCA9685_DEFAULT_PULSE_FREQUENCY, int bus = -1) : device (new DeviceType (address, bus)){
-            init (requestedPulseFrequency);
+        // with attach, a chip that is already configured for the requested pulse frequency keeps
+        // running as it is, and its channels are adopted instead of being turned off
+        PCA9685 (uint address, uint requestedPulseFrequency = PCA9685_DEFAULT_PULSE_FREQUENCY, int bus = -1, bool attach = false) : device (new DeviceType (address, bus)){
+            init (requestedPulseFrequency, 0, PCA9685_CLOCK_FREQUENCY, attach);
+        }
+
+        PCA9685 (PtrTo<DeviceType> _device, uint requestedPulseFrequency = PCA9685_DEFAULT_PULSE_FREQUENCY, bool attach = false) : device (_device){
+            init (requestedPulseFrequency, 0, PCA9685_CLOCK_FREQUENCY, attach);
+        }
+
+        // start staging channel changes instead of sending them - everything set through the
+        // drivers (runMotor, setPulseDuration, etc.) until the commit is held in an image of the
+        // chip's registers, and only the registers that changed are sent
+        PCA9685<DeviceType>* beginFrame () {
+            framing = true;
+            return this;
+        }
+
+        // send everything staged since beginFrame as a single run of registers (or as few runs as
+        // the known registers allow), so all the changes take effect together at the STOP
+        PCA9685<DeviceType>* commit () {
+            framing = false;
+            uint sent = sendStaged ();
+            Log::debug () << "PCA9685: " << "commit " << sent << " register" << ((sent != 1) ? "s" : "") << endl;
+            return this;
+        }
+
+        bool isFraming () {
+            return framing;
+        }
+
+        // forget the register image, the next update to each register is sent even if it doesn't
+        // change anything. use this if the chip might have been changed behind our back (a reset,
+        // another process, etc.)
+        PCA9685<DeviceType>* invalidateImage () {
+            for (uint i = 0; i < REGISTER_COUNT; ++i) {
+                registerKnown[i] = false;
+            }
+            device->invalidate ();
+            return this;
+        }
+
+        // program one of the three sub-addresses (1..3) and have the board answer at it, so a
+        // group of boards can be written to with a single transfer. the address is the 7-bit
+        // address, like the board's own.
+        PCA9685<DeviceType>* setSubAddress (byte subAddress, uint address) {
+            if ((subAddress < 1) or (subAddress > 3)) {
+                throw RuntimeError (Text ("PCA9685: ") << "invalid sub-address (" << uint (subAddress) << ")");
+            }
+            device->begin ();
+            byte mode = device->read (MODE1);
+            device
+                ->write (SUBADR1 + subAddress - 1, byte (address << 1))
+                ->write (MODE1, (mode & ~RESTART) | (SUB1 >> (subAddress - 1)))
+                ->end ();
+            Log::debug () << "PCA9685: " << "sub-address " << uint (subAddress) << " (" << hex (address) << ")" << endl;
+            return this;
+        }
+
+        // stop answering at one of the sub-addresses
+        PCA9685<DeviceType>* clearSubAddress (byte subAddress) {
+            if ((subAddress < 1) or (subAddress > 3)) {
+                throw RuntimeError (Text ("PCA9685: ") << "invalid sub-address (" << uint (subAddress) << ")");
+            }
+            device->begin ();
+            byte mode = device->read (MODE1);
+            device
+                ->write (MODE1, mode & ~(RESTART | (SUB1 >> (subAddress - 1))))
+                ->end ();
+            return this;
+        }
+
+        double getPulseFrequency () {
+            return pulseFrequency;
+        }
+
+        // set when the outputs take on new channel values. with STOP, a frame commit (or any single
+        // update) takes effect all at once, so updates can go back to back without glitching a
+        // channel part way through its registers.
+        PCA9685<DeviceType>* setOutputChange (PCA9685OutputChange _outputChange) {
+            byte mode2 = OUTDRV | ((_outputChange == PCA9685OutputChange::ACK) ? OCH : 0);
+            device
+                ->begin ()
+                ->write (MODE2, mode2)
+                ->end ();
+            registerImage[MODE2] = mode2;
+            registerKnown[MODE2] = true;
+            outputChange = _outputChange;
+            return this;
+        }
+
+        PCA9685OutputChange getOutputChange () {
+            return outputChange;
+        }
+
+        // true if the chip was already running and its state was adopted, rather than reset
+        bool isAttached () {
+            return attached;
         }
 
-        PCA9685 (PtrTo<DeviceType> _device, uint requestedPulseFrequency = PCA9685_DEFAULT_PULSE_FREQUENCY) : device (_device){
-            init (requestedPulseFrequency);
+        // tag all the traffic to the controller with a priority class, motor drivers whose updates
+        // can't be late (like steppers) should be REALTIME
+        PCA9685<DeviceType>* setPriority (BusPriority priority) {
+            device->setPriority (priority);
+            return this;
         }
 
          // Set the frequency of pulses across the whole controller - each channel has 12-bits
@@ -144,35 +560,21 @@ class PCA9685 : public ReferenceCountedObject {
          //                                value in Hertz (Hz). The code tries to accommodate the request
          //                                as best as it can, to be *at least* as frequent as requested.
         void setPulseFrequency (uint requestedPulseFrequency, double clockFrequency = PCA9685_CLOCK_FREQUENCY) {
+            byte preScale = computePreScale (requestedPulseFrequency, clockFrequency);
+            Log::info () << "PCA9685: " << "requested @" << requestedPulseFrequency << " Hz" << endl;
+
+            // compute the *actual* pulse frequency by inverting the equation, and set it
+            setPreScale (preScale, clockFrequency);
+        }
+
+        // the pre-scale for a requested pulse frequency
+        static byte computePreScale (uint requestedPulseFrequency, double clockFrequency = PCA9685_CLOCK_FREQUENCY) {
             // (https://cdn-shop.adafruit.com/datasheets/PCA9685.pdf - Section 7.3.5)
             const double CHANNEL_RESOLUTION = 4096.0;   // 12-bit precision
             byte preScale = byte (round (clockFrequency / (CHANNEL_RESOLUTION * requestedPulseFrequency))) - 1;
             Log::debug () << "PCA9685: " << "pre-scale (" << hex (preScale) << ")" << endl;
             const byte MIN_PRE_SCALE = 0x03, MAX_PRE_SCALE = 0xFF;
-            preScale = min (max (MIN_PRE_SCALE, preScale), MAX_PRE_SCALE);
-            Log::info () << "PCA9685: " << "requested @" << requestedPulseFrequency << " Hz";
-
-            // compute the *actual* pulse frequency by inverting the equation
-            pulseFrequency = clockFrequency / (CHANNEL_RESOLUTION * (preScale + 1));
-            Log::info () << ", " << "actual @" << pulseFrequency << "Hz" << endl;
-
-            // PRE_SCALE can only be set when the SLEEP bit of the MODE1 register is set to logic 1.
-            byte oldMode = 0x00;
-            device
-                ->begin ()
-                ->read (MODE1, &oldMode)
-                ->write (MODE1, (oldMode & 0x7f) | SLEEP)
-                ->write (PRE_SCALE, preScale)
-                ->write (MODE1, oldMode)
-                ->flush ();
-
-            // SLEEP bit must be 0 for at least 500us before 1 is written into the RESTART bit.
-            Pause::micro (500);
-
-            // restart
-            device
-                ->write (MODE1, oldMode | RESTART)
-                ->end ();
+            return min (max (MIN_PRE_SCALE, preScale), MAX_PRE_SCALE);
         }
 };
 
@@ -0,0 +1,125 @@
+#pragma once
+
+#include "PCA9685.h"
+
+// one board to bring up
+struct PCA9685Config {
+    uint address;
+    int bus;
+    uint requestedPulseFrequency;
+
+    PCA9685Config (uint _address, int _bus = -1, uint _requestedPulseFrequency = PCA9685_DEFAULT_PULSE_FREQUENCY) : address (_address), bus (_bus), requestedPulseFrequency (_requestedPulseFrequency) {}
+};
+
+// Bring up a set of PCA9685 boards together. Constructing the boards one at a time spends most of
+// the time in the 500us waits the chip needs after its control registers change, once for each
+// board. Here every board on a bus gets its writes before the wait, so the boards share one wait,
+// and each bus runs on its own thread, so startup takes about as long as a single board does.
+// The boards are left in the state PCA9685::init would leave them in (all channels off), so the
+// drivers are then constructed with attach, which adopts that state with a couple of reads:
+//
+//     vector<PCA9685Config> configs;
+//     configs.push_back (PCA9685Config (0x40, 1, 50));
+//     configs.push_back (PCA9685Config (0x60, 1));
+//     PCA9685BringUp<DeviceI2C>::bringUp (configs);
+//     PtrTo<AdafruitServoDriver<DeviceI2C> > servos = new AdafruitServoDriver<DeviceI2C> (0x40, 50, 1, true);
+template<typename DeviceType>
+class PCA9685BringUp {
+    protected:
+        typedef PCA9685<DeviceType> Board;
+
+        // the boards on one bus, and how their bring-up went
+        struct BusBringUp {
+            vector<PCA9685Config> configs;
+            double clockFrequency;
+            bool success;
+        };
+
+        static void* run (void* context) {
+            BusBringUp* busBringUp = static_cast<BusBringUp*> (context);
+            try {
+                bringUpBus (busBringUp->configs, busBringUp->clockFrequency);
+                busBringUp->success = true;
+            } catch (RuntimeError& runtimeError) {
+                Log::exception (runtimeError);
+                busBringUp->success = false;
+            }
+            return 0;
+        }
+
+        static void bringUpBus (const vector<PCA9685Config>& configs, double clockFrequency) {
+            vector<PtrTo<DeviceType> > devices;
+            for (typename vector<PCA9685Config>::const_iterator iter = configs.begin (); iter != configs.end (); ++iter) {
+                devices.push_back (new DeviceType (iter->address, iter->bus));
+            }
+
+            // everything that can be written before the wait - with the oscillator asleep, turn
+            // on auto-increment, turn all the channels off, set the pre-scale (which can only be
+            // written while the oscillator is asleep), and wake the oscillator up
+            for (uint i = 0; i < devices.size (); ++i) {
+                byte preScale = Board::computePreScale (configs[i].requestedPulseFrequency, clockFrequency);
+                devices[i]
+                    ->begin ()
+                    ->write (Board::MODE1, Board::ALLCALL | Board::AUTO_INCREMENT | Board::SLEEP)
+                    ->write (Board::CHANNEL_BASE_ON + (Board::CHANNEL_ALL * Board::CHANNEL_OFFSET_MULTIPLIER), 0x00)
+                    ->write (Board::CHANNEL_BASE_ON + (Board::CHANNEL_ALL * Board::CHANNEL_OFFSET_MULTIPLIER) + 1, 0x00)
+                    ->write (Board::CHANNEL_BASE_OFF + (Board::CHANNEL_ALL * Board::CHANNEL_OFFSET_MULTIPLIER), 0x00)
+                    ->write (Board::CHANNEL_BASE_OFF + (Board::CHANNEL_ALL * Board::CHANNEL_OFFSET_MULTIPLIER) + 1, (Board::CHANNEL_FORCE >> 8) & 0x00ff)
+                    ->write (Board::MODE2, Board::OUTDRV)
+                    ->write (Board::PRE_SCALE, preScale)
+                    ->write (Board::MODE1, Board::ALLCALL | Board::AUTO_INCREMENT)
+                    ->end ();
+            }
+
+            // one wait for all of them, the SLEEP bit must be 0 for at least 500us before 1 is
+            // written into the RESTART bit
+            Pause::micro (500);
+
+            // restart
+            for (uint i = 0; i < devices.size (); ++i) {
+                devices[i]
+                    ->begin ()
+                    ->write (Board::MODE1, Board::ALLCALL | Board::AUTO_INCREMENT | Board::RESTART)
+                    ->end ();
+            }
+            Log::info () << "PCA9685BringUp: " << devices.size () << " board" << ((devices.size () != 1) ? "s" : "") << " ready" << endl;
+        }
+
+    public:
+        // bring up all the boards, the boards on each bus in a thread of their own. throws if any
+        // of the boards failed, after all the buses have finished
+        static void bringUp (const vector<PCA9685Config>& configs, double clockFrequency = PCA9685_CLOCK_FREQUENCY) {
+            map<int, BusBringUp> busBringUps;
+            for (vector<PCA9685Config>::const_iterator iter = configs.begin (); iter != configs.end (); ++iter) {
+                BusBringUp& busBringUp = busBringUps[iter->bus];
+                busBringUp.configs.push_back (*iter);
+                busBringUp.clockFrequency = clockFrequency;
+                busBringUp.success = false;
+            }
+
+            // a single bus doesn't need a thread of its own
+            if (busBringUps.size () == 1) {
+                bringUpBus (configs, clockFrequency);
+                return;
+            }
+
+            vector<pthread_t> threads;
+            for (typename map<int, BusBringUp>::iterator iter = busBringUps.begin (); iter != busBringUps.end (); ++iter) {
+                pthread_t thread;
+                if (pthread_create (&thread, 0, run, &iter->second) == 0) {
+                    threads.push_back (thread);
+                } else {
+                    Log::error () << "PCA9685BringUp: " << "can't create thread for bus " << iter->first << endl;
+                }
+            }
+            for (vector<pthread_t>::iterator iter = threads.begin (); iter != threads.end (); ++iter) {
+                pthread_join (*iter, 0);
+            }
+
+            for (typename map<int, BusBringUp>::iterator iter = busBringUps.begin (); iter != busBringUps.end (); ++iter) {
+                if (not iter->second.success) {
+                    throw RuntimeError (Text ("PCA9685BringUp: ") << "bus " << iter->first << " failed");
+                }
+            }
+        }
+};
@@ -0,0 +1,134 @@
+#pragma once
+
+#include "PCA9685.h"
+
+// every PCA9685 answers at the all-call address (ALLCALLADR 0xe0, as a 7-bit address) unless its
+// ALLCALL bit is cleared, and the power-on value of SUBADR1 (0xe2) makes a natural group address
+const uint PCA9685_ALLCALL_ADDRESS = 0x70;
+const uint PCA9685_DEFAULT_GROUP_ADDRESS = 0x71;
+
+// A group of PCA9685 boards on the same bus that share a sub-address, so writing channel values to
+// the group address sets them on every board in the group with a single transfer - a common pose on
+// a chain of servo boards, or all the outputs off, costs one transaction instead of one per board.
+// The group can only be written to, reading from several boards at once doesn't mean anything.
+template<typename DeviceType>
+class PCA9685Group : public ReferenceCountedObject {
+    protected:
+        typedef PCA9685<DeviceType> Board;
+
+        PtrTo<DeviceType> device;
+        uint groupAddress;
+        byte subAddress;
+        vector<PtrTo<Board> > boards;
+
+        // what each board knew about its channel registers isn't true after a group write
+        void invalidateBoards () {
+            for (typename vector<PtrTo<Board> >::iterator iter = boards.begin (); iter != boards.end (); ++iter) {
+                (*iter)->invalidateImage ();
+            }
+        }
+
+        void writeChannel (byte channel, u2 on, u2 off) {
+            byte at = Board::CHANNEL_BASE_ON + (channel * Board::CHANNEL_OFFSET_MULTIPLIER);
+            device
+                ->write (at, on & 0x00ff)
+                ->write (at + 1, (on >> 8) & 0x00ff)
+                ->write (at + 2, off & 0x00ff)
+                ->write (at + 3, (off >> 8) & 0x00ff);
+        }
+
+    public:
+        // @param groupAddress - the 7-bit address the boards in the group will answer at
+        // @param subAddress   - which of the three sub-address registers (1..3) the group uses
+        // (the boards are all set up to auto-increment, so a channel goes to the group as one block)
+        PCA9685Group (uint _groupAddress = PCA9685_DEFAULT_GROUP_ADDRESS, byte _subAddress = 1, int bus = -1) : device (new DeviceType (_groupAddress, bus)), groupAddress (_groupAddress), subAddress (_subAddress) {
+            device->enableAutoIncrement ();
+        }
+
+        PCA9685Group (PtrTo<DeviceType> _device, uint _groupAddress = PCA9685_DEFAULT_GROUP_ADDRESS, byte _subAddress = 1) : device (_device), groupAddress (_groupAddress), subAddress (_subAddress) {
+            device->enableAutoIncrement ();
+        }
+
+        // add a board to the group, by programming the group address into its sub-address register
+        PCA9685Group<DeviceType>* add (PtrTo<Board> board) {
+            board->setSubAddress (subAddress, groupAddress);
+            boards.push_back (board);
+            return this;
+        }
+
+        uint getGroupAddress () {
+            return groupAddress;
+        }
+
+        uint getBoardCount () {
+            return boards.size ();
+        }
+
+        // set a channel's pulse parameters on every board, "all" (Board::CHANNEL_ALL) is allowed
+        PCA9685Group<DeviceType>* setChannelPulse (byte channel, u2 on, u2 off) {
+            Log::debug () << "PCA9685Group: " << "setChannelPulse - CHANNEL(" << hex(channel) << ") ON(" << hex (on) << ") OFF(" << hex (off) << ") @" << hex (groupAddress) << endl;
+            device->begin ();
+            writeChannel (channel, on, off);
+            device->end ();
+            invalidateBoards ();
+            return this;
+        }
+
+        PCA9685Group<DeviceType>* setChannelPulse (byte channel, uint width) {
+            ChannelPulse pulse = Board::getChannelPulse (channel, width);
+            return setChannelPulse (channel, pulse.on, pulse.off);
+        }
+
+        // the pulse frequency is taken from the first board, the boards in a group should all be
+        // running at the same frequency
+        PCA9685Group<DeviceType>* setChannelPulseMs (byte channel, double milliseconds) {
+            if (boards.size () == 0) {
+                throw RuntimeError (Text ("PCA9685Group: ") << "no boards to get the pulse frequency from");
+            }
+            return setChannelPulse (channel, uint (round ((Board::CHANNEL_HIGH * milliseconds * boards[0]->getPulseFrequency ()) / 1.0e3)));
+        }
+
+        // set many channels on every board in one transfer, the registers are written in
+        // ascending order so adjacent channels go as a single run
+        PCA9685Group<DeviceType>* setChannelPulses (const ChannelPulse* pulses, uint count) {
+            const ChannelPulse* ordered[Board::CHANNEL_COUNT] = {};
+            for (uint i = 0; i < count; ++i) {
+                if (pulses[i].channel >= Board::CHANNEL_COUNT) {
+                    throw RuntimeError (Text ("PCA9685Group: ") << "invalid channel for setChannelPulses (" << hex (pulses[i].channel) << ")");
+                }
+                ordered[pulses[i].channel] = &pulses[i];
+            }
+            device->begin ();
+            for (uint channel = 0; channel < Board::CHANNEL_COUNT; ++channel) {
+                if (ordered[channel]) {
+                    writeChannel (channel, ordered[channel]->on, ordered[channel]->off);
+                }
+            }
+            device->end ();
+            invalidateBoards ();
+            return this;
+        }
+
+        // turn every output on every board in the group off
+        PCA9685Group<DeviceType>* allOff () {
+            return setChannelPulse (Board::CHANNEL_ALL, 0, Board::CHANNEL_FORCE);
+        }
+
+        // turn every output off on every PCA9685 on the bus that answers the all-call address
+        // (they all do unless told not to), in one transfer - whatever the boards' objects know
+        // about their channels is wrong afterwards, so call invalidateImage on them. the boards
+        // answering might not have auto-increment on, so this is the one byte that does it, the
+        // full off bit in ALL_LED_OFF_H (which wins over full on)
+        static void emergencyAllOff (PtrTo<DeviceType> allCallDevice) {
+            byte at = Board::CHANNEL_BASE_OFF + (Board::CHANNEL_ALL * Board::CHANNEL_OFFSET_MULTIPLIER) + 1;
+            allCallDevice
+                ->begin ()
+                ->write (at, Board::CHANNEL_FORCE >> 8)
+                ->end ();
+            Log::info () << "PCA9685Group: " << "emergency all off" << endl;
+        }
+
+        static void emergencyAllOff (int bus = -1) {
+            emergencyAllOff (new DeviceType (PCA9685_ALLCALL_ADDRESS, bus));
+        }
+};
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "PCA9685.h"
+#include "MotorId.h"
+
+// Compile-time configuration for the PCA9685 drivers. The drivers take these as optional template
+// parameters - the defaults keep everything configured at run time, while a PCA9685Timing fixes the
+// oscillator and pulse frequencies when the code is built, so the pre-scale and the conversion from
+// pulse durations to ticks are constants, and the conversion is integer math.
+
+// the internal oscillator, as a constant usable at compile time
+const uint PCA9685_OSCILLATOR_FREQUENCY = 25000000;
+
+// everything computed at run time (the default)
+struct PCA9685RuntimeTiming {
+    static constexpr bool isStatic () { return false; }
+
+    // a pre-scale of 0 tells the PCA9685 to compute it from the requested pulse frequency
+    static constexpr byte getPreScale () { return 0; }
+
+    static constexpr double getOscillatorFrequency () { return PCA9685_OSCILLATOR_FREQUENCY; }
+
+    static constexpr u2 getWidth (uint) { return 0; }
+
+    // any pulse frequency can be requested at run time
+    static uint checkRequestedPulseFrequency (uint requestedPulseFrequency) { return requestedPulseFrequency; }
+};
+
+template<uint oscillatorFrequency = PCA9685_OSCILLATOR_FREQUENCY, uint requestedPulseFrequency = PCA9685_DEFAULT_PULSE_FREQUENCY>
+struct PCA9685Timing {
+    static constexpr bool isStatic () { return true; }
+
+    static constexpr double getOscillatorFrequency () { return oscillatorFrequency; }
+
+    static constexpr uint getRequestedPulseFrequency () { return requestedPulseFrequency; }
+
+    // the pre-scale is fixed, so a driver asked for any other pulse frequency is refused rather
+    // than quietly running at this one
+    static uint checkRequestedPulseFrequency (uint requested) {
+        if (requested != requestedPulseFrequency) {
+            throw RuntimeError (Text ("PCA9685Timing: ") << "requested pulse frequency (" << requested << " Hz) doesn't match the compile-time timing (" << requestedPulseFrequency << " Hz)");
+        }
+        return requested;
+    }
+
+    // the same computation as PCA9685::setPulseFrequency (datasheet section 7.3.5), rounded to the
+    // nearest, and limited to the smallest pre-scale the chip allows
+    static constexpr byte getPreScale () {
+        return max (byte (uint ((double (oscillatorFrequency) / (4096.0 * requestedPulseFrequency)) + 0.5) - 1), byte (0x03));
+    }
+
+    // the actual pulse frequency the pre-scale gives
+    static constexpr double getPulseFrequency () {
+        return oscillatorFrequency / (4096.0 * (getPreScale () + 1));
+    }
+
+    // the number of ticks (out of 4095) in a microsecond of pulse, as a 32.32 fixed point number
+    static constexpr uint64_t getTicksPerMicrosecond () {
+        return uint64_t (((4095.0 * getPulseFrequency ()) / 1.0e6) * 4294967296.0);
+    }
+
+    // the pulse width for a duration, rounded to the nearest tick, in integer math
+    static constexpr u2 getWidth (uint microseconds) {
+        return u2 (min ((((microseconds * getTicksPerMicrosecond ()) + 0x80000000) >> 32), uint64_t (4095)));
+    }
+};
+
+// the channels of the PCA9685 the Adafruit motor hat uses to drive each motor (the modulator sets
+// the speed, the front and back pins the direction), packed a nibble per motor with MOTOR_0 in
+// the low nibble, so finding them is a shift and a mask
+struct AdafruitMotorHatWiring {
+    static constexpr byte getPin (u2 pins, MotorId motorId) {
+        return (pins >> (static_cast<byte> (motorId) * 4)) & 0x0f;
+    }
+
+    static constexpr byte getModulator (MotorId motorId) { return getPin (0x72d8, motorId); }
+
+    static constexpr byte getFrontPin (MotorId motorId) { return getPin (0x63c9, motorId); }
+
+    static constexpr byte getBackPin (MotorId motorId) { return getPin (0x54ba, motorId); }
+};
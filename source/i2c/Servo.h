@@ -51,4 +51,11 @@ class Servo : public ReferenceCountedObject {
         return servoId;
     }
 
+    /**
+    * @return
+    */
+    DriverType* getDriver () {
+        return driver.getPtr ();
+    }
+
 };
@@ -0,0 +1,330 @@
+#pragma once
+
+#include "Servo.h"
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <pthread.h>
+#include <time.h>
+
+enum class ServoInterpolation : byte {
+    // straight lines between the keyframes
+    LINEAR,
+
+    // a cubic through the keyframes (catmull-rom tangents, at rest on the first and last), so the
+    // velocity is continuous across the keyframes
+    CUBIC
+};
+
+// called when a trajectory ends, with true if it played to the end and false if it was cancelled
+// or a driver failed, on the trajectory's thread
+typedef function<void (bool)> ServoTrajectoryCompletion;
+
+// A trajectory moves a group of servos through timed keyframes. The positions are sent once per
+// PWM period of the servo driver (20ms at 50Hz) - anything faster is overwritten before the servo
+// sees it - on absolute deadlines counted from the start of play, so the updates stay on the same
+// phase of the period however long each one takes. Every update is one frame per driver, so all
+// the servos on a board move in the same period, and only the channels that changed are sent.
+// While a trajectory plays, its servos should not be set from anywhere else.
+//
+//     vector<PtrTo<Servo<Driver> > > legs;
+//     ...
+//     PtrTo<ServoTrajectory<Driver> > step = new ServoTrajectory<Driver> (legs);
+//     step->addKeyframe (0.25, lifted)->addKeyframe (0.5, planted);
+//     step->playFuture ().get ();
+template<typename DriverType>
+class ServoTrajectory : public ReferenceCountedObject {
+    protected:
+        struct Keyframe {
+            double seconds;
+            vector<double> positions;
+        };
+
+        vector<PtrTo<Servo<DriverType> > > servos;
+        vector<DriverType*> drivers;
+        ServoInterpolation interpolation;
+        vector<Keyframe> keyframes;
+        vector<Keyframe> playing;
+        ServoTrajectoryCompletion completion;
+        pthread_t thread;
+        bool started;
+        atomic<bool> active;
+        atomic<bool> cancelled;
+        atomic<uint> emitCount;
+        atomic<uint> missedCount;
+        long periodNanoseconds;
+
+        static void* run (void* context) {
+            static_cast<ServoTrajectory<DriverType>*> (context)->playLoop ();
+            return 0;
+        }
+
+        static void advance (struct timespec& time, long nanoseconds) {
+            time.tv_nsec += nanoseconds;
+            while (time.tv_nsec >= 1000000000) {
+                time.tv_nsec -= 1000000000;
+                ++time.tv_sec;
+            }
+        }
+
+        static long elapsed (const struct timespec& from, const struct timespec& to) {
+            return ((to.tv_sec - from.tv_sec) * 1000000000) + (to.tv_nsec - from.tv_nsec);
+        }
+
+        // the tangent at a keyframe, with the servos at rest on the first and last
+        static double getTangent (const vector<Keyframe>& frames, uint k, uint servo) {
+            if ((k == 0) or (k == (frames.size () - 1))) {
+                return 0;
+            }
+            return (frames[k + 1].positions[servo] - frames[k - 1].positions[servo]) / (frames[k + 1].seconds - frames[k - 1].seconds);
+        }
+
+        static void evaluate (const vector<Keyframe>& frames, ServoInterpolation interpolation, double seconds, vector<double>& positions) {
+            uint count = frames[0].positions.size ();
+            positions.resize (count);
+
+            // find the span holding the time, before the first and after the last the positions hold
+            uint k = 0;
+            while (((k + 1) < frames.size ()) and (frames[k + 1].seconds <= seconds)) {
+                ++k;
+            }
+            if ((seconds <= frames[0].seconds) or ((k + 1) == frames.size ())) {
+                positions = frames[(seconds <= frames[0].seconds) ? 0 : k].positions;
+                return;
+            }
+
+            const Keyframe& a = frames[k];
+            const Keyframe& b = frames[k + 1];
+            double span = b.seconds - a.seconds;
+            double t = (seconds - a.seconds) / span;
+            for (uint i = 0; i < count; ++i) {
+                if (interpolation == ServoInterpolation::LINEAR) {
+                    positions[i] = a.positions[i] + ((b.positions[i] - a.positions[i]) * t);
+                } else {
+                    // cubic hermite basis
+                    double t2 = t * t;
+                    double t3 = t2 * t;
+                    positions[i] =
+                        (((2 * t3) - (3 * t2) + 1) * a.positions[i]) +
+                        ((t3 - (2 * t2) + t) * span * getTangent (frames, k, i)) +
+                        (((-2 * t3) + (3 * t2)) * b.positions[i]) +
+                        ((t3 - t2) * span * getTangent (frames, k + 1, i));
+                }
+            }
+        }
+
+        // one update, a frame on each driver
+        void emit (const vector<double>& positions) {
+            for (typename vector<DriverType*>::iterator iter = drivers.begin (); iter != drivers.end (); ++iter) {
+                (*iter)->beginFrame ();
+            }
+            for (uint i = 0; i < servos.size (); ++i) {
+                servos[i]->setPosition (positions[i]);
+            }
+            for (typename vector<DriverType*>::iterator iter = drivers.begin (); iter != drivers.end (); ++iter) {
+                (*iter)->commit ();
+            }
+            ++emitCount;
+        }
+
+        void playLoop () {
+            bool success = false;
+            try {
+                double end = playing.back ().seconds;
+                struct timespec start;
+                clock_gettime (CLOCK_MONOTONIC, &start);
+                struct timespec next = start;
+                uint period = 0;
+                vector<double> positions;
+                while (not cancelled) {
+                    double seconds = (period * periodNanoseconds) / 1.0e9;
+                    evaluate (playing, interpolation, min (seconds, end), positions);
+                    emit (positions);
+                    if (seconds >= end) {
+                        success = true;
+                        break;
+                    }
+
+                    // wait for the next period boundary. if the update ran past it, skip ahead to
+                    // the first boundary still to come, rather than sending late and out of phase
+                    advance (next, periodNanoseconds);
+                    ++period;
+                    struct timespec now;
+                    clock_gettime (CLOCK_MONOTONIC, &now);
+                    long late = elapsed (next, now);
+                    if (late > 0) {
+                        uint skip = (late / periodNanoseconds) + 1;
+                        advance (next, skip * periodNanoseconds);
+                        period += skip;
+                        missedCount += skip;
+                    }
+                    while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &next, 0) != 0) {}
+                }
+            } catch (RuntimeError& runtimeError) {
+                Log::exception (runtimeError);
+                for (typename vector<DriverType*>::iterator iter = drivers.begin (); iter != drivers.end (); ++iter) {
+                    if ((*iter)->isFraming ()) {
+                        try {
+                            (*iter)->commit ();
+                        } catch (RuntimeError& commitError) {
+                            Log::exception (commitError);
+                        }
+                    }
+                }
+            }
+            Log::debug () << "ServoTrajectory: " << (success ? "finished" : "cancelled") << " after " << emitCount << " update" << ((emitCount != 1) ? "s" : "") << " (" << missedCount << " missed)" << endl;
+            active = false;
+            if (completion) {
+                completion (success);
+            }
+        }
+
+        void join () {
+            if (started and (not pthread_equal (thread, pthread_self ()))) {
+                pthread_join (thread, 0);
+                started = false;
+            }
+        }
+
+    public:
+        ServoTrajectory (const vector<PtrTo<Servo<DriverType> > >& _servos, ServoInterpolation _interpolation = ServoInterpolation::CUBIC) :
+            servos (_servos), interpolation (_interpolation), started (false), active (false), cancelled (false), emitCount (0), missedCount (0) {
+            if (servos.empty ()) {
+                throw RuntimeError (Text ("ServoTrajectory: ") << "no servos");
+            }
+            for (typename vector<PtrTo<Servo<DriverType> > >::iterator iter = servos.begin (); iter != servos.end (); ++iter) {
+                DriverType* driver = (*iter)->getDriver ();
+                if (find (drivers.begin (), drivers.end (), driver) == drivers.end ()) {
+                    drivers.push_back (driver);
+                }
+            }
+
+            // the servo drivers on a rig run at the same pulse frequency, the first sets the period
+            periodNanoseconds = (long) round (1.0e9 / drivers[0]->getPulseFrequency ());
+        }
+
+        ~ServoTrajectory () {
+            cancel ();
+        }
+
+        /**
+        * add a keyframe, the keyframes must be added in time order. if the first keyframe isn't at
+        * 0, play starts from wherever the servos are.
+        * @param seconds   - the time of the keyframe, from the start of play
+        * @param positions - a position (-1..1) for each of the servos, in the order they were given
+        * @return
+        */
+        ServoTrajectory<DriverType>* addKeyframe (double seconds, const vector<double>& positions) {
+            if (active) {
+                throw RuntimeError (Text ("ServoTrajectory: ") << "can't add keyframes while playing");
+            }
+            if (positions.size () != servos.size ()) {
+                throw RuntimeError (Text ("ServoTrajectory: ") << "keyframe has " << positions.size () << " positions for " << servos.size () << " servos");
+            }
+            if ((seconds < 0) or ((not keyframes.empty ()) and (seconds <= keyframes.back ().seconds))) {
+                throw RuntimeError (Text ("ServoTrajectory: ") << "keyframe at " << seconds << "s is out of order");
+            }
+            Keyframe keyframe;
+            keyframe.seconds = seconds;
+            keyframe.positions = positions;
+            keyframes.push_back (keyframe);
+            return this;
+        }
+
+        ServoTrajectory<DriverType>* clearKeyframes () {
+            if (active) {
+                throw RuntimeError (Text ("ServoTrajectory: ") << "can't clear keyframes while playing");
+            }
+            keyframes.clear ();
+            return this;
+        }
+
+        /**
+        * the positions of the servos at a time, as they would be sent
+        */
+        void getPositions (double seconds, vector<double>& positions) {
+            if (keyframes.empty ()) {
+                positions.clear ();
+                for (typename vector<PtrTo<Servo<DriverType> > >::iterator iter = servos.begin (); iter != servos.end (); ++iter) {
+                    positions.push_back ((*iter)->getPosition ());
+                }
+            } else {
+                evaluate (keyframes, interpolation, seconds, positions);
+            }
+        }
+
+        /**
+        * start playing the keyframes on a thread of the trajectory's own
+        * @param completion - called with true when the last keyframe has been sent, or false if the
+        *                     trajectory was cancelled or a driver failed
+        * @return false if the trajectory is already playing or has no keyframes
+        */
+        bool play (const ServoTrajectoryCompletion& _completion = nullptr) {
+            if (active or keyframes.empty ()) {
+                return false;
+            }
+            join ();
+
+            playing = keyframes;
+            if (playing[0].seconds > 0) {
+                Keyframe from;
+                from.seconds = 0;
+                for (typename vector<PtrTo<Servo<DriverType> > >::iterator iter = servos.begin (); iter != servos.end (); ++iter) {
+                    from.positions.push_back ((*iter)->getPosition ());
+                }
+                playing.insert (playing.begin (), from);
+            }
+            completion = _completion;
+            cancelled = false;
+            emitCount = 0;
+            missedCount = 0;
+            active = true;
+            if (pthread_create (&thread, 0, run, this) != 0) {
+                active = false;
+                Log::error () << "ServoTrajectory: " << "can't create thread" << endl;
+                return false;
+            }
+            started = true;
+            return true;
+        }
+
+        // as play, but the result is delivered through a future. if the play was rejected, the
+        // future is already resolved to false
+        future<bool> playFuture () {
+            shared_ptr<promise<bool> > result = make_shared<promise<bool> > ();
+            if (not play ([result] (bool success) { result->set_value (success); })) {
+                result->set_value (false);
+            }
+            return result->get_future ();
+        }
+
+        /**
+        * stop playing, leaving the servos wherever the last update put them. waits for the
+        * trajectory's thread to finish (unless called from the completion)
+        */
+        ServoTrajectory<DriverType>* cancel () {
+            cancelled = true;
+            join ();
+            return this;
+        }
+
+        bool isPlaying () {
+            return active;
+        }
+
+        // the number of updates sent by the last (or current) play
+        uint getEmitCount () {
+            return emitCount;
+        }
+
+        // the number of period boundaries skipped because an update ran late
+        uint getMissedCount () {
+            return missedCount;
+        }
+
+        double getPeriod () {
+            return periodNanoseconds / 1.0e9;
+        }
+};
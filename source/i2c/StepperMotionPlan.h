@@ -0,0 +1,198 @@
+#pragma once
+
+#include "Log.h"
+
+// the limits of a stepper motor's motion, in revolutions (per second, per second squared, etc.)
+struct StepperMotionLimits {
+    double maxVelocity;
+    double acceleration;
+
+    // 0 for a trapezoidal profile (the acceleration changes instantly), otherwise the profile is
+    // an S-curve with the acceleration changing no faster than this
+    double jerk;
+
+    StepperMotionLimits (double _maxVelocity, double _acceleration, double _jerk = 0) : maxVelocity (_maxVelocity), acceleration (_acceleration), jerk (_jerk) {}
+};
+
+// A stepper motion plan is a table of the intervals between the steps of a turn, computed before
+// the turn starts so the step loop only has to play it back. the table has one more entry than
+// there are steps: entry i is the wait before step i, and the last entry is the wait after the
+// last step (0 for the plans made here, the motor is done once the last step is taken). the plans
+// are symmetric - the end slows down the way the start speeds up - so a turn that is cancelled
+// can slow down by playing the end of the table.
+class StepperMotionPlan : public ReferenceCountedObject {
+    private:
+        double revolutions;
+        vector<uint64_t> intervals;
+
+        // the number of steps it takes to get up to speed
+        int rampSteps;
+        double peakVelocity;
+        double duration;
+
+        StepperMotionPlan (double _revolutions, int stepCount) : revolutions (_revolutions), intervals (stepCount + 1, 0), rampSteps (stepCount), peakVelocity (0), duration (0) {}
+
+        // the speeding up half of a jerk limited profile from rest to a velocity, where the
+        // acceleration ramps up to a peak (at most the acceleration limit), holds there, and ramps
+        // back down. a jerk of 0 makes the ramps instantaneous.
+        struct Ramp {
+            double velocity;
+            double jerk;
+            double peak;
+            double t1;
+            double t2;
+            double time;
+            double distance;
+
+            Ramp (double _velocity, double acceleration, double _jerk) : velocity (_velocity), jerk (_jerk) {
+                peak = (jerk > 0) ? min (acceleration, sqrt (velocity * jerk)) : acceleration;
+                t1 = (jerk > 0) ? (peak / jerk) : 0;
+                t2 = max ((velocity / peak) - t1, 0.0);
+                time = (2 * t1) + t2;
+
+                // the velocity curve is symmetric about its middle, so the average is half the peak
+                distance = velocity * time * 0.5;
+            }
+
+            double getPosition (double t) {
+                if (t < t1) {
+                    return (jerk * t * t * t) / 6.0;
+                }
+                if (t < (t1 + t2)) {
+                    double v1 = (jerk * t1 * t1) / 2.0;
+                    double tau = t - t1;
+                    return ((jerk * t1 * t1 * t1) / 6.0) + (v1 * tau) + ((peak * tau * tau) / 2.0);
+                }
+                double u = time - min (t, time);
+                return distance - (velocity * u) + ((jerk * u * u * u) / 6.0);
+            }
+        };
+
+    public:
+        // the original soft start, where the speed varies the delay between the steps linearly
+        // from 10 times the middle delay at the ends down to the middle, to take the given time
+        static PtrTo<StepperMotionPlan> getRamp (double revolutions, int stepCount, double time) {
+            StepperMotionPlan* plan = new StepperMotionPlan (revolutions, stepCount);
+
+            // we want to ramp the speed up and then back down to "soft start" the motor - giving us the
+            // ability to overcome the motor's inherent internal inertia. for instance, where range =
+            // 0.9, the varied speed will be (0.1 + (0.9 * x)) times the delay, where x will vary from 1
+            // to 0 and back to 1 over the set of steps we will make. to keep the total time correct, we
+            // compute the integral of the speed * time as the sum of the area of a box and a triangle.
+            double speedVaryingRange = 0.9;
+            double rangeTimeScale = 1.0 / ((1.0 - speedVaryingRange) + (0.5 * speedVaryingRange));
+
+            // time is in seconds, scale it up to nano-seconds, scale by the rangeTimeScale, and
+            // divide by the number of steps we will take to get the delay per step. the steps are
+            // timed against absolute deadlines, so the time spent writing to the bus doesn't have
+            // to be estimated and subtracted - it comes out of the wait for the next deadline.
+            double nanosecondsDelayPerStep = (stepCount > 0) ? ((rangeTimeScale * 1.0e9 * max (time, 0.0)) / stepCount) : 0;
+            double halfway = stepCount / 2.0;
+            uint64_t total = 0;
+            for (int i = 0; i < stepCount; ++i) {
+                double proportion = (1.0 - speedVaryingRange) + (speedVaryingRange * abs ((halfway - i) / halfway));
+                plan->intervals[i] = uint64_t (round (nanosecondsDelayPerStep * proportion));
+                total += plan->intervals[i];
+            }
+            plan->duration = total / 1.0e9;
+            Log::debug () << "StepperMotionPlan: " << stepCount << " steps (delay: " << (nanosecondsDelayPerStep / 1.0e3) << "us)" << endl;
+            return plan;
+        }
+
+        // a profile that speeds up at the acceleration limit (with the jerk limit, if there is
+        // one) to the velocity limit, cruises, and slows down the same way. short moves that can't
+        // reach the velocity limit peak at whatever velocity lets them stop in time.
+        static PtrTo<StepperMotionPlan> getProfile (double revolutions, int stepCount, double stepsPerRevolution, const StepperMotionLimits& limits) {
+            if ((limits.maxVelocity <= 0) or (limits.acceleration <= 0) or (limits.jerk < 0)) {
+                throw RuntimeError (Text ("StepperMotionPlan: ") << "invalid limits (velocity " << limits.maxVelocity << ", acceleration " << limits.acceleration << ", jerk " << limits.jerk << ")");
+            }
+            StepperMotionPlan* plan = new StepperMotionPlan (revolutions, stepCount);
+            if (stepCount == 0) {
+                return plan;
+            }
+
+            // everything in steps
+            double acceleration = limits.acceleration * stepsPerRevolution;
+            double jerk = limits.jerk * stepsPerRevolution;
+            Ramp ramp (limits.maxVelocity * stepsPerRevolution, acceleration, jerk);
+
+            // if speeding up and slowing down take more than the whole move, find the peak
+            // velocity that just fits
+            if ((ramp.distance * 2) > stepCount) {
+                double low = 0;
+                double high = ramp.velocity;
+                for (int i = 0; i < 60; ++i) {
+                    double middle = (low + high) * 0.5;
+                    if ((Ramp (middle, acceleration, jerk).distance * 2) > stepCount) {
+                        high = middle;
+                    } else {
+                        low = middle;
+                    }
+                }
+                ramp = Ramp (low, acceleration, jerk);
+            }
+            double cruise = (stepCount - (ramp.distance * 2)) / ramp.velocity;
+            double total = (ramp.time * 2) + cruise;
+
+            // the time each step is reached, found by bisection on the position
+            uint64_t previous = 0;
+            for (int i = 1; i <= stepCount; ++i) {
+                double t;
+                if (i == stepCount) {
+                    t = total;
+                } else {
+                    double low = 0;
+                    double high = total;
+                    for (int j = 0; j < 50; ++j) {
+                        double middle = (low + high) * 0.5;
+                        double position =
+                            (middle < ramp.time) ? ramp.getPosition (middle) :
+                            ((middle < (ramp.time + cruise)) ? (ramp.distance + (ramp.velocity * (middle - ramp.time))) :
+                            (stepCount - ramp.getPosition (total - middle)));
+                        if (position < i) {
+                            low = middle;
+                        } else {
+                            high = middle;
+                        }
+                    }
+                    t = high;
+                }
+                uint64_t at = uint64_t (round (t * 1.0e9));
+                plan->intervals[i - 1] = at - previous;
+                previous = at;
+            }
+            plan->rampSteps = int (ceil (ramp.distance));
+            plan->peakVelocity = ramp.velocity / stepsPerRevolution;
+            plan->duration = previous / 1.0e9;
+            Log::debug () << "StepperMotionPlan: " << stepCount << " steps in " << (plan->duration * 1.0e3) << "ms, peak " << plan->peakVelocity << " rev/s" << endl;
+            return plan;
+        }
+
+        double getRevolutions () {
+            return revolutions;
+        }
+
+        int getStepCount () {
+            return int (intervals.size ()) - 1;
+        }
+
+        // the wait before step i, or after the last step for i = step count, in nanoseconds
+        uint64_t getInterval (int i) {
+            return intervals[i];
+        }
+
+        int getRampSteps () {
+            return rampSteps;
+        }
+
+        // the fastest the plan moves, in revolutions per second (0 for a ramp, which is timed
+        // rather than limited)
+        double getPeakVelocity () {
+            return peakVelocity;
+        }
+
+        // how long the plan takes, in seconds
+        double getDuration () {
+            return duration;
+        }
+};
@@ -1,6 +1,13 @@
 #pragma once
 
 #include "Motor.h"
+#include "BusStatistics.h"
+#include "StepperMotionPlan.h"
+
+#include <algorithm>
+#include <atomic>
+#include <pthread.h>
+#include <time.h>
 
 // Stepper Motor
 //
@@ -13,13 +20,17 @@
 // this type of stepper is made using teeth internally that cause some number of detent positions
 // for the motor. most motors will specify the "step angle", which is the angle associated with
 // these detents in degrees (typical: 1.8 degrees)
+template<typename DriverType> class StepperTurn;
+
 template<typename DriverType>
 class StepperMotor : public ReferenceCountedObject {
     private:
-        // internal class for the values in a cycle
+        // internal class for the values in a cycle, with the driver's register bytes for them
+        // computed when the stepper is built, so a step doesn't convert anything
         struct CycleValue {
             double motorA;
             double motorB;
+            PreparedMotors prepared;
 
             CycleValue (double _motorA, double _motorB, bool _saturate) {
                 motorA = _saturate ? saturate (_motorA) : _motorA;
@@ -36,11 +47,15 @@ class StepperMotor : public ReferenceCountedObject {
         double stepAngle;
         int stepsPerRevolution;
         int current;
+        atomic<int> position;
+        atomic<bool> turning;
         vector<CycleValue> cycle;
 
+        friend class StepperTurn<DriverType>;
+
         StepperMotor (PtrTo<DriverType> _driver, Text _stepperType, MotorId _motorIdA, MotorId _motorIdB, double _stepAngle, int cycleLength, double startAngle, bool _saturate) :
             driver (_driver), stepperType (_stepperType), motorIdA(_motorIdA), motorIdB(_motorIdB),
-            stepAngle (_stepAngle), stepsPerRevolution (int (round (360.0 / stepAngle))), current (0) {
+            stepAngle (_stepAngle), stepsPerRevolution (int (round (360.0 / stepAngle))), current (0), position (0), turning (false) {
 
             // build the cycle table - basically it is a representation of a list of 2d coordinates
             // taken to be positions on the unit circle, and traversed in angle order
@@ -48,10 +63,13 @@ class StepperMotor : public ReferenceCountedObject {
             for (int i = 0; i < cycleLength; ++i) {
                 double angle = startAngle + (cycleAngle * i);
                 cycle.emplace_back (cos (angle), sin (angle), _saturate);
+                MotorId motorIds[] = { motorIdA, motorIdB };
+                double speeds[] = { cycle.back ().motorA, cycle.back ().motorB };
+                driver->prepareMotors (motorIds, speeds, 2, cycle.back ().prepared);
             }
     
             Log::info () << "StepperMotor:  " << getDescription () << ", with " << stepsPerRevolution << " steps per revolution" << endl;
-    
+
             // and now... energize the coils at the start of the cycle
             step (0);
         }
@@ -59,12 +77,11 @@ class StepperMotor : public ReferenceCountedObject {
         void step (int direction) {
             // add the direction for the step, and ensure the new index is in the valid region
             current += direction;
+            position += direction;
             int cycleSize = cycle.size ();
             do { current = (current + cycleSize) % cycleSize; } while (current < 0);
             Log::trace () << "StepperMotor: " << "current: " << current << ", A (" << cycle[current].motorA << "), B (" << cycle[current].motorB << ")" << endl;
-            driver
-                ->runMotor (motorIdA, cycle[current].motorA)
-                ->runMotor (motorIdB, cycle[current].motorB);
+            driver->runPreparedMotors (cycle[current].prepared);
         }
     
 
@@ -126,51 +143,85 @@ class StepperMotor : public ReferenceCountedObject {
     }
 
     StepperMotor<DriverType>* turn (double revolutions, double time) {
-        // XXX TODO this should be (optionally) threaded in the future
-
-        // stepsPerRevolution is an artifical number based on the number of discrete positions of
-        // the two energizing coils with the full step model - so we have to compensate if we use a
-        // different cycle length. the number of full cycles through the stepsPerRevolution is given
-        // by: stepsPerRevolution / 4. one is led to believe that all steppers have a
-        // stepsPerRevolution that is evenly divisible by 4.
-        int stepCount = int (round (abs (revolutions) * (((cycle.size () * stepsPerRevolution) / 4.0) + 1.0)));
-        int direction = int (signum (revolutions));
-        double halfway = stepCount / 2.0;
-
-        // account for the delay time of going through this loop - assume 3us per iteration for
-        // giggles - though empirical testing indicates the number is more in the 12-13 milliseconds
-        // range. Maybe raspberry pi isn't the right platform to do this type of control? or maybe
-        // the adafruit hat has too much communication overhead? or maybe Pi4J is based on a milli-
-        // second time model, instead of a micro-second time model.
-        double overheadTime = stepCount * 3;
-
-        // we want to ramp the speed up and then back down to "soft start" the motor - giving us the
-        // ability to overcome the motor's inherent internal inertia. for instance, where range =
-        // 0.9, the varied speed will be (0.1 + (0.9 * x)) times the delay, where x will vary from 1
-        // to 0 and back to 1 over the set of steps we will make. to keep the total time correct, we
-        // compute the integral of the speed * time as the sum of the area of a box and a triangle.
-        double speedVaryingRange = 0.9;
-        double rangeTimeScale = 1.0 / ((1.0 - speedVaryingRange) + (0.5 * speedVaryingRange));
-
-        // time is in seconds, scale it up to micro-seconds, scale by the rangeTimeScale, then
-        // subtract the expected overhead. finally, divide by the number of steps we will take to
-        // get the delay per step, rounded to the nearest integral microsecond.
-        double microsecondsDelay = (rangeTimeScale * 1000000.0 * time) - overheadTime;
-        int microsecondsDelayPerStep = max (int (round (microsecondsDelay / stepCount)), 0);
-        Log::debug () << "StepperMotor: " << stepCount << " steps (direction: " << direction << ", delay: " << microsecondsDelayPerStep << ")" << endl;
-
-        // loop over all the steps...
-        //long timeSum = 0;
-        for (int i = 0; i < stepCount; ++i) {
-            //long startTime = System.nanoTime ();
-            step (direction);
-            double proportion = (1.0 - speedVaryingRange) + (speedVaryingRange * abs ((halfway - i) / halfway));
-            int delay = int (round (microsecondsDelayPerStep * proportion));
-            //log.debug ("delay: " + delay + "us");
-            //timeSum += System.nanoTime () - startTime;
-            Pause::micro (delay);
-        }
-        //Log::debug() << "StepperMotor: " << "Average overhead: " << (timeSum / stepCount) << "ns" << endl;
+        return turn (planTurn (revolutions, time));
+    }
+
+    // the same steps as an asynchronous turn, but on the calling thread
+    StepperMotor<DriverType>* turn (PtrTo<StepperMotionPlan> plan) {
+        StepperTurn<DriverType> stepperTurn (this, plan);
+        stepperTurn.claim ();
+        stepperTurn.run ();
+        return this;
+    }
+
+    // start a turn on a step generator thread of its own, and return right away. the handle can
+    // be waited on, polled, or cancelled. only one turn can be in progress on a stepper at a time,
+    // and while it is, the motors on the stepper's driver should not be used from other threads.
+    PtrTo<StepperTurn<DriverType> > turnAsync (double revolutions, double time = 0) {
+        return turnAsync (planTurn (revolutions, time));
+    }
+
+    PtrTo<StepperTurn<DriverType> > turnAsync (PtrTo<StepperMotionPlan> plan) {
+        PtrTo<StepperTurn<DriverType> > stepperTurn = new StepperTurn<DriverType> (this, plan);
+        stepperTurn->start ();
+        return stepperTurn;
+    }
+
+    // plan a turn with the original soft start ramp, taking the given time (0 is as fast as
+    // possible)
+    PtrTo<StepperMotionPlan> planTurn (double revolutions, double time) {
+        return StepperMotionPlan::getRamp (revolutions, getStepCount (revolutions), time);
+    }
+
+    // plan a turn that runs the motor at its limits. the plan knows how long the turn will take
+    // before it starts (getDuration), and can be played back any number of times.
+    PtrTo<StepperMotionPlan> planTurn (double revolutions, const StepperMotionLimits& limits) {
+        return StepperMotionPlan::getProfile (revolutions, getStepCount (revolutions), getStepsPerCycleRevolution (), limits);
+    }
+
+    // plan a number of steps (signed), with the original soft start ramp
+    PtrTo<StepperMotionPlan> planSteps (int steps, double time) {
+        return StepperMotionPlan::getRamp (steps / getStepsPerCycleRevolution (), abs (steps), time);
+    }
+
+    // plan a number of steps (signed) that runs the motor at its limits
+    PtrTo<StepperMotionPlan> planSteps (int steps, const StepperMotionLimits& limits) {
+        return StepperMotionPlan::getProfile (steps / getStepsPerCycleRevolution (), abs (steps), getStepsPerCycleRevolution (), limits);
+    }
+
+    // turn several steppers together, each by its own number of steps (signed, forward is
+    // positive). the axis with the most steps follows the plan, which should be made for that
+    // many steps, and the others step in between its steps (Bresenham style), so all the axes
+    // start and finish together and move in proportion the whole way. the steps that fall on the
+    // same tick go out as one frame on each driver, so two steppers on one motor hat are updated
+    // in a single transaction. the handle's cancel slows all the axes down together.
+    static PtrTo<StepperTurn<DriverType> > turnTogetherAsync (const vector<PtrTo<StepperMotor<DriverType> > >& steppers, const vector<int>& steps, PtrTo<StepperMotionPlan> plan) {
+        PtrTo<StepperTurn<DriverType> > stepperTurn = new StepperTurn<DriverType> (steppers, steps, plan);
+        stepperTurn->start ();
+        return stepperTurn;
+    }
+
+    // as turnTogetherAsync, but on the calling thread
+    static void turnTogether (const vector<PtrTo<StepperMotor<DriverType> > >& steppers, const vector<int>& steps, PtrTo<StepperMotionPlan> plan) {
+        StepperTurn<DriverType> stepperTurn (steppers, steps, plan);
+        stepperTurn.claim ();
+        stepperTurn.run ();
+    }
+
+    bool isTurning () {
+        return turning;
+    }
+
+    // the number of steps taken from the start position, forward steps are positive
+    int getPosition () {
+        return position;
+    }
+
+    // the priority class of the traffic to the driver. a late coil update is a missed step, so a
+    // stepper that has to keep time should be REALTIME, but the driver (and its priority) is
+    // shared with any other motors on it, so the stepper leaves it alone unless asked
+    StepperMotor<DriverType>* setPriority (BusPriority priority) {
+        driver->setPriority (priority);
         return this;
     }
 
@@ -180,6 +231,20 @@ class StepperMotor : public ReferenceCountedObject {
         return this;
     }
 
+    // stepsPerRevolution is an artifical number based on the number of discrete positions of
+    // the two energizing coils with the full step model - so we have to compensate if we use a
+    // different cycle length. the number of full cycles through the stepsPerRevolution is given
+    // by: stepsPerRevolution / 4. one is led to believe that all steppers have a
+    // stepsPerRevolution that is evenly divisible by 4.
+    double getStepsPerCycleRevolution () {
+        return (cycle.size () * stepsPerRevolution) / 4.0;
+    }
+
+    // the steps in a turn, every planner converts revolutions to steps here
+    int getStepCount (double revolutions) {
+        return int (round (abs (revolutions) * getStepsPerCycleRevolution ()));
+    }
+
     double getResolution () {
         return (stepAngle * 4.0) / cycle.size ();
     }
@@ -188,3 +253,277 @@ class StepperMotor : public ReferenceCountedObject {
         return stepperType << "-step, cycle-length (per 4 steps): " << cycle.size () << ", resolution: " << getResolution () << " degrees/step";
     }
 };
+
+// A turn of one or more stepper motors, as a handle, playing back a motion plan. A turn runs
+// either on the calling thread (StepperMotor::turn), or on a step generator thread of its own
+// (StepperMotor::turnAsync).
+template<typename DriverType>
+class StepperTurn : public ReferenceCountedObject {
+    private:
+        // a stepper in the turn. the plan ticks once per step of the longest axis, and each axis
+        // adds its step count to its error every tick, taking a step each time the error passes
+        // the plan's step count
+        struct Axis {
+            PtrTo<StepperMotor<DriverType> > stepper;
+            int direction;
+            int steps;
+            int error;
+        };
+
+        vector<Axis> axes;
+        vector<DriverType*> drivers;
+        PtrTo<StepperMotionPlan> plan;
+        int stepCount;
+
+        // measured as the turn runs
+        atomic<uint64_t> stepWriteNanoseconds;
+        atomic<uint64_t> elapsedNanoseconds;
+
+        // the step the turn will end at, moved closer if the turn is cancelled
+        atomic<int> stopAt;
+        atomic<int> stepsTaken;
+        atomic<bool> cancelled;
+
+        pthread_mutex_t mutex;
+        pthread_cond_t finished;
+        bool done;
+
+        friend class StepperMotor<DriverType>;
+
+        static void* runThread (void* context) {
+            // the thread holds a reference, so the handle can be dropped while the turn runs
+            PtrTo<StepperTurn<DriverType> >* stepperTurn = static_cast<PtrTo<StepperTurn<DriverType> >*> (context);
+            try {
+                (*stepperTurn)->run ();
+            } catch (RuntimeError& runtimeError) {
+                Log::exception (runtimeError);
+            }
+            delete stepperTurn;
+            return 0;
+        }
+
+        // sleeping wakes up late by a scheduling quantum or so, so the sleep ends this far short of
+        // the deadline and the rest is spent spinning on the clock
+        enum { SPIN_NANOSECONDS = 50000 };
+
+        static void waitUntil (uint64_t deadline) {
+            uint64_t now = BusStatistics::now ();
+            if ((now + SPIN_NANOSECONDS) < deadline) {
+                struct timespec wake;
+                wake.tv_sec = (deadline - SPIN_NANOSECONDS) / 1000000000;
+                wake.tv_nsec = (deadline - SPIN_NANOSECONDS) % 1000000000;
+                while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, 0) != 0) {}
+            }
+            while (BusStatistics::now () < deadline) {}
+        }
+
+        void addAxis (StepperMotor<DriverType>* stepper, int steps) {
+            Axis axis;
+            axis.stepper = stepper;
+            axis.direction = signum (steps);
+            axis.steps = abs (steps);
+            axis.error = stepCount / 2;
+            axes.push_back (axis);
+            DriverType* driver = stepper->driver.getPtr ();
+            if (find (drivers.begin (), drivers.end (), driver) == drivers.end ()) {
+                drivers.push_back (driver);
+            }
+        }
+
+        StepperTurn (StepperMotor<DriverType>* stepper, PtrTo<StepperMotionPlan> _plan) :
+            plan (_plan), stepCount (plan->getStepCount ()),
+            stepWriteNanoseconds (0), elapsedNanoseconds (0), stopAt (stepCount), stepsTaken (0), cancelled (false), done (false) {
+            addAxis (stepper, stepCount * signum (plan->getRevolutions ()));
+            pthread_mutex_init (&mutex, 0);
+            pthread_cond_init (&finished, 0);
+        }
+
+        StepperTurn (const vector<PtrTo<StepperMotor<DriverType> > >& steppers, const vector<int>& steps, PtrTo<StepperMotionPlan> _plan) :
+            plan (_plan), stepCount (plan->getStepCount ()),
+            stepWriteNanoseconds (0), elapsedNanoseconds (0), stopAt (stepCount), stepsTaken (0), cancelled (false), done (false) {
+            if (steppers.size () != steps.size ()) {
+                throw RuntimeError (Text ("StepperTurn: ") << steps.size () << " step counts for " << steppers.size () << " steppers");
+            }
+            int longest = 0;
+            for (uint i = 0; i < steppers.size (); ++i) {
+                longest = max (longest, abs (steps[i]));
+            }
+            if (longest != stepCount) {
+                throw RuntimeError (Text ("StepperTurn: ") << "plan has " << stepCount << " steps, the longest axis has " << longest);
+            }
+            for (uint i = 0; i < steppers.size (); ++i) {
+                addAxis (steppers[i].getPtr (), steps[i]);
+            }
+            pthread_mutex_init (&mutex, 0);
+            pthread_cond_init (&finished, 0);
+        }
+
+        void claim () {
+            for (uint i = 0; i < axes.size (); ++i) {
+                if (axes[i].stepper->turning.exchange (true)) {
+                    // let go of the ones already claimed
+                    while (i > 0) {
+                        axes[--i].stepper->turning = false;
+                    }
+                    throw RuntimeError (Text ("StepperTurn: ") << "a turn is already in progress");
+                }
+            }
+        }
+
+        void release () {
+            for (typename vector<Axis>::iterator iter = axes.begin (); iter != axes.end (); ++iter) {
+                iter->stepper->turning = false;
+            }
+        }
+
+        // step the axes that are due on a tick, in one frame per driver, so both coils of every
+        // stepper on a driver change in the same transaction
+        void tick () {
+            for (typename vector<DriverType*>::iterator iter = drivers.begin (); iter != drivers.end (); ++iter) {
+                (*iter)->beginFrame ();
+            }
+            for (typename vector<Axis>::iterator iter = axes.begin (); iter != axes.end (); ++iter) {
+                iter->error += iter->steps;
+                if (iter->error >= stepCount) {
+                    iter->error -= stepCount;
+                    iter->stepper->step (iter->direction);
+                }
+            }
+            for (typename vector<DriverType*>::iterator iter = drivers.begin (); iter != drivers.end (); ++iter) {
+                (*iter)->commit ();
+            }
+        }
+
+        void start () {
+            claim ();
+            PtrTo<StepperTurn<DriverType> >* context = new PtrTo<StepperTurn<DriverType> > (this);
+            pthread_t thread;
+            if (pthread_create (&thread, 0, runThread, context) != 0) {
+                delete context;
+                release ();
+                throw RuntimeError (Text ("StepperTurn: ") << "can't create thread");
+            }
+            pthread_detach (thread);
+        }
+
+        void run () {
+            try {
+                // each step has a deadline, the sum of the intervals before it from the start of
+                // the turn, so lateness in one step doesn't push the rest of the turn back. the
+                // write for a step is started early by the measured time a write takes, so the
+                // coils change on the deadline rather than after it
+                uint64_t start = BusStatistics::now ();
+                uint64_t deadline = start;
+                for (int i = 0; i < stopAt; ++i) {
+                    // once cancelled, the intervals are taken from the end of the plan, slowing
+                    // down from wherever the turn had gotten to
+                    deadline += plan->getInterval (cancelled ? (stepCount - (stopAt - i)) : i);
+                    waitUntil (deadline - min (uint64_t (stepWriteNanoseconds), deadline - start));
+
+                    uint64_t writeStart = BusStatistics::now ();
+                    tick ();
+                    uint64_t writeTime = BusStatistics::now () - writeStart;
+                    stepWriteNanoseconds = (stepsTaken == 0) ? writeTime : (((stepWriteNanoseconds * 7) + writeTime) / 8);
+                    ++stepsTaken;
+                }
+                deadline += plan->getInterval (stepCount);
+                waitUntil (deadline);
+                elapsedNanoseconds = BusStatistics::now () - start;
+                Log::debug () << "StepperTurn: " << stepsTaken << " steps in " << (elapsedNanoseconds / 1.0e6) << "ms (planned " << (plan->getDuration () * 1.0e3) << "ms), step write " << (stepWriteNanoseconds / 1.0e3) << "us" << endl;
+            } catch (...) {
+                for (typename vector<DriverType*>::iterator iter = drivers.begin (); iter != drivers.end (); ++iter) {
+                    if ((*iter)->isFraming ()) {
+                        try {
+                            (*iter)->commit ();
+                        } catch (RuntimeError& commitError) {
+                            Log::exception (commitError);
+                        }
+                    }
+                }
+                finish ();
+                throw;
+            }
+            finish ();
+        }
+
+        void finish () {
+            release ();
+            pthread_mutex_lock (&mutex);
+            done = true;
+            pthread_cond_broadcast (&finished);
+            pthread_mutex_unlock (&mutex);
+        }
+
+    public:
+        ~StepperTurn () {
+            pthread_cond_destroy (&finished);
+            pthread_mutex_destroy (&mutex);
+        }
+
+        // block until the turn is done (finished or stopped after a cancel)
+        StepperTurn<DriverType>* wait () {
+            pthread_mutex_lock (&mutex);
+            while (not done) {
+                pthread_cond_wait (&finished, &mutex);
+            }
+            pthread_mutex_unlock (&mutex);
+            return this;
+        }
+
+        bool isDone () {
+            pthread_mutex_lock (&mutex);
+            bool result = done;
+            pthread_mutex_unlock (&mutex);
+            return result;
+        }
+
+        // stop the turn early, slowing back down over as many steps as it took to get up to the
+        // current speed (or the steps left, if that is fewer). with no time between the steps
+        // there is no ramp to retrace, and the turn stops at the next step. call wait to know
+        // when the motor has stopped.
+        StepperTurn<DriverType>* cancel () {
+            if (not cancelled.exchange (true)) {
+                int taken = stepsTaken;
+                int slowdown = (plan->getDuration () > 0) ? min (min (taken, plan->getRampSteps ()), stepCount - taken) : 0;
+                stopAt = min (int (stopAt), taken + slowdown);
+                Log::debug () << "StepperTurn: " << "cancel at step " << taken << ", stopping at " << stopAt << endl;
+            }
+            return this;
+        }
+
+        bool isCancelled () {
+            return cancelled;
+        }
+
+        int getStepsTaken () {
+            return stepsTaken;
+        }
+
+        int getStepCount () {
+            return stopAt;
+        }
+
+        // the time the turn was planned to take, in seconds
+        double getRequestedTime () {
+            return plan->getDuration ();
+        }
+
+        PtrTo<StepperMotionPlan> getPlan () {
+            return plan;
+        }
+
+        // the time the turn actually took, in seconds, once it is done
+        double getElapsedTime () {
+            return elapsedNanoseconds / 1.0e9;
+        }
+
+        // the average time to write a step to the driver, in seconds
+        double getStepWriteTime () {
+            return stepWriteNanoseconds / 1.0e9;
+        }
+
+        // how far the turn has gotten, in revolutions of the longest axis (signed like the plan)
+        double getRevolutions () {
+            return (stepCount > 0) ? ((plan->getRevolutions () * stepsTaken) / stepCount) : 0;
+        }
+};
@@ -0,0 +1,152 @@
+#pragma once
+
+#include "Bus.h"
+
+// a transaction collects raw I2C messages - writes, and write-then-read pairs - for any number of
+// devices on the same bus, and submits them to the bus as a single combined transfer (I2C_RDWR).
+// the messages are separated by repeated starts, so the whole transaction costs one system call
+// and one trip through the bus lock, and the bus sees only one STOP, at the very end. it's a
+// plain value type (no reference counting), so it can be built on the stack and copied into queues.
+
+const int TRANSACTION_MESSAGE_COUNT = I2C_RDWR_IOCTL_MAX_MSGS;
+const int TRANSACTION_BUFFER_SIZE = 512;
+
+class Transaction {
+    protected:
+        // messages are kept as offsets into the buffer, so a transaction can be copied freely and
+        // the kernel messages are built only when it is submitted
+        struct Message {
+            u2 address;
+            u2 flags;
+            u2 length;
+            u2 offset;
+            bool registerWrite;
+        };
+
+        Message messages[TRANSACTION_MESSAGE_COUNT];
+        uint messageCount;
+        byte buffer[TRANSACTION_BUFFER_SIZE];
+        uint bufferLength;
+
+        byte* addMessage (uint address, u2 flags, uint length, bool registerWrite = false) {
+            if (messageCount >= TRANSACTION_MESSAGE_COUNT) {
+                throw RuntimeError (Text ("Transaction: ") << "out of messages.");
+            }
+            if ((bufferLength + length) > TRANSACTION_BUFFER_SIZE) {
+                throw RuntimeError (Text ("Transaction: ") << "out of buffer.");
+            }
+            Message& message = messages[messageCount++];
+            message.address = address;
+            message.flags = flags;
+            message.length = length;
+            message.offset = bufferLength;
+            message.registerWrite = registerWrite;
+            byte* data = &buffer[bufferLength];
+            bufferLength += length;
+            return data;
+        }
+
+    public:
+        Transaction () : messageCount (0), bufferLength (0) {}
+
+        ~Transaction () {}
+
+        // write raw bytes to a device
+        Transaction* write (uint address, const byte* data, uint count) {
+            byte* out = addMessage (address, 0, count);
+            for (uint i = 0; i < count; ++i) {
+                out[i] = data[i];
+            }
+            return this;
+        }
+
+        // write a run of consecutive registers (the device must auto-increment its register
+        // pointer). a run that continues the previous register write to the same device is merged
+        // into it, so building a transaction one register at a time still sends one message.
+        Transaction* writeAt (uint address, byte at, const byte* values, uint count) {
+            if (messageCount > 0) {
+                Message& last = messages[messageCount - 1];
+                if (last.registerWrite and (last.address == address) and
+                    ((last.offset + last.length) == bufferLength) and
+                    ((buffer[last.offset] + last.length - 1) == at) and
+                    ((bufferLength + count) <= TRANSACTION_BUFFER_SIZE)) {
+                    for (uint i = 0; i < count; ++i) {
+                        buffer[bufferLength++] = values[i];
+                    }
+                    last.length += count;
+                    return this;
+                }
+            }
+            byte* out = addMessage (address, 0, count + 1, true);
+            out[0] = at;
+            for (uint i = 0; i < count; ++i) {
+                out[i + 1] = values[i];
+            }
+            return this;
+        }
+
+        Transaction* writeAt (uint address, byte at, byte value) {
+            return writeAt (address, at, &value, 1);
+        }
+
+        // write the register address, then read count bytes back from the device starting there.
+        // the return value identifies the read when fetching results after the submit.
+        uint readAt (uint address, byte at, uint count) {
+            write (address, &at, 1);
+            addMessage (address, I2C_M_RD, count);
+            return messageCount - 1;
+        }
+
+        // send the whole transaction in one transfer
+        Transaction* submit (PtrToBus bus, BusPriority priority = BusPriority::BACKGROUND) {
+            if (messageCount > 0) {
+                struct i2c_msg kernelMessages[TRANSACTION_MESSAGE_COUNT];
+                for (uint i = 0; i < messageCount; ++i) {
+                    Message& message = messages[i];
+                    kernelMessages[i].addr = message.address;
+                    kernelMessages[i].flags = message.flags;
+                    kernelMessages[i].len = message.length;
+                    kernelMessages[i].buf = &buffer[message.offset];
+                }
+                bus->transfer (kernelMessages, messageCount, priority);
+                Log::trace () << "Transaction: " << "submit " << messageCount << " message" << ((messageCount != 1) ? "s" : "") << " (" << bufferLength << " bytes)" << endl;
+            }
+            return this;
+        }
+
+        // fetch the results of a read after the transaction was submitted
+        const byte* getRead (uint read) {
+            if ((read >= messageCount) or ((messages[read].flags & I2C_M_RD) == 0)) {
+                throw RuntimeError (Text ("Transaction: ") << "invalid read (" << read << ")");
+            }
+            return &buffer[messages[read].offset];
+        }
+
+        byte getRead (uint read, uint offset) {
+            const byte* data = getRead (read);
+            if (offset >= messages[read].length) {
+                throw RuntimeError (Text ("Transaction: ") << "read offset out of range (" << offset << ")");
+            }
+            return data[offset];
+        }
+
+        // clear the transaction so it can be built again
+        Transaction* reset () {
+            messageCount = 0;
+            bufferLength = 0;
+            return this;
+        }
+
+        uint getMessageCount () {
+            return messageCount;
+        }
+
+        uint getByteCount () {
+            return bufferLength;
+        }
+
+        // true if there is room for another message of the given length
+        bool hasRoom (uint length) {
+            return (messageCount < TRANSACTION_MESSAGE_COUNT) and ((bufferLength + length) <= TRANSACTION_BUFFER_SIZE);
+        }
+};